@@ -0,0 +1,260 @@
+#include "acpi.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include "libc/mem.h"
+#include "mm/vm.h"
+#include "paging.h"
+#include <stddef.h>
+
+// The RSDP is in the first KiB of the EBDA, whose segment the BIOS keeps at
+// 0x40e, or on a 16 byte boundary in the BIOS ROM area.
+#define EBDA_SEGMENT 0x40e
+#define BIOS_AREA_START 0xe0000
+#define BIOS_AREA_END 0x100000
+
+#define MADT_LAPIC 0
+#define MADT_IOAPIC 1
+#define MADT_OVERRIDE 2
+#define MADT_LAPIC_NMI 4
+#define MADT_LAPIC_ADDRESS 5
+
+#define MADT_PCAT_COMPAT (1 << 0)
+#define MADT_CPU_ENABLED (1 << 0)
+// Polarity and trigger mode in the flags of an override. 0 conforms to the
+// bus, which is active high and edge triggered for ISA.
+#define MPS_POLARITY_MASK 0x3
+#define MPS_ACTIVE_LOW 0x3
+#define MPS_TRIGGER_MASK 0xc
+#define MPS_LEVEL 0xc
+
+typedef struct rsdp_t {
+  char signature[8];
+  uint8_t checksum;
+  char oem[6];
+  uint8_t revision;
+  uint32_t rsdt;
+  // From revision 2 on.
+  uint32_t length;
+  uint64_t xsdt;
+  uint8_t extended_checksum;
+  uint8_t reserved[3];
+} __attribute__((packed)) rsdp_t;
+
+typedef struct sdt_header_t {
+  char signature[4];
+  uint32_t length;
+  uint8_t revision;
+  uint8_t checksum;
+  char oem[6];
+  char oem_table[8];
+  uint32_t oem_revision;
+  uint32_t creator;
+  uint32_t creator_revision;
+} __attribute__((packed)) sdt_header_t;
+
+typedef struct madt_header_t {
+  sdt_header_t header;
+  uint32_t lapic_address;
+  uint32_t flags;
+} __attribute__((packed)) madt_header_t;
+
+typedef struct madt_entry_t {
+  uint8_t type;
+  uint8_t length;
+  union {
+    struct {
+      uint8_t acpi_id;
+      uint8_t apic_id;
+      uint32_t flags;
+    } __attribute__((packed)) lapic;
+    struct {
+      uint8_t id;
+      uint8_t reserved;
+      uint32_t address;
+      uint32_t gsi_base;
+    } __attribute__((packed)) ioapic;
+    struct {
+      uint8_t bus;
+      uint8_t irq;
+      uint32_t gsi;
+      uint16_t flags;
+    } __attribute__((packed)) override;
+    struct {
+      uint8_t acpi_id;
+      uint16_t flags;
+      uint8_t lint;
+    } __attribute__((packed)) nmi;
+    struct {
+      uint16_t reserved;
+      uint64_t address;
+    } __attribute__((packed)) lapic_address;
+  };
+} __attribute__((packed)) madt_entry_t;
+
+static acpi_madt_t madt;
+static bool found;
+
+static bool checksum(const void *p, uint32_t length) {
+  uint8_t sum = 0;
+  for (uint32_t i = 0; i < length; i++) {
+    sum += ((const uint8_t *)p)[i];
+  }
+  return sum == 0;
+}
+
+// Tables usually are in RAM the direct map covers, the rest get a mapping of
+// their own, which is kept.
+static const void *map(uint32_t physical, uint32_t size) {
+  pde_t *directory = paging_kernel_directory();
+  if (physical < DIRECT_MAP_SIZE && size <= DIRECT_MAP_SIZE - physical &&
+      paging_translate(directory, (uint32_t)P2V(physical), NULL, NULL) &&
+      paging_translate(directory, (uint32_t)P2V(physical + size - 1), NULL, NULL)) {
+    return P2V(physical);
+  }
+  return vm_map_device(physical, size, MEMTYPE_WB);
+}
+
+// The table at `physical`, checked, or NULL.
+static const sdt_header_t *map_table(uint32_t physical) {
+  const sdt_header_t *header = map(physical, sizeof(sdt_header_t));
+  if (header == NULL) {
+    return NULL;
+  }
+  const sdt_header_t *table = map(physical, header->length);
+  if (table == NULL || !checksum(table, table->length)) {
+    return NULL;
+  }
+  return table;
+}
+
+static const rsdp_t *scan(uint32_t start, uint32_t end) {
+  for (uint32_t address = start; address + sizeof(rsdp_t) <= end; address += 16) {
+    const rsdp_t *rsdp = P2V(address);
+    if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && checksum(rsdp, 20)) {
+      return rsdp;
+    }
+  }
+  return NULL;
+}
+
+static const rsdp_t *find_rsdp(void) {
+  uint32_t ebda = *(const uint16_t *)P2V(EBDA_SEGMENT) << 4;
+  const rsdp_t *rsdp = NULL;
+  if (ebda >= 0x80000 && ebda < 0xa0000) {
+    rsdp = scan(ebda, ebda + 1024);
+  }
+  return rsdp != NULL ? rsdp : scan(BIOS_AREA_START, BIOS_AREA_END);
+}
+
+// The table with `signature` listed by the RSDT or XSDT.
+static const sdt_header_t *find_table(const rsdp_t *rsdp, const char *signature) {
+  bool xsdt = rsdp->revision >= 2 && rsdp->xsdt != 0 && rsdp->xsdt >> 32 == 0;
+  const sdt_header_t *root = map_table(xsdt ? (uint32_t)rsdp->xsdt : rsdp->rsdt);
+  if (root == NULL) {
+    return NULL;
+  }
+  uint32_t entry_size = xsdt ? 8 : 4;
+  uint32_t n = (root->length - sizeof(sdt_header_t)) / entry_size;
+  const uint8_t *entries = (const uint8_t *)(root + 1);
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t address = xsdt ? *(const uint64_t *)&entries[i * 8] : *(const uint32_t *)&entries[i * 4];
+    if (address >> 32 != 0) {
+      continue;
+    }
+    const sdt_header_t *table = map_table(address);
+    if (table != NULL && memcmp(table->signature, signature, 4) == 0) {
+      return table;
+    }
+  }
+  return NULL;
+}
+
+static void parse_madt(const madt_header_t *header) {
+  madt.lapic_address = header->lapic_address;
+  madt.pic = header->flags & MADT_PCAT_COMPAT;
+  madt.nmi_lint = ACPI_NO_LINT;
+  for (uint32_t irq = 0; irq < ACPI_ISA_IRQS; irq++) {
+    madt.isa[irq] = (acpi_isa_irq_t){.gsi = irq, .active_low = false, .level = false};
+  }
+
+  const uint8_t *p = (const uint8_t *)(header + 1);
+  const uint8_t *end = (const uint8_t *)header + header->header.length;
+  while (p + 2 <= end) {
+    const madt_entry_t *entry = (const madt_entry_t *)p;
+    if (entry->length < 2 || p + entry->length > end) {
+      break;
+    }
+    switch (entry->type) {
+    case MADT_LAPIC:
+      if (entry->lapic.flags & MADT_CPU_ENABLED && madt.n_cpus < ACPI_MAX_CPUS) {
+        madt.cpus[madt.n_cpus++] = (acpi_cpu_t){.apic_id = entry->lapic.apic_id, .acpi_id = entry->lapic.acpi_id};
+      }
+      break;
+    case MADT_IOAPIC:
+      if (madt.n_ioapics < ACPI_MAX_IOAPICS) {
+        madt.ioapics[madt.n_ioapics++] = (acpi_ioapic_t){
+            .id = entry->ioapic.id, .address = entry->ioapic.address, .gsi_base = entry->ioapic.gsi_base};
+      }
+      break;
+    case MADT_OVERRIDE:
+      if (entry->override.bus == 0 && entry->override.irq < ACPI_ISA_IRQS) {
+        uint16_t flags = entry->override.flags;
+        madt.isa[entry->override.irq] = (acpi_isa_irq_t){
+            .gsi = entry->override.gsi,
+            .active_low = (flags & MPS_POLARITY_MASK) == MPS_ACTIVE_LOW,
+            .level = (flags & MPS_TRIGGER_MASK) == MPS_LEVEL,
+        };
+      }
+      break;
+    case MADT_LAPIC_NMI:
+      madt.nmi_lint = entry->nmi.lint;
+      break;
+    case MADT_LAPIC_ADDRESS:
+      if (entry->lapic_address.address >> 32 == 0) {
+        madt.lapic_address = entry->lapic_address.address;
+      }
+      break;
+    }
+    p += entry->length;
+  }
+}
+
+bool acpi_init(void) {
+  const rsdp_t *rsdp = find_rsdp();
+  if (rsdp == NULL) {
+    TRACE("ACPI", 1, "%s", "no RSDP");
+    return false;
+  }
+  const sdt_header_t *table = find_table(rsdp, "APIC");
+  if (table == NULL) {
+    TRACE("ACPI", 2, "%s", "no MADT");
+    return false;
+  }
+  parse_madt((const madt_header_t *)table);
+  found = true;
+  TRACE("ACPI", 3, "%d cpus, %d io apics", madt.n_cpus, madt.n_ioapics);
+  return true;
+}
+
+const acpi_madt_t *acpi_madt(void) { return found ? &madt : NULL; }
+
+void acpi_dump(void) {
+  if (!found) {
+    kprintf("acpi: no MADT\n");
+    return;
+  }
+  kprintf("local apic at %x, %s\n", madt.lapic_address, madt.pic ? "with PICs" : "no PICs");
+  for (uint32_t i = 0; i < madt.n_cpus; i++) {
+    kprintf("cpu %u: apic id %u\n", madt.cpus[i].acpi_id, madt.cpus[i].apic_id);
+  }
+  for (uint32_t i = 0; i < madt.n_ioapics; i++) {
+    kprintf("io apic %u at %x, from gsi %u\n", madt.ioapics[i].id, madt.ioapics[i].address, madt.ioapics[i].gsi_base);
+  }
+  for (uint32_t irq = 0; irq < ACPI_ISA_IRQS; irq++) {
+    const acpi_isa_irq_t *isa = &madt.isa[irq];
+    if (isa->gsi != irq || isa->active_low || isa->level) {
+      kprintf("irq %u -> gsi %u%s%s\n", irq, isa->gsi, isa->active_low ? " active low" : "",
+              isa->level ? " level" : "");
+    }
+  }
+}
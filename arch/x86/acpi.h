@@ -0,0 +1,55 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ACPI_MAX_CPUS 16
+#define ACPI_MAX_IOAPICS 4
+#define ACPI_ISA_IRQS 16
+// No LINT pin, in acpi_madt_t.nmi_lint.
+#define ACPI_NO_LINT 0xff
+
+typedef struct acpi_cpu_t {
+  uint8_t apic_id;
+  uint8_t acpi_id;
+} acpi_cpu_t;
+
+typedef struct acpi_ioapic_t {
+  uint8_t id;
+  uint32_t address;
+  // First global system interrupt of its inputs.
+  uint32_t gsi_base;
+} acpi_ioapic_t;
+
+// Where an ISA IRQ comes in. Without an override it is the GSI with the same
+// number, active high and edge triggered.
+typedef struct acpi_isa_irq_t {
+  uint32_t gsi;
+  bool active_low;
+  bool level;
+} acpi_isa_irq_t;
+
+// What the MADT says about the interrupt controllers.
+typedef struct acpi_madt_t {
+  uint32_t lapic_address;
+  // The legacy PICs are present too and have to be masked.
+  bool pic;
+  // Enabled CPUs, in MADT order.
+  uint32_t n_cpus;
+  acpi_cpu_t cpus[ACPI_MAX_CPUS];
+  uint32_t n_ioapics;
+  acpi_ioapic_t ioapics[ACPI_MAX_IOAPICS];
+  acpi_isa_irq_t isa[ACPI_ISA_IRQS];
+  // Local APIC input wired to NMI, usually LINT1.
+  uint8_t nmi_lint;
+} acpi_madt_t;
+
+// Find the RSDP and read the MADT. Needs the VM for tables above the direct
+// map. Returns false if there is no ACPI or no MADT.
+bool acpi_init(void);
+// NULL until acpi_init() succeeded.
+const acpi_madt_t *acpi_madt(void);
+void acpi_dump(void);
+
+#endif
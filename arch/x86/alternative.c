@@ -0,0 +1,43 @@
+#include "alternative.h"
+#include "cpu.h"
+#include "kernel/trace.h"
+
+#define OPCODE_CALL 0xe8
+#define OPCODE_JMP 0xe9
+#define OPCODE_NOP 0x90
+
+// Provided by the linker script.
+extern alt_instr_t __alt_instructions_start[];
+extern alt_instr_t __alt_instructions_end[];
+
+// Bytes are moved one at a time: memory_copy goes through patch sites itself.
+// Interrupts stay off throughout, as a handler printing would run memory_copy
+// while one of its sites is half patched.
+void alternatives_apply(void) {
+  uint32_t flags = interrupts_save();
+  uint32_t patched = 0;
+  for (alt_instr_t *alt = __alt_instructions_start; alt < __alt_instructions_end; alt++) {
+    if (!cpu_has(alt->feature) || alt->replacement_length > alt->length) {
+      continue;
+    }
+    uint8_t *instruction = (uint8_t *)alt->instruction;
+    const uint8_t *replacement = (const uint8_t *)alt->replacement;
+    for (uint32_t i = 0; i < alt->replacement_length; i++) {
+      instruction[i] = replacement[i];
+    }
+    // Relative targets are relative to where the instruction is run from.
+    if (alt->replacement_length >= 5 && (replacement[0] == OPCODE_CALL || replacement[0] == OPCODE_JMP)) {
+      *(int32_t *)(instruction + 1) += replacement - instruction;
+    }
+    for (uint32_t i = alt->replacement_length; i < alt->length; i++) {
+      instruction[i] = OPCODE_NOP;
+    }
+    patched++;
+  }
+
+  // CPUID serializes, so no stale instructions are run.
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(0, &eax, &ebx, &ecx, &edx);
+  interrupts_restore(flags);
+  TRACE("ALT", 1, "patched %d of %d sites", patched, __alt_instructions_end - __alt_instructions_start);
+}
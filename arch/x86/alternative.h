@@ -0,0 +1,55 @@
+#ifndef ALTERNATIVE_H
+#define ALTERNATIVE_H
+
+#include <stdint.h>
+
+// A patch site, collected in .altinstructions. If the CPU has `feature`, the
+// `length` bytes at `instruction` are replaced by the `replacement_length`
+// bytes at `replacement` and padded with nops.
+typedef struct alt_instr_t {
+  uint32_t instruction;
+  uint32_t replacement;
+  uint16_t feature;
+  uint8_t length;
+  uint8_t replacement_length;
+} __attribute__((packed)) alt_instr_t;
+
+#define ALT_STRINGIFY(x) #x
+#define ALT_STR(x) ALT_STRINGIFY(x)
+
+#define ALT_OLD_LENGTH "(662b - 661b)"
+#define ALT_NEW_LENGTH(n) "(665" #n "f - 664" #n "f)"
+// Nops needed for replacement `n` to fit over the original. Comparisons are -1
+// when true in the assembler.
+#define ALT_GROWTH(n) "(" ALT_NEW_LENGTH(n) " - " ALT_OLD_LENGTH ")"
+#define ALT_PAD(n) "(-(" ALT_GROWTH(n) " > 0) * " ALT_GROWTH(n) ")"
+#define ALT_MAX(a, b) "(" a " ^ ((" a " ^ " b ") & -(-(" a " < " b "))))"
+
+#define ALT_OLD(old, padding) "661:\n\t" old "\n662:\n\t.skip " padding ", 0x90\n663:\n\t"
+
+#define ALT_ENTRY(feature, n)                                                                                        \
+  ".long 661b, 664" #n "f\n\t"                                                                                        \
+  ".word " ALT_STR(feature) "\n\t"                                                                                    \
+  ".byte 663b - 661b, 665" #n "f - 664" #n "f\n\t"
+
+#define ALT_REPLACEMENT(new, n) "664" #n ":\n\t" new "\n665" #n ":\n\t"
+
+// Inline assembly running `old`, or `new` on CPUs with `feature`. A call or
+// jump may only be the first instruction of a replacement, as only its target
+// is fixed up when it is moved.
+#define ALTERNATIVE(old, new, feature)                                                                               \
+  ALT_OLD(old, ALT_PAD(1))                                                                                            \
+  ".pushsection .altinstructions, \"a\"\n\t" ALT_ENTRY(feature, 1) ".popsection\n\t"                                  \
+  ".pushsection .altinstr_replacement, \"ax\"\n\t" ALT_REPLACEMENT(new, 1) ".popsection\n"
+
+// Like ALTERNATIVE, with a second choice that wins when both features are there.
+#define ALTERNATIVE_2(old, new1, feature1, new2, feature2)                                                           \
+  ALT_OLD(old, ALT_MAX(ALT_PAD(1), ALT_PAD(2)))                                                                       \
+  ".pushsection .altinstructions, \"a\"\n\t" ALT_ENTRY(feature1, 1) ALT_ENTRY(feature2, 2) ".popsection\n\t"          \
+  ".pushsection .altinstr_replacement, \"ax\"\n\t" ALT_REPLACEMENT(new1, 1) ALT_REPLACEMENT(new2, 2) ".popsection\n"
+
+// Patch every site for the features cpu_features_init() found. Runs once,
+// early, before the other CPUs start, with interrupts disabled.
+void alternatives_apply(void);
+
+#endif
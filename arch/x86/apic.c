@@ -0,0 +1,286 @@
+#include "apic.h"
+#include "acpi.h"
+#include "cpu.h"
+#include "isr.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include "mm/vm.h"
+#include "ports.h"
+#include "timer.h"
+
+#define MSR_APIC_BASE 0x1b
+#define APIC_BASE_ENABLE (1 << 11)
+
+// Local APIC registers, by byte offset.
+#define LAPIC_ID 0x20
+#define LAPIC_VERSION 0x30
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0
+#define LAPIC_ESR 0x280
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3e0
+
+#define SVR_ENABLE (1 << 8)
+#define LVT_NMI (4 << 8)
+#define LVT_MASKED (1 << 16)
+#define TIMER_DIVIDE_16 0x3
+
+// Interrupt command register, low word. The destination is the APIC id in the
+// top byte of the high word.
+#define ICR_INIT (5 << 8)
+#define ICR_STARTUP (6 << 8)
+#define ICR_PENDING (1 << 12)
+#define ICR_ASSERT (1 << 14)
+// Waits from the MP specification: after INIT, and after each STARTUP.
+#define INIT_DELAY_US 10000
+#define STARTUP_DELAY_US 200
+
+// I/O APIC registers are selected through IOREGSEL and read and written
+// through IOWIN.
+#define IOAPIC_IOREGSEL 0x00
+#define IOAPIC_IOWIN 0x10
+#define IOAPIC_VERSION 0x01
+#define IOAPIC_REDIRECTION(input) (0x10 + 2 * (input))
+#define REDIRECTION_ACTIVE_LOW (1 << 13)
+#define REDIRECTION_LEVEL (1 << 15)
+#define REDIRECTION_MASKED (1 << 16)
+
+#define PIC1_DATA 0x21
+#define PIC2_DATA 0xa1
+// Connects the second PIC, never raised itself.
+#define ISA_CASCADE 2
+
+#define CALIBRATE_US 10000
+#define TIMER_MAX_NS (1ull << 40)
+
+typedef struct ioapic_t {
+  volatile uint32_t *registers;
+  uint32_t gsi_base;
+  uint32_t n_inputs;
+  uint8_t id;
+} ioapic_t;
+
+static volatile uint32_t *lapic;
+static ioapic_t ioapics[ACPI_MAX_IOAPICS];
+static uint32_t n_ioapics;
+static bool enabled;
+// The CPU the ISA IRQs go to, the boot CPU.
+static uint8_t irq_destination;
+// Local APIC timer counts per millisecond, divided by 16.
+static uint32_t timer_khz;
+static uint32_t errors;
+// Error status register contents at the last error interrupt.
+static uint32_t last_error;
+
+static uint32_t lapic_read(uint32_t reg) { return lapic[reg / 4]; }
+
+static void lapic_write(uint32_t reg, uint32_t value) { lapic[reg / 4] = value; }
+
+static uint32_t ioapic_read(const ioapic_t *ioapic, uint32_t reg) {
+  ioapic->registers[IOAPIC_IOREGSEL / 4] = reg;
+  return ioapic->registers[IOAPIC_IOWIN / 4];
+}
+
+static void ioapic_write(const ioapic_t *ioapic, uint32_t reg, uint32_t value) {
+  ioapic->registers[IOAPIC_IOREGSEL / 4] = reg;
+  ioapic->registers[IOAPIC_IOWIN / 4] = value;
+}
+
+static ioapic_t *ioapic_of(uint32_t gsi) {
+  for (uint32_t i = 0; i < n_ioapics; i++) {
+    if (gsi >= ioapics[i].gsi_base && gsi - ioapics[i].gsi_base < ioapics[i].n_inputs) {
+      return &ioapics[i];
+    }
+  }
+  return NULL;
+}
+
+// Deliver ISA `irq` to the vector the remapped PIC used for it.
+static void route(uint32_t irq, const acpi_isa_irq_t *isa, uint8_t destination) {
+  ioapic_t *ioapic = ioapic_of(isa->gsi);
+  if (ioapic == NULL) {
+    kprintf("apic: no io apic for gsi %u\n", isa->gsi);
+    return;
+  }
+  uint32_t input = isa->gsi - ioapic->gsi_base;
+  uint32_t low = (IRQ0 + irq) | (isa->active_low ? REDIRECTION_ACTIVE_LOW : 0) | (isa->level ? REDIRECTION_LEVEL : 0);
+  ioapic_write(ioapic, IOAPIC_REDIRECTION(input) + 1, (uint32_t)destination << 24);
+  ioapic_write(ioapic, IOAPIC_REDIRECTION(input), low);
+}
+
+static void error_interrupt(registers_t *regs) {
+  (void)regs;
+  // Writing latches the errors so they can be read.
+  lapic_write(LAPIC_ESR, 0);
+  last_error = lapic_read(LAPIC_ESR);
+  errors++;
+  TRACE("APIC", 2, "error %x", last_error);
+}
+
+static bool map_ioapics(const acpi_madt_t *madt) {
+  for (uint32_t i = 0; i < madt->n_ioapics; i++) {
+    ioapic_t *ioapic = &ioapics[n_ioapics];
+    ioapic->registers = vm_map_device(madt->ioapics[i].address, PAGE_SIZE, MEMTYPE_UC);
+    if (ioapic->registers == NULL) {
+      return false;
+    }
+    ioapic->id = madt->ioapics[i].id;
+    ioapic->gsi_base = madt->ioapics[i].gsi_base;
+    ioapic->n_inputs = ((ioapic_read(ioapic, IOAPIC_VERSION) >> 16) & 0xff) + 1;
+    for (uint32_t input = 0; input < ioapic->n_inputs; input++) {
+      ioapic_write(ioapic, IOAPIC_REDIRECTION(input), REDIRECTION_MASKED);
+    }
+    n_ioapics++;
+  }
+  return true;
+}
+
+// Enable the local APIC of the calling CPU, with its timer masked.
+static void lapic_enable(const acpi_madt_t *madt) {
+  uint32_t flags = interrupts_save();
+  wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | IRQ_APIC_TIMER);
+  // The PIC would come in through LINT0, it is not used any more.
+  lapic_write(LAPIC_LVT_LINT0, madt->nmi_lint == 0 ? LVT_NMI : LVT_MASKED);
+  lapic_write(LAPIC_LVT_LINT1, madt->nmi_lint == 1 ? LVT_NMI : LVT_MASKED);
+  lapic_write(LAPIC_LVT_ERROR, IRQ_APIC_ERROR);
+  lapic_write(LAPIC_ESR, 0);
+  lapic_write(LAPIC_ESR, 0);
+  lapic_write(LAPIC_SVR, SVR_ENABLE | IRQ_SPURIOUS);
+  lapic_write(LAPIC_EOI, 0);
+  interrupts_restore(flags);
+}
+
+// The pair of writes must not be split by an interrupt that sends one too.
+static void send(uint32_t destination, uint32_t command) {
+  uint32_t flags = interrupts_save();
+  while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+    cpu_relax();
+  }
+  lapic_write(LAPIC_ICR_HIGH, destination << 24);
+  lapic_write(LAPIC_ICR_LOW, command);
+  interrupts_restore(flags);
+}
+
+bool apic_init(void) {
+  const acpi_madt_t *madt = acpi_madt();
+  if (madt == NULL || madt->n_ioapics == 0 || !cpu_has(X86_FEATURE_APIC) || !cpu_has(X86_FEATURE_MSR)) {
+    return false;
+  }
+  lapic = vm_map_device(madt->lapic_address, PAGE_SIZE, MEMTYPE_UC);
+  if (lapic == NULL || !map_ioapics(madt)) {
+    kprintf("apic: cannot map registers\n");
+    return false;
+  }
+  register_interrupt_handler(IRQ_APIC_ERROR, error_interrupt);
+  lapic_enable(madt);
+
+  uint32_t flags = interrupts_save();
+  irq_destination = apic_id();
+  // The IRQs registered later are routed as they are.
+  for (uint32_t irq = 0; irq < ACPI_ISA_IRQS; irq++) {
+    if (irq != ISA_CASCADE && has_interrupt_handler(IRQ0 + irq)) {
+      route(irq, &madt->isa[irq], irq_destination);
+    }
+  }
+  if (madt->pic) {
+    outb(PIC1_DATA, 0xff);
+    outb(PIC2_DATA, 0xff);
+  }
+  enabled = true;
+  interrupts_restore(flags);
+  TRACE("APIC", 1, "local apic %d, %d io apics", irq_destination, n_ioapics);
+  return true;
+}
+
+void apic_route_irq(uint32_t irq) {
+  if (!enabled || irq >= ACPI_ISA_IRQS || irq == ISA_CASCADE) {
+    return;
+  }
+  // Selecting a register and writing it must not be split by another route.
+  uint32_t flags = interrupts_save();
+  route(irq, &acpi_madt()->isa[irq], irq_destination);
+  interrupts_restore(flags);
+}
+
+void apic_init_ap(void) {
+  lapic_enable(acpi_madt());
+  // Calibrated on the boot CPU, they all count at the bus clock.
+  if (timer_khz != 0) {
+    lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, IRQ_APIC_TIMER);
+  }
+}
+
+bool apic_enabled(void) { return enabled; }
+
+void apic_eoi(void) { lapic_write(LAPIC_EOI, 0); }
+
+uint32_t apic_id(void) { return lapic_read(LAPIC_ID) >> 24; }
+
+void apic_send_ipi(uint32_t apic_id, uint8_t vector) { send(apic_id, ICR_ASSERT | vector); }
+
+void apic_start_cpu(uint32_t apic_id, uint32_t address) {
+  send(apic_id, ICR_INIT | ICR_ASSERT);
+  udelay(INIT_DELAY_US);
+  // The second STARTUP is for CPUs that miss the first, one that is already
+  // running ignores it.
+  for (uint32_t i = 0; i < 2; i++) {
+    send(apic_id, ICR_STARTUP | address >> 12);
+    udelay(STARTUP_DELAY_US);
+  }
+}
+
+bool apic_timer_init(void) {
+  if (!enabled || timer_tsc_khz() == 0) {
+    return false;
+  }
+  lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+  lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | IRQ_APIC_TIMER);
+  uint32_t flags = interrupts_save();
+  lapic_write(LAPIC_TIMER_INITIAL, UINT32_MAX);
+  uint64_t start = timer_ns();
+  udelay(CALIBRATE_US);
+  uint32_t counted = UINT32_MAX - lapic_read(LAPIC_TIMER_CURRENT);
+  uint32_t elapsed = timer_ns() - start;
+  lapic_write(LAPIC_TIMER_INITIAL, 0);
+  interrupts_restore(flags);
+  timer_khz = div64((uint64_t)counted * 1000000, elapsed);
+  // One-shot mode, the initial count starts it.
+  lapic_write(LAPIC_LVT_TIMER, IRQ_APIC_TIMER);
+  TRACE("APIC", 3, "timer at %d kHz", timer_khz);
+  return timer_khz != 0;
+}
+
+void apic_timer_start(uint64_t ns) {
+  // Far beyond what the count holds, and keeps the product below 2^64.
+  if (ns > TIMER_MAX_NS) {
+    ns = TIMER_MAX_NS;
+  }
+  uint64_t count = div64(ns * timer_khz, 1000000) + 1;
+  lapic_write(LAPIC_TIMER_INITIAL, count < UINT32_MAX ? count : UINT32_MAX);
+}
+
+void apic_timer_stop(void) { lapic_write(LAPIC_TIMER_INITIAL, 0); }
+
+void apic_dump(void) {
+  if (!enabled) {
+    kprintf("apic: off, using the PIC\n");
+    return;
+  }
+  kprintf("local apic %u, version %x, timer %u kHz, %u errors (last %x)\n", apic_id(),
+          lapic_read(LAPIC_VERSION) & 0xff, timer_khz, errors, last_error);
+  for (uint32_t i = 0; i < n_ioapics; i++) {
+    kprintf("io apic %u: gsi %u - %u\n", ioapics[i].id, ioapics[i].gsi_base,
+            ioapics[i].gsi_base + ioapics[i].n_inputs - 1);
+  }
+}
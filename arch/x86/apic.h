@@ -0,0 +1,35 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Enable the local APIC and route the ISA IRQs with a handler through the I/O
+// APICs to the vectors the PIC used, then mask the PIC. Needs acpi_init(). Returns false
+// and leaves the PIC in charge if there is no APIC.
+bool apic_init(void);
+// Route ISA `irq` to the boot CPU, done for each IRQ once it gets a handler.
+// The ones without stay masked. Does nothing without an APIC.
+void apic_route_irq(uint32_t irq);
+// Enable the local APIC of an application processor, with its timer set up
+// like the boot CPU's if that one uses it. No I/O APIC input is routed to it.
+void apic_init_ap(void);
+bool apic_enabled(void);
+// Acknowledge the interrupt being handled, with one write to the local APIC.
+void apic_eoi(void);
+uint32_t apic_id(void);
+// Send `vector` to the CPU with `apic_id`.
+void apic_send_ipi(uint32_t apic_id, uint8_t vector);
+// Have the CPU with `apic_id` start in real mode at `address`, a page below
+// 1 MiB, with INIT and STARTUP IPIs. Takes about 10 ms.
+void apic_start_cpu(uint32_t apic_id, uint32_t address);
+
+// Time the local APIC timer against timer_ns(). Returns false if there is no
+// APIC or no TSC to time it with.
+bool apic_timer_init(void);
+// Interrupt on IRQ_APIC_TIMER once, after at least `ns` nanoseconds.
+void apic_timer_start(uint64_t ns);
+void apic_timer_stop(void);
+void apic_dump(void);
+
+#endif
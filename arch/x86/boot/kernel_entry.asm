@@ -1,4 +1,25 @@
 [bits 32]
 [extern kernel_main] ; Define calling point. Must have same name as kernel.c 'main' function
-call kernel_main ; Calls the C function. The linker will know where it is placed in memory
-jmp $
\ No newline at end of file
+[extern enable_paging]
+
+; Stage 2 jumps to the first byte of the kernel image, which the linker script
+; places at the physical address it is loaded to.
+section .boot progbits alloc exec write
+    global _start
+_start:
+    call enable_paging
+    mov eax, higher_half ; Absolute jump, a relative one would stay in low memory
+    jmp eax
+
+section .text
+higher_half:
+    mov esp, stack_top ; Stage 2's stack is in low memory, which paging_init unmaps
+    push 0 ; No multiboot information, the memory map is read from where stage 2 left it
+    push 0 ; Not a multiboot magic
+    call kernel_main ; Calls the C function. The linker will know where it is placed in memory
+    jmp $
+
+section .bss
+    align 16
+stack_bottom: resb 16384 ; 16 KiB
+stack_top:
@@ -33,11 +33,14 @@ stack_top:
 
 ; Define calling point. Must have same name as kernel.c 'main' function
 [extern kernel_main]
+[extern enable_paging]
 
 ; The linker script specifies _start as the entry point to the kernel and the
 ; bootloader will jump to this position once the kernel has been loaded. It
 ; doesn't make sense to return from this function as the bootloader is gone.
-section .text
+; Paging is still off, so _start lives in .boot, which is linked at its physical
+; address, while the rest of the kernel is linked in the higher half.
+section .boot progbits alloc exec write
     global _start
 _start:
 	; The bootloader has loaded us into 32-bit protected mode on a x86
@@ -51,6 +54,18 @@ _start:
 	; itself. It has absolute and complete power over the
 	; machine.
 
+	; Map the kernel in the higher half and continue there. enable_paging
+	; clobbers eax, so keep the multiboot magic in edx. The bootloader does
+	; not give us a stack and the real one is in .bss, which enable_paging
+	; clears, so the call uses a tiny one of its own.
+	mov edx, eax
+	mov esp, boot_stack_top
+	call enable_paging
+	mov eax, higher_half
+	jmp eax
+
+section .text
+higher_half:
 	; To set up a stack, we set the esp register to point to the top of the
 	; stack (as it grows downwards on x86 systems). This is necessarily done
 	; in assembly as languages such as C cannot function without a stack.
@@ -59,9 +74,9 @@ _start:
 	; This is a good place to initialize crucial processor state before the
 	; high-level kernel is entered. It's best to minimize the early
 	; environment where crucial features are offline. Note that the
-	; processor is not fully initialized yet: Features such as floating
-	; point instructions and instruction set extensions are not initialized
-	; yet. The GDT should be loaded here. Paging should be enabled here.
+	; processor is not fully initialized yet: Floating point instructions
+	; and instruction set extensions are set up by fpu_init and the GDT is
+	; loaded by smp_early_init, both early in kernel_main.
 	; C++ features such as global constructors and exceptions will require
 	; runtime support to work as well.
 
@@ -69,8 +84,14 @@ _start:
 	; aligned at the time of the call instruction (which afterwards pushes
 	; the return pointer of size 4 bytes). The stack was originally 16-byte
 	; aligned above and we've pushed a multiple of 16 bytes to the
-	; stack since (pushed 0 bytes so far), so the alignment has thus been
-	; preserved and the call is well defined.
+	; stack since (8 bytes of padding and the two arguments), so the
+	; alignment has thus been preserved and the call is well defined.
+	; kernel_main(magic, info) gets the magic value, saved in edx, and the
+	; physical address of the multiboot information structure in ebx, which
+	; holds the memory map.
+	sub esp, 8
+	push ebx
+	push edx
 	call kernel_main
 
 	; If the system has nothing more to do, put the computer into an
@@ -87,3 +108,8 @@ _start:
 inf:
     hlt
 	jmp inf
+
+section .boot
+    align 16
+boot_stack: times 16 db 0
+boot_stack_top:
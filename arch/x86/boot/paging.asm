@@ -0,0 +1,54 @@
+; --------------------------------------------------------------------------------
+; Early paging
+; --------------------------------------------------------------------------------
+; The kernel is linked at KERNEL_VIRTUAL_BASE + its physical address, so until
+; paging is on only code in the .boot section, which is linked at its physical
+; address, may run. Both entry points call enable_paging before jumping to the
+; higher half. The boot page directory maps the first 16 MiB with 4 MiB pages
+; twice: at 0 so that the caller keeps running, and at KERNEL_VIRTUAL_BASE.
+; paging_init replaces it with the full kernel page directory.
+[bits 32]
+
+KERNEL_VIRTUAL_BASE equ 0xc0000000
+KERNEL_PDE          equ KERNEL_VIRTUAL_BASE >> 22
+BOOT_MAPPED_PDES    equ 4           ; 16 MiB
+PDE_LARGE           equ 0x83        ; Present, writable, 4 MiB page
+LARGE_PAGE_SIZE     equ 0x400000
+CR4_PSE             equ 1 << 4      ; Page size extension, every CPU since the Pentium
+CR0_PG              equ 1 << 31
+
+[extern __bss_start]
+[extern _end]
+[extern boot_page_directory]
+
+section .boot progbits alloc exec write
+    global enable_paging
+; Clobbers eax, ecx and edi.
+enable_paging:
+    ; Nothing loads .bss, so clear it before C code relies on it being zero.
+    mov edi, __bss_start - KERNEL_VIRTUAL_BASE
+    mov ecx, _end - KERNEL_VIRTUAL_BASE
+    sub ecx, edi
+    xor eax, eax
+    cld
+    rep stosb
+
+    mov edi, boot_page_directory - KERNEL_VIRTUAL_BASE
+    mov eax, PDE_LARGE
+    xor ecx, ecx
+enable_paging_map:
+    mov [edi + ecx * 4], eax
+    mov [edi + KERNEL_PDE * 4 + ecx * 4], eax
+    add eax, LARGE_PAGE_SIZE
+    inc ecx
+    cmp ecx, BOOT_MAPPED_PDES
+    jne enable_paging_map
+
+    mov cr3, edi
+    mov eax, cr4
+    or eax, CR4_PSE
+    mov cr4, eax
+    mov eax, cr0
+    or eax, CR0_PG
+    mov cr0, eax
+    ret
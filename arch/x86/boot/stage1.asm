@@ -44,13 +44,15 @@
 ;
 ; Stage 1 can be described with the following points:
 ;   1. Setup the stack at the last address of the big free block (480.5 KiB),
-;      i.e., address 0x7ffff.
+;      i.e., address 0x7fffe. It gets a segment of its own, 0x7000, as stage 2
+;      loads the kernel from 0x4000 up to the start of it.
 ;   2. Print status message
 ;   3. Load 1 * 512 bytes from the boot drive into memory at 0x500
 ;   4. Jump to address 0x500
 
 STAGE2_OFFSET equ 0x0500
-STACK_POINTER equ 0xffff
+STACK_SEGMENT equ 0x7000
+STACK_POINTER equ 0xfffe
 
 ; --------------------------------------------------------------------------------
 ; Using 16-bit real mode
@@ -61,8 +63,12 @@ STACK_POINTER equ 0xffff
 ; --------------------------------------------------------------------------------
 stage1_start:
     mov [BOOT_DRIVE], dl        ; Remember that the BIOS sets us the boot drive in 'dl' on boot
-    mov bp, STACK_POINTER       ; Set the base pointer to 0xffff
-    mov sp, bp                  ; Set the stack pointer to 0xffff
+    cli                         ; No interrupt may use the stack while it moves
+    mov ax, STACK_SEGMENT
+    mov ss, ax
+    mov bp, STACK_POINTER       ; Set the base pointer to 0x7000:0xfffe
+    mov sp, bp                  ; Set the stack pointer to 0x7000:0xfffe
+    sti
     mov bx, MSG_REAL_MODE
     call print
     mov bx, STAGE2_OFFSET       ; Read from disk and store in 0x500
@@ -230,9 +230,11 @@ detect_ram_failed:
 ; --------------------------------------------------------------------------------
 ; Disk loader
 ; --------------------------------------------------------------------------------
+; The kernel must end below the stack segment stage 1 set up at 0x70000, which
+; scripts/sectors.py checks when it builds the image.
 disk_load_kernel:
     pusha
-    mov ax, KERNEL_OFFSET       ; Read from disk and store in 0x1000
+    mov ax, KERNEL_OFFSET >> 4  ; Read from disk and store at KERNEL_OFFSET
     mov es, ax
     mov dl, [BOOT_DRIVE]
     sub ebx, ebx
@@ -257,18 +259,25 @@ disk_main:
     push 0                      ; LBA sector number [48:63]
     push 0                      ; LBA sector number [32:47]
     push ebx                    ; LBA sector number [00:31]
+    push es                     ; Buffer segment
     push 0                      ; Buffer offset
-    push es                     ; Buffer segement
     push ax                     ; Number of sectors
     push 0x1000                 ; Size of packet
+    mov si, sp                  ; DS:SI -> packet, which is on the stack
+    push ds
+    push ss
+    pop ds
     mov ah, 0x42                ; Extended read (LBA instead of CHS)
-    mov si, sp                  ; DS:SI -> packet
     int 0x13
+    pop ds                      ; Leaves the carry flag alone
     jc disk_error               ; if error (stored in the carry bit)
     cmp ah, 0                  ; BIOS also sets 'al' to the ; of sectors read. Compare it.
     jne sectors_error
     mov sp, bp
     pop bp
+    mov ax, es                  ; Advance the buffer past the sectors just read
+    add ax, 127 * 512 / 16
+    mov es, ax
     mov ax, cx
     cmp ax, 0
     jne disk_loop_start
@@ -0,0 +1,16 @@
+#include "cpu.h"
+
+static uint32_t features[X86_FEATURE_WORDS];
+
+void cpu_features_init(void) {
+  uint32_t max, eax, ebx, ecx, edx;
+  cpuid(0, &max, &ebx, &ecx, &edx);
+  cpuid(1, &eax, &ebx, &features[1], &features[0]);
+  if (max >= 7) {
+    cpuid(7, &eax, &features[2], &ecx, &edx);
+  }
+}
+
+bool cpu_has(uint32_t feature) {
+  return feature < 32 * X86_FEATURE_WORDS && (features[feature / 32] & (1u << (feature % 32))) != 0;
+}
@@ -0,0 +1,165 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* CPUID leaf 1 feature bits in edx */
+#define CPUID_EDX_PSE (1 << 3)
+#define CPUID_EDX_PGE (1 << 13)
+#define CPUID_EDX_FXSR (1 << 24)
+#define CPUID_EDX_SSE2 (1 << 26)
+
+// Features as 32 * word + bit. Word 0 is CPUID leaf 1 edx, word 1 leaf 1 ecx
+// and word 2 leaf 7 ebx.
+#define X86_FEATURE_WORDS 3
+#define X86_FEATURE_FPU (0 * 32 + 0)
+#define X86_FEATURE_PSE (0 * 32 + 3)
+#define X86_FEATURE_TSC (0 * 32 + 4)
+#define X86_FEATURE_MSR (0 * 32 + 5)
+#define X86_FEATURE_APIC (0 * 32 + 9)
+#define X86_FEATURE_MTRR (0 * 32 + 12)
+#define X86_FEATURE_PGE (0 * 32 + 13)
+#define X86_FEATURE_PAT (0 * 32 + 16)
+#define X86_FEATURE_FXSR (0 * 32 + 24)
+#define X86_FEATURE_SSE (0 * 32 + 25)
+#define X86_FEATURE_SSE2 (0 * 32 + 26)
+#define X86_FEATURE_SSE3 (1 * 32 + 0)
+#define X86_FEATURE_ERMS (2 * 32 + 9)
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+#define CR0_WP (1 << 16)
+#define CR0_NW (1 << 29)
+#define CR0_CD (1 << 30)
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define EFLAGS_IF (1 << 9)
+
+// Data that different CPUs write goes in different lines of this size, so
+// their writes do not take the line from each other.
+#define CACHE_LINE_SIZE 64
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+  asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+static inline uint32_t read_cr0(void) {
+  uint32_t value;
+  asm volatile("mov %%cr0, %0" : "=r"(value));
+  return value;
+}
+
+static inline void write_cr0(uint32_t value) { asm volatile("mov %0, %%cr0" : : "r"(value) : "memory"); }
+
+static inline uint32_t read_cr2(void) {
+  uint32_t value;
+  asm volatile("mov %%cr2, %0" : "=r"(value));
+  return value;
+}
+
+static inline uint32_t read_cr3(void) {
+  uint32_t value;
+  asm volatile("mov %%cr3, %0" : "=r"(value));
+  return value;
+}
+
+static inline void write_cr3(uint32_t value) { asm volatile("mov %0, %%cr3" : : "r"(value) : "memory"); }
+
+static inline uint32_t read_cr4(void) {
+  uint32_t value;
+  asm volatile("mov %%cr4, %0" : "=r"(value));
+  return value;
+}
+
+static inline void write_cr4(uint32_t value) { asm volatile("mov %0, %%cr4" : : "r"(value) : "memory"); }
+
+static inline uint64_t rdmsr(uint32_t msr) {
+  uint32_t low, high;
+  asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+  return (uint64_t)high << 32 | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+  asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+static inline uint64_t rdtsc(void) {
+  uint32_t low, high;
+  asm volatile("rdtsc" : "=a"(low), "=d"(high));
+  return (uint64_t)high << 32 | low;
+}
+
+static inline void wbinvd(void) { asm volatile("wbinvd" : : : "memory"); }
+
+// 64-bit by 32-bit division with two divl, since there is no libgcc to do
+// 64-bit division for the compiler.
+static inline uint64_t div64(uint64_t n, uint32_t d) {
+  uint32_t high = n >> 32;
+  uint32_t low, remainder;
+  asm("divl %4" : "=a"(low), "=d"(remainder) : "a"((uint32_t)n), "d"(high % d), "rm"(d));
+  return (uint64_t)(high / d) << 32 | low;
+}
+
+// Let FPU and SSE instructions run without a #NM trap.
+static inline void clts(void) { asm volatile("clts" : : : "memory"); }
+
+// Time the sections that interrupts_save() turned interrupts off for, in
+// isr.c. The site is the caller of irqoff_start().
+void irqoff_start(void);
+void irqoff_stop(void);
+
+// Halt until an interrupt has been handled. Called with interrupts disabled
+// after checking there is nothing to do: sti takes effect after hlt has
+// started, so an interrupt in between cannot be missed. Returns with
+// interrupts disabled again. The halt does not count as a section with
+// interrupts off.
+static inline __attribute__((always_inline)) void cpu_idle(void) {
+  irqoff_stop();
+  asm volatile("sti; hlt; cli" : : : "memory");
+  irqoff_start();
+}
+
+// Spin-wait hint. Encoded as rep nop, which CPUs without it run as a nop.
+static inline void cpu_relax(void) { asm volatile("pause" : : : "memory"); }
+
+static inline void invlpg(uint32_t address) { asm volatile("invlpg (%0)" : : "r"(address) : "memory"); }
+
+// Disable interrupts, returning EFLAGS so interrupts_restore() can put the
+// interrupt flag back the way it was. Always inlined, so the sections are
+// timed against the function that disabled interrupts.
+static inline __attribute__((always_inline)) uint32_t interrupts_save(void) {
+  uint32_t flags;
+  asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+  if (flags & EFLAGS_IF) {
+    irqoff_start();
+  }
+  return flags;
+}
+
+static inline __attribute__((always_inline)) void interrupts_restore(uint32_t flags) {
+  if (flags & EFLAGS_IF) {
+    irqoff_stop();
+  }
+  asm volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+static inline bool interrupts_enabled(void) {
+  uint32_t flags;
+  asm volatile("pushf; pop %0" : "=r"(flags));
+  return flags & EFLAGS_IF;
+}
+
+static inline void interrupts_enable(void) { asm volatile("sti" : : : "memory"); }
+
+static inline void interrupts_disable(void) { asm volatile("cli" : : : "memory"); }
+
+// Read the CPUID feature words once, for cpu_has().
+void cpu_features_init(void);
+bool cpu_has(uint32_t feature);
+
+#endif
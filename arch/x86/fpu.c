@@ -0,0 +1,170 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "isr.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include "smp.h"
+
+#define NO_COPROCESSOR 7
+// All SIMD exceptions masked, round to nearest.
+#define MXCSR_DEFAULT 0x1f80
+
+static bool present;
+static bool fxsr;
+static bool sse;
+// Each CPU has its own registers, so whose they hold (NULL when nobody's, like
+// after a kernel section), the running task's and the interrupt flag at
+// kernel_fpu_begin() are in its percpu_t.
+// The context each CPU starts in, kernel_main on the boot CPU.
+static fpu_state_t boot_states[SMP_MAX_CPUS];
+static fpu_stats_t stats;
+
+static uint8_t *save_area(fpu_state_t *state) { return (uint8_t *)(((uint32_t)state->area + 15) & ~15u); }
+
+static void reset(void) {
+  asm volatile("fninit");
+  if (sse) {
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+  }
+}
+
+static void save(fpu_state_t *state) {
+  if (fxsr) {
+    asm volatile("fxsave (%0)" : : "r"(save_area(state)) : "memory");
+  } else {
+    asm volatile("fnsave (%0)" : : "r"(save_area(state)) : "memory");
+  }
+  stats.saves++;
+}
+
+static void restore(fpu_state_t *state) {
+  if (!state->used) {
+    reset();
+    state->used = true;
+    return;
+  }
+  if (fxsr) {
+    asm volatile("fxrstor (%0)" : : "r"(save_area(state)) : "memory");
+  } else {
+    asm volatile("frstor (%0)" : : "r"(save_area(state)) : "memory");
+  }
+  stats.restores++;
+}
+
+// The running task used the FPU after a switch. The registers are still those
+// of the last task that used it, so they are saved only now.
+static void no_coprocessor(registers_t *r) {
+  (void)r;
+  percpu_t *cpu = this_cpu();
+  clts();
+  stats.traps++;
+  if (cpu->fpu_owner == cpu->fpu_current) {
+    return;
+  }
+  if (cpu->fpu_owner != NULL) {
+    save(cpu->fpu_owner);
+  }
+  restore(cpu->fpu_current);
+  cpu->fpu_owner = cpu->fpu_current;
+}
+
+// Turn the unit on for the calling CPU and give its registers to the context
+// it runs.
+static void enable(void) {
+  // MP makes wait trap on TS too, NE reports errors as exceptions instead of
+  // through the PIC.
+  write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+  if (fxsr) {
+    write_cr4(read_cr4() | CR4_OSFXSR | (sse ? CR4_OSXMMEXCPT : 0));
+  }
+  percpu_t *cpu = this_cpu();
+  fpu_state_t *state = &boot_states[cpu->id];
+  fpu_state_init(state);
+  cpu->fpu_current = state;
+  restore(state);
+  cpu->fpu_owner = state;
+}
+
+void fpu_init(void) {
+  present = cpu_has(X86_FEATURE_FPU);
+  if (!present) {
+    kprintf("fpu: no x87 unit\n");
+    return;
+  }
+  fxsr = cpu_has(X86_FEATURE_FXSR);
+  sse = fxsr && cpu_has(X86_FEATURE_SSE);
+  register_interrupt_handler(NO_COPROCESSOR, no_coprocessor);
+  enable();
+  TRACE("FPU", 1, "fxsr %d, sse %d", fxsr, sse);
+}
+
+void fpu_init_ap(void) {
+  if (present) {
+    enable();
+  }
+}
+
+void fpu_state_init(fpu_state_t *state) { state->used = false; }
+
+void fpu_state_release(fpu_state_t *state) {
+  percpu_t *cpu = this_cpu();
+  if (cpu->fpu_owner == state) {
+    cpu->fpu_owner = NULL;
+  }
+}
+
+void fpu_save(fpu_state_t *state) {
+  percpu_t *cpu = this_cpu();
+  if (present && cpu->fpu_owner == state) {
+    clts();
+    save(state);
+    cpu->fpu_owner = NULL;
+  }
+}
+
+void fpu_switch(fpu_state_t *state) {
+  percpu_t *cpu = this_cpu();
+  cpu->fpu_current = state;
+  if (!present) {
+    return;
+  }
+  if (cpu->fpu_owner == state) {
+    clts();
+  } else {
+    write_cr0(read_cr0() | CR0_TS);
+  }
+}
+
+void kernel_fpu_begin(void) {
+  uint32_t flags = interrupts_save();
+  percpu_t *cpu = this_cpu();
+  cpu->fpu_kernel_flags = flags;
+  if (!present) {
+    return;
+  }
+  clts();
+  if (cpu->fpu_owner != NULL) {
+    save(cpu->fpu_owner);
+    cpu->fpu_owner = NULL;
+  }
+  reset();
+  stats.kernel_sections++;
+}
+
+// The registers hold nobody's state now, whoever uses them next traps and
+// gets its own back.
+void kernel_fpu_end(void) {
+  if (present) {
+    write_cr0(read_cr0() | CR0_TS);
+  }
+  interrupts_restore(this_cpu()->fpu_kernel_flags);
+}
+
+const fpu_stats_t *fpu_stats(void) { return &stats; }
+
+void fpu_dump(void) {
+  kprintf("fpu: %s, %u traps, %u saves, %u restores, %u kernel sections\n",
+          !present ? "none" : sse ? "x87 and sse" : fxsr ? "x87 with fxsr" : "x87", stats.traps, stats.saves,
+          stats.restores, stats.kernel_sections);
+}
@@ -0,0 +1,52 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Room for FXSAVE, which needs 16-byte alignment that allocators do not
+// promise, so the area is aligned inside the buffer.
+#define FPU_AREA_SIZE 512
+
+// x87 and SSE registers of one task. They are only saved and loaded when
+// another task actually uses the FPU.
+typedef struct fpu_state_t {
+  uint8_t area[FPU_AREA_SIZE + 15];
+  // Cleared until the first use, which starts from a clean FPU.
+  bool used;
+} fpu_state_t;
+
+typedef struct fpu_stats_t {
+  // #NM traps, taken on the first FPU use after a switch.
+  uint32_t traps;
+  uint32_t saves;
+  uint32_t restores;
+  uint32_t kernel_sections;
+} fpu_stats_t;
+
+// Enable the x87 unit, and SSE when the CPU has FXSR, and take over #NM. The
+// running context gets the registers.
+void fpu_init(void);
+// The same on an application processor, after fpu_init() on the boot CPU.
+void fpu_init_ap(void);
+
+void fpu_state_init(fpu_state_t *state);
+// `state` is going away. Drops it if the registers still hold it.
+void fpu_state_release(fpu_state_t *state);
+// Write `state` back if the registers of this CPU hold it, for a task that
+// may run on another CPU next. Called with interrupts disabled.
+void fpu_save(fpu_state_t *state);
+// Make `state` the one of the running task. Its registers are loaded on its
+// first FPU instruction, unless they are still there.
+void fpu_switch(fpu_state_t *state);
+
+// Kernel code that wants the FPU or SSE registers for longer than a call to a
+// mem* function brackets it with these. The task state is saved first and
+// interrupts stay disabled until kernel_fpu_end(), so keep sections short.
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+const fpu_stats_t *fpu_stats(void);
+void fpu_dump(void);
+
+#endif
@@ -0,0 +1,40 @@
+#include "gdt.h"
+#include "smp.h"
+
+#define GDT_ENTRIES 4
+
+static gdt_entry_t gdts[SMP_MAX_CPUS][GDT_ENTRIES];
+
+static void set_gdt_entry(gdt_entry_t *gdt, int n, uint32_t base, uint32_t limit, uint8_t access,
+                          uint8_t granularity) {
+  gdt[n].limit_low = limit & 0xffff;
+  gdt[n].base_low = base & 0xffff;
+  gdt[n].base_middle = (base >> 16) & 0xff;
+  gdt[n].access = access;
+  gdt[n].granularity = (granularity & 0xf0) | ((limit >> 16) & 0x0f);
+  gdt[n].base_high = (base >> 24) & 0xff;
+}
+
+void gdt_init(uint32_t cpu, uint32_t percpu, uint32_t size) {
+  gdt_entry_t *gdt = gdts[cpu];
+  gdt_register_t gdt_reg;
+  set_gdt_entry(gdt, 0, 0, 0, 0, 0);
+  // 4 GiB ring 0 code (execute/read) and data (read/write) segments.
+  set_gdt_entry(gdt, KERNEL_CS >> 3, 0, 0xfffff, 0x9a, 0xc0);
+  set_gdt_entry(gdt, KERNEL_DS >> 3, 0, 0xfffff, 0x92, 0xc0);
+  // Byte granular, the area is small.
+  set_gdt_entry(gdt, KERNEL_PERCPU >> 3, percpu, size - 1, 0x92, 0x40);
+  gdt_reg.base = (uint32_t)gdt;
+  gdt_reg.limit = sizeof(gdts[cpu]) - 1;
+  asm volatile("lgdtl (%0)\n"
+               "ljmp %1, $1f\n"
+               "1:\n"
+               "mov %2, %%ds\n"
+               "mov %2, %%es\n"
+               "mov %2, %%fs\n"
+               "mov %3, %%gs\n"
+               "mov %2, %%ss\n"
+               :
+               : "r"(&gdt_reg), "i"(KERNEL_CS), "r"(KERNEL_DS), "r"(KERNEL_PERCPU)
+               : "memory");
+}
@@ -0,0 +1,35 @@
+#ifndef GDT_H
+#define GDT_H
+
+#include <stdint.h>
+
+/* Segment selectors, the same as the ones stage 2 sets up */
+#define KERNEL_CS 0x08
+#define KERNEL_DS 0x10
+// Data segment over the per-CPU area, loaded into %gs.
+#define KERNEL_PERCPU 0x18
+
+typedef struct {
+  uint16_t limit_low;
+  uint16_t base_low;
+  uint8_t base_middle;
+  /* Bit 7: present, bits 6-5: privilege level, bit 4: code or data,
+   * bits 3-0: type */
+  uint8_t access;
+  /* Bit 7: limit in pages, bit 6: 32-bit, bits 3-0: limit bits 16-19 */
+  uint8_t granularity;
+  uint8_t base_high;
+} __attribute__((packed)) gdt_entry_t;
+
+typedef struct {
+  uint16_t limit;
+  uint32_t base;
+} __attribute__((packed)) gdt_register_t;
+
+// Load a flat GDT that lives in the kernel image. The one from stage 2 or the
+// multiboot loader is in low memory, which is unmapped once paging_init runs.
+// Each CPU has its own, which differs in the base of the per-CPU segment
+// loaded into %gs: [percpu, percpu + size).
+void gdt_init(uint32_t cpu, uint32_t percpu, uint32_t size);
+
+#endif
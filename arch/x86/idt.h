@@ -1,8 +1,7 @@
 #ifndef IDT_H
 #define IDT_H
 
-/* Segment selectors */
-#define KERNEL_CS 0x08
+#include "gdt.h"
 
 /* How every interrupt gate (handler) is defined */
 typedef struct {
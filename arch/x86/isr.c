@@ -1,10 +1,44 @@
 #include "isr.h"
+#include "apic.h"
+#include "cpu.h"
 #include "idt.h"
 #include "kernel/kprintf.h"
+#include "kernel/softirq.h"
+#include "kernel/thread.h"
+#include "libc/mem.h"
 #include "libc/string.h"
 #include "ports.h"
+#include "smp.h"
+#include <stdint.h>
+
+// Vectors with statistics, the ones with gates.
+#define STATS_VECTORS 64
+#define HISTOGRAM_BUCKETS 32
+
+// Values counted by their highest set bit: bucket i holds [2^i, 2^(i+1)),
+// bucket 0 holds 0 too.
+typedef struct histogram_t {
+  uint32_t buckets[HISTOGRAM_BUCKETS];
+  uint32_t max;
+  // The code running when the worst case was taken.
+  uint32_t max_eip;
+} histogram_t;
+
+typedef struct interrupt_stats_t {
+  uint32_t count;
+  uint64_t cycles;
+  // Cycles from the C entry to its return.
+  histogram_t duration;
+  // Nanoseconds after it was due, only known for the timer.
+  histogram_t latency;
+} interrupt_stats_t;
 
 isr_t interrupt_handlers[256];
+static interrupt_stats_t stats[STATS_VECTORS];
+// Cycles interrupts were off between interrupts_save() and
+// interrupts_restore(), by the function that turned them off. The section
+// being timed is kept per CPU.
+static histogram_t irqoff;
 
 /* Can't do this with a loop because we need the address
  * of the function names */
@@ -71,6 +105,11 @@ void isr_install() {
   set_idt_gate(45, (unsigned int)irq13);
   set_idt_gate(46, (unsigned int)irq14);
   set_idt_gate(47, (unsigned int)irq15);
+  set_idt_gate(IRQ_APIC_TIMER, (unsigned int)irq16);
+  set_idt_gate(IRQ_APIC_ERROR, (unsigned int)irq17);
+  set_idt_gate(IRQ_IPI_CALL, (unsigned int)irq18);
+  set_idt_gate(IRQ_IPI_RESCHEDULE, (unsigned int)irq19);
+  set_idt_gate(IRQ_SPURIOUS, (unsigned int)irq_spurious);
 
   set_idt(); // Load with ASM
 }
@@ -112,14 +151,70 @@ char *exception_messages[] = {"Division By Zero",
                               "Reserved",
                               "Reserved"};
 
-void isr_handler(registers_t r) {
+static void histogram_add(histogram_t *h, uint64_t value, uint32_t eip) {
+  uint32_t v = value > UINT32_MAX ? UINT32_MAX : value;
+  h->buckets[v == 0 ? 0 : 31 - __builtin_clz(v)]++;
+  if (v > h->max) {
+    h->max = v;
+    h->max_eip = eip;
+  }
+}
+
+// 0 without a TSC, before cpu_features_init() has found it.
+static uint64_t stats_start(void) { return cpu_has(X86_FEATURE_TSC) ? rdtsc() : 0; }
+
+static void stats_end(const registers_t *r, uint64_t start) {
+  if (r->int_no >= STATS_VECTORS) {
+    return;
+  }
+  interrupt_stats_t *s = &stats[r->int_no];
+  s->count++;
+  if (start != 0) {
+    uint64_t cycles = rdtsc() - start;
+    s->cycles += cycles;
+    histogram_add(&s->duration, cycles, r->eip);
+  }
+}
+
+void interrupt_latency(uint32_t vector, uint64_t ns, uint32_t eip) {
+  if (vector < STATS_VECTORS) {
+    histogram_add(&stats[vector].latency, ns, eip);
+  }
+}
+
+void irqoff_start(void) {
+  if (cpu_has(X86_FEATURE_TSC)) {
+    percpu_t *cpu = this_cpu();
+    cpu->irqoff_started = rdtsc();
+    cpu->irqoff_site = (uint32_t)__builtin_return_address(0);
+  }
+}
+
+void irqoff_stop(void) {
+  percpu_t *cpu = this_cpu();
+  if (cpu->irqoff_started != 0) {
+    histogram_add(&irqoff, rdtsc() - cpu->irqoff_started, cpu->irqoff_site);
+    cpu->irqoff_started = 0;
+  }
+}
+
+void isr_handler(registers_t *r) {
+  uint64_t start = stats_start();
+  /* Exceptions the kernel can recover from, like page faults */
+  if (interrupt_handlers[r->int_no] != 0) {
+    isr_t handler = interrupt_handlers[r->int_no];
+    handler(r);
+    stats_end(r, start);
+    return;
+  }
   kprintf("Received interrupt exception: ");
   char s[3];
-  int_to_ascii(r.int_no, s);
+  int_to_ascii(r->int_no, s);
   kprintf(s);
   kprintf("\n");
-  kprintf(exception_messages[r.int_no]);
+  kprintf(exception_messages[r->int_no]);
   kprintf("\n");
+  stats_end(r, start);
 }
 
 void register_interrupt_handler(unsigned char n, isr_t handler) {
@@ -129,18 +224,124 @@ void register_interrupt_handler(unsigned char n, isr_t handler) {
   kprintf(buf);
   kprintf("\n");
   interrupt_handlers[n] = handler;
+  if (n >= IRQ0 && n <= IRQ15) {
+    apic_route_irq(n - IRQ0);
+  }
 }
 
-void irq_handler(registers_t r) {
+bool has_interrupt_handler(unsigned char n) { return interrupt_handlers[n] != 0; }
+
+void irq_handler(registers_t *r) {
+  uint64_t start = stats_start();
   /* After every interrupt we need to send an EOI to the PICs
    * or they will not send another interrupt again */
-  if (r.int_no >= 40)
-    outb(0xA0, 0x20); /* slave */
-  outb(0x20, 0x20);   /* master */
+  if (apic_enabled()) {
+    apic_eoi();
+  } else {
+    if (r->int_no >= 40)
+      outb(0xA0, 0x20); /* slave */
+    outb(0x20, 0x20);   /* master */
+  }
 
   /* Handle the interrupt in a more modular way */
-  if (interrupt_handlers[r.int_no] != 0) {
-    isr_t handler = interrupt_handlers[r.int_no];
-    handler(&r);
+  if (interrupt_handlers[r->int_no] != 0) {
+    isr_t handler = interrupt_handlers[r->int_no];
+    handler(r);
+  }
+  stats_end(r, start);
+  // The bottom halves, with interrupts back on. The EOI is sent, so this
+  // interrupt can come in again meanwhile. Devices only interrupt the boot
+  // CPU, the tasklets run there.
+  if (cpu_id() == 0) {
+    softirq_run();
+  }
+  // The interrupted thread continues from here when it gets the CPU back.
+  thread_preempt();
+}
+
+static void print_vector(void (*print)(const char *format, ...), uint32_t vector) {
+  if (vector < 32) {
+    print("%u %s", vector, exception_messages[vector]);
+  } else if (vector == IRQ_APIC_TIMER) {
+    print("%u apic timer", vector);
+  } else if (vector == IRQ_APIC_ERROR) {
+    print("%u apic error", vector);
+  } else if (vector == IRQ_IPI_CALL) {
+    print("%u ipi call", vector);
+  } else if (vector == IRQ_IPI_RESCHEDULE) {
+    print("%u ipi reschedule", vector);
+  } else {
+    print("%u irq %u", vector, vector - IRQ0);
+  }
+}
+
+// A copy, so the interrupts counted while printing do not tear the numbers.
+static void stats_copy(interrupt_stats_t *copy, histogram_t *irqoff_copy) {
+  uint32_t flags = interrupts_save();
+  memmove(copy, stats, sizeof(stats));
+  *irqoff_copy = irqoff;
+  interrupts_restore(flags);
+}
+
+void interrupt_stats_dump(void (*print)(const char *format, ...)) {
+  static interrupt_stats_t copy[STATS_VECTORS];
+  histogram_t irqoff_copy;
+  stats_copy(copy, &irqoff_copy);
+
+  print("vector: count, average and max cycles at eip\n");
+  for (uint32_t vector = 0; vector < STATS_VECTORS; vector++) {
+    const interrupt_stats_t *s = &copy[vector];
+    if (s->count == 0) {
+      continue;
+    }
+    print_vector(print, vector);
+    print(": %u, %u, %u at %x\n", s->count, (uint32_t)div64(s->cycles, s->count), s->duration.max,
+          s->duration.max_eip);
+    if (s->latency.max != 0) {
+      print("  up to %u ns late at %x\n", s->latency.max, s->latency.max_eip);
+    }
   }
+  print("interrupts off: up to %u cycles from %x\n", irqoff_copy.max, irqoff_copy.max_eip);
+}
+
+static void histogram_dump(void (*print)(const char *format, ...), const char *what, const histogram_t *h) {
+  uint32_t last = 0;
+  for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (h->buckets[i] != 0) {
+      last = i + 1;
+    }
+  }
+  if (last == 0) {
+    return;
+  }
+  print("  %s, max %u at %x\n", what, h->max, h->max_eip);
+  for (uint32_t i = 0; i < last; i++) {
+    print("    %u: %u\n", i == 0 ? 0 : 1u << i, h->buckets[i]);
+  }
+}
+
+void interrupt_histograms_dump(void (*print)(const char *format, ...)) {
+  static interrupt_stats_t copy[STATS_VECTORS];
+  histogram_t irqoff_copy;
+  stats_copy(copy, &irqoff_copy);
+
+  for (uint32_t vector = 0; vector < STATS_VECTORS; vector++) {
+    const interrupt_stats_t *s = &copy[vector];
+    if (s->count == 0) {
+      continue;
+    }
+    print_vector(print, vector);
+    print(": %u\n", s->count);
+    histogram_dump(print, "cycles", &s->duration);
+    histogram_dump(print, "ns late", &s->latency);
+  }
+  print("interrupts off\n");
+  histogram_dump(print, "cycles", &irqoff_copy);
+}
+
+void interrupt_stats_reset(void) {
+  uint32_t flags = interrupts_save();
+  memory_set((unsigned char *)stats, 0, sizeof(stats));
+  memory_set((unsigned char *)&irqoff, 0, sizeof(irqoff));
+  interrupts_restore(flags);
 }
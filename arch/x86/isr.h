@@ -1,6 +1,9 @@
 #ifndef ISR_H
 #define ISR_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /* ISRs reserved for CPU exceptions */
 extern void isr0();
 extern void isr1();
@@ -51,6 +54,11 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void irq16();
+extern void irq17();
+extern void irq18();
+extern void irq19();
+extern void irq_spurious();
 
 #define IRQ0 32
 #define IRQ1 33
@@ -68,20 +76,44 @@ extern void irq15();
 #define IRQ13 45
 #define IRQ14 46
 #define IRQ15 47
+// Local APIC interrupts, after the ISA IRQs. The spurious vector needs the low
+// four bits set on older local APICs.
+#define IRQ_APIC_TIMER 48
+#define IRQ_APIC_ERROR 49
+// Sent between CPUs, see smp_call().
+#define IRQ_IPI_CALL 50
+#define IRQ_IPI_RESCHEDULE 51
+#define IRQ_SPURIOUS 63
 
-/* Struct which aggregates many registers */
+/* Struct which aggregates many registers, as the stubs push them. Handlers get
+ * a pointer to it and changes are restored on return. */
 typedef struct {
-   unsigned int ds; /* Data segment selector */
    unsigned int edi, esi, ebp, esp, ebx, edx, ecx, eax; /* Pushed by pusha. */
    unsigned int int_no, err_code; /* Interrupt number and error code (if applicable) */
    unsigned int eip, cs, eflags, useresp, ss; /* Pushed by the processor automatically */
 } registers_t;
 
 void isr_install();
-void isr_handler(registers_t r);
+void isr_handler(registers_t *r);
+void irq_handler(registers_t *r);
 
 typedef void (*isr_t)(registers_t*);
+// For an ISA IRQ this also unmasks it on the I/O APIC, which only delivers
+// the ones with a handler.
 void register_interrupt_handler(unsigned char n, isr_t handler);
+bool has_interrupt_handler(unsigned char n);
+
+// Per-vector counts and the cycles spent from the C entry to its return,
+// including the EOI, with the worst case and the eip it interrupted. Cycles
+// are only taken with a TSC.
+void interrupt_stats_dump(void (*print)(const char *format, ...));
+// The log2 histograms behind them, also of how late the timer was and of the
+// sections with interrupts off. Too long for the screen.
+void interrupt_histograms_dump(void (*print)(const char *format, ...));
+void interrupt_stats_reset(void);
+// Record that interrupt `vector` came `ns` after it was due, interrupting
+// `eip`.
+void interrupt_latency(uint32_t vector, uint64_t ns, uint32_t eip);
 
 #endif
 
@@ -0,0 +1,167 @@
+#include "memory_map.h"
+#include "paging.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include <stdbool.h>
+
+// Where detect_ram in stage 2 stores the E820 map: a 16-bit entry count
+// followed by 24 byte entries.
+#define E820_MAP 0x1000
+#define E820_ENTRIES (E820_MAP + 4)
+#define MEMORY_MAP_MAX_RAW 128
+
+typedef struct e820_entry_t {
+  uint64_t base;
+  uint64_t length;
+  uint32_t type;
+  uint32_t acpi;
+} __attribute__((packed)) e820_entry_t;
+
+static memory_map_t memory_map;
+static memory_region_t raw[MEMORY_MAP_MAX_RAW];
+static size_t n_raw;
+
+static void add_raw(uint64_t base, uint64_t length, uint32_t type) {
+  if (length == 0) {
+    return;
+  }
+  if (n_raw == MEMORY_MAP_MAX_RAW) {
+    kprintf("memory map: too many entries, ignoring the rest\n");
+    return;
+  }
+  // Unknown types must not be used.
+  if (type < MEMORY_USABLE || type > MEMORY_BAD) {
+    type = MEMORY_RESERVED;
+  }
+  // Don't let the end wrap around.
+  if (base + length < base) {
+    length = UINT64_MAX - base;
+  }
+  raw[n_raw].base = base;
+  raw[n_raw].length = length;
+  raw[n_raw].type = type;
+  n_raw++;
+}
+
+static void read_e820(void) {
+  uint16_t n = *(volatile uint16_t *)P2V(E820_MAP);
+  const e820_entry_t *entries = P2V(E820_ENTRIES);
+  for (size_t i = 0; i < n; i++) {
+    add_raw(entries[i].base, entries[i].length, entries[i].type);
+  }
+}
+
+static void read_multiboot(const multiboot_info_t *info) {
+  if (info->flags & MULTIBOOT_INFO_MEM_MAP) {
+    uint32_t p = info->mmap_addr;
+    while (p < info->mmap_addr + info->mmap_length) {
+      const multiboot_mmap_entry_t *entry = P2V(p);
+      add_raw(entry->addr, entry->len, entry->type);
+      p += entry->size + sizeof(entry->size);
+    }
+  } else if (info->flags & MULTIBOOT_INFO_MEMORY) {
+    add_raw(0, (uint64_t)info->mem_lower * 1024, MEMORY_USABLE);
+    add_raw(0x100000, (uint64_t)info->mem_upper * 1024, MEMORY_USABLE);
+  }
+}
+
+// Higher wins when regions overlap.
+static int precedence(memory_type_t type) {
+  switch (type) {
+  case MEMORY_USABLE:
+    return 0;
+  case MEMORY_ACPI_RECLAIMABLE:
+    return 1;
+  case MEMORY_ACPI_NVS:
+    return 2;
+  case MEMORY_RESERVED:
+    return 3;
+  case MEMORY_BAD:
+  default:
+    return 4;
+  }
+}
+
+static void append(uint64_t base, uint64_t end, memory_type_t type) {
+  if (memory_map.n_regions > 0) {
+    memory_region_t *last = &memory_map.regions[memory_map.n_regions - 1];
+    if (last->type == type && last->base + last->length == base) {
+      last->length = end - last->base;
+      return;
+    }
+  }
+  if (memory_map.n_regions == MEMORY_MAP_MAX_REGIONS) {
+    kprintf("memory map: too many regions, ignoring the rest\n");
+    return;
+  }
+  memory_region_t *region = &memory_map.regions[memory_map.n_regions++];
+  region->base = base;
+  region->length = end - base;
+  region->type = type;
+}
+
+// Split the raw entries at every boundary and give each piece the type of the
+// most restrictive entry covering it. The entries are few, so quadratic is
+// fine.
+static void normalize(void) {
+  static uint64_t bounds[2 * MEMORY_MAP_MAX_RAW];
+  size_t n_bounds = 0;
+
+  for (size_t i = 0; i < n_raw; i++) {
+    bounds[n_bounds++] = raw[i].base;
+    bounds[n_bounds++] = raw[i].base + raw[i].length;
+  }
+  for (size_t i = 1; i < n_bounds; i++) {
+    uint64_t bound = bounds[i];
+    size_t j = i;
+    while (j > 0 && bounds[j - 1] > bound) {
+      bounds[j] = bounds[j - 1];
+      j--;
+    }
+    bounds[j] = bound;
+  }
+
+  memory_map.n_regions = 0;
+  for (size_t i = 0; i + 1 < n_bounds; i++) {
+    uint64_t base = bounds[i];
+    uint64_t end = bounds[i + 1];
+    if (base == end) {
+      continue;
+    }
+    bool covered = false;
+    memory_type_t type = MEMORY_USABLE;
+    for (size_t j = 0; j < n_raw; j++) {
+      if (raw[j].base <= base && end <= raw[j].base + raw[j].length) {
+        if (!covered || precedence(raw[j].type) > precedence(type)) {
+          type = raw[j].type;
+        }
+        covered = true;
+      }
+    }
+    if (covered) {
+      append(base, end, type);
+    }
+  }
+}
+
+void memory_map_init(uint32_t magic, const multiboot_info_t *info) {
+  n_raw = 0;
+  if (magic == MULTIBOOT_BOOTLOADER_MAGIC) {
+    read_multiboot(info);
+  } else {
+    read_e820();
+  }
+  normalize();
+  TRACE("MEMORY", 1, "%d raw entries, %d regions", n_raw, memory_map.n_regions);
+}
+
+const memory_map_t *memory_map_get(void) { return &memory_map; }
+
+void memory_map_dump(void) {
+  static const char *names[] = {"", "usable", "reserved", "ACPI reclaimable", "ACPI NVS", "bad"};
+  for (size_t i = 0; i < memory_map.n_regions; i++) {
+    const memory_region_t *region = &memory_map.regions[i];
+    kprintf("%u KiB - %u KiB %s\n", (uint32_t)(region->base >> 10), (uint32_t)((region->base + region->length) >> 10),
+            names[region->type]);
+  }
+}
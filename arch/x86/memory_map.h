@@ -0,0 +1,41 @@
+#ifndef ARCH_X86_MEMORY_MAP_H
+#define ARCH_X86_MEMORY_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "multiboot.h"
+
+#define MEMORY_MAP_MAX_REGIONS 64
+
+// Region types as reported by E820. Multiboot uses the same values.
+typedef enum memory_type_t {
+  MEMORY_USABLE = 1,
+  MEMORY_RESERVED = 2,
+  MEMORY_ACPI_RECLAIMABLE = 3,
+  MEMORY_ACPI_NVS = 4,
+  MEMORY_BAD = 5,
+} memory_type_t;
+
+typedef struct memory_region_t {
+  uint64_t base;
+  uint64_t length;
+  memory_type_t type;
+} memory_region_t;
+
+// Sorted, non-overlapping regions. Adjacent regions of the same type are
+// merged and overlaps are resolved in favour of the more restrictive type.
+typedef struct memory_map_t {
+  memory_region_t regions[MEMORY_MAP_MAX_REGIONS];
+  size_t n_regions;
+} memory_map_t;
+
+// Build the memory map from the multiboot information if `magic` says we were
+// booted by a multiboot loader, otherwise from the E820 entries left behind by
+// stage 2. Runs on the boot page directory, so `info` and the map it points to
+// must be in the first 16 MiB, where multiboot loaders put them.
+void memory_map_init(uint32_t magic, const multiboot_info_t *info);
+const memory_map_t *memory_map_get(void);
+void memory_map_dump(void);
+
+#endif
@@ -0,0 +1,228 @@
+#include "memtype.h"
+#include "cpu.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include <stdbool.h>
+
+#define MSR_MTRR_CAP 0xfe
+#define MSR_MTRR_BASE(i) (0x200 + 2 * (i))
+#define MSR_MTRR_MASK(i) (0x201 + 2 * (i))
+#define MSR_MTRR_FIX_64K 0x250
+#define MSR_MTRR_FIX_16K 0x258
+#define MSR_MTRR_FIX_4K 0x268
+#define MSR_PAT 0x277
+#define MSR_MTRR_DEF_TYPE 0x2ff
+
+#define MTRR_CAP_COUNT 0xff
+#define MTRR_CAP_FIXED (1 << 8)
+#define MTRR_CAP_WC (1 << 10)
+#define MTRR_ENABLED (1 << 11)
+#define MTRR_FIXED_ENABLED (1 << 10)
+#define MTRR_MASK_VALID (1 << 11)
+// Physical address bits a variable range mask covers, for CPUs that do not
+// report their width.
+#define MTRR_ADDRESS_BITS 36
+// MTRRs changed here, more than the variable ranges there are.
+#define MTRR_WRITES 32
+
+// Encodings shared by the PAT and the MTRRs.
+#define TYPE_UC 0x00
+#define TYPE_WC 0x01
+#define TYPE_WT 0x04
+#define TYPE_WB 0x06
+#define TYPE_UC_MINUS 0x07
+
+// Entries 0-3 are selected by PWT and PCD: WB, WC, UC- and UC. The upper half,
+// used when the PAT bit is set, repeats them.
+#define PAT_ENTRIES                                                                                                  \
+  ((uint64_t)TYPE_WB | (uint64_t)TYPE_WC << 8 | (uint64_t)TYPE_UC_MINUS << 16 | (uint64_t)TYPE_UC << 24)
+#define PAT_VALUE (PAT_ENTRIES | PAT_ENTRIES << 32)
+
+static bool pat;
+static bool mtrr;
+static uint32_t mtrr_count;
+static uint32_t mtrr_used;
+static bool mtrr_fixed;
+static uint64_t mtrr_address_mask;
+// What was written to the MTRRs, for the other CPUs, which must agree.
+static struct {
+  uint32_t msr;
+  uint64_t value;
+} mtrr_writes[MTRR_WRITES];
+static uint32_t n_mtrr_writes;
+
+// PWT and PCD select the same types with and without the PAT, except that
+// PWT alone is write-through without one.
+static const uint32_t cache_flags[] = {
+    [MEMTYPE_WB] = 0,
+    [MEMTYPE_WC] = PAGE_WRITE_THROUGH,
+    [MEMTYPE_UC_MINUS] = PAGE_NO_CACHE,
+    [MEMTYPE_UC] = PAGE_NO_CACHE | PAGE_WRITE_THROUGH,
+};
+
+static void flush_tlb(void) {
+  uint32_t cr4 = read_cr4();
+  if (cr4 & CR4_PGE) {
+    // Global pages are only dropped by toggling PGE.
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+  } else {
+    write_cr3(read_cr3());
+  }
+}
+
+// Memory types may only change with caches disabled and flushed, and the
+// MTRRs must be off while they are rewritten.
+static uint32_t begin_change(void) {
+  uint32_t flags = interrupts_save();
+  write_cr0((read_cr0() | CR0_CD) & ~CR0_NW);
+  wbinvd();
+  flush_tlb();
+  if (mtrr) {
+    wrmsr(MSR_MTRR_DEF_TYPE, rdmsr(MSR_MTRR_DEF_TYPE) & ~MTRR_ENABLED);
+  }
+  return flags;
+}
+
+static void end_change(uint32_t flags) {
+  if (mtrr) {
+    wrmsr(MSR_MTRR_DEF_TYPE, rdmsr(MSR_MTRR_DEF_TYPE) | MTRR_ENABLED);
+  }
+  wbinvd();
+  flush_tlb();
+  write_cr0(read_cr0() & ~CR0_CD);
+  interrupts_restore(flags);
+}
+
+static void write_mtrr(uint32_t msr, uint64_t value) {
+  wrmsr(msr, value);
+  uint32_t i = 0;
+  while (i < n_mtrr_writes && mtrr_writes[i].msr != msr) {
+    i++;
+  }
+  if (i < MTRR_WRITES) {
+    mtrr_writes[i].msr = msr;
+    mtrr_writes[i].value = value;
+    n_mtrr_writes += i == n_mtrr_writes;
+  }
+}
+
+// The fixed range MSR and the byte in it for `address` below 1 MiB, and the
+// size that byte covers.
+static uint32_t fixed_range(uint32_t address, uint32_t *byte, uint32_t *size) {
+  if (address < 0x80000) {
+    *byte = address >> 16;
+    *size = 0x10000;
+    return MSR_MTRR_FIX_64K;
+  }
+  if (address < 0xc0000) {
+    *byte = (address >> 14) & 7;
+    *size = 0x4000;
+    return MSR_MTRR_FIX_16K + ((address - 0x80000) >> 17);
+  }
+  *byte = (address >> 12) & 7;
+  *size = 0x1000;
+  return MSR_MTRR_FIX_4K + ((address - 0xc0000) >> 15);
+}
+
+static bool set_fixed(uint32_t start, uint32_t end, uint8_t type) {
+  uint32_t byte, size;
+  for (uint32_t address = start; address < end; address += size) {
+    fixed_range(address, &byte, &size);
+    if (address & (size - 1) || address + size > end) {
+      return false;
+    }
+  }
+  uint32_t flags = begin_change();
+  for (uint32_t address = start; address < end; address += size) {
+    uint32_t msr = fixed_range(address, &byte, &size);
+    uint64_t value = rdmsr(msr) & ~((uint64_t)0xff << (byte * 8));
+    write_mtrr(msr, value | (uint64_t)type << (byte * 8));
+  }
+  end_change(flags);
+  return true;
+}
+
+// A variable range needs a power of two size and a base aligned to it.
+static bool set_variable(uint32_t base, uint32_t size, uint8_t type) {
+  if (size & (size - 1) || base & (size - 1)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < mtrr_count; i++) {
+    if (rdmsr(MSR_MTRR_MASK(i)) & MTRR_MASK_VALID) {
+      continue;
+    }
+    uint32_t flags = begin_change();
+    write_mtrr(MSR_MTRR_BASE(i), base | type);
+    write_mtrr(MSR_MTRR_MASK(i), (~(uint64_t)(size - 1) & mtrr_address_mask) | MTRR_MASK_VALID);
+    end_change(flags);
+    mtrr_used++;
+    return true;
+  }
+  return false;
+}
+
+void memtype_init(void) {
+  if (!cpu_has(X86_FEATURE_MSR)) {
+    return;
+  }
+  pat = cpu_has(X86_FEATURE_PAT);
+  if (cpu_has(X86_FEATURE_MTRR)) {
+    uint64_t cap = rdmsr(MSR_MTRR_CAP);
+    uint64_t def = rdmsr(MSR_MTRR_DEF_TYPE);
+    mtrr = (cap & MTRR_CAP_WC) && (def & MTRR_ENABLED);
+    mtrr_count = cap & MTRR_CAP_COUNT;
+    mtrr_fixed = (cap & MTRR_CAP_FIXED) && (def & MTRR_FIXED_ENABLED);
+    mtrr_address_mask = ((uint64_t)1 << MTRR_ADDRESS_BITS) - 1;
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000008) {
+      cpuid(0x80000008, &eax, &ebx, &ecx, &edx);
+      mtrr_address_mask = ((uint64_t)1 << (eax & 0xff)) - 1;
+    }
+  }
+  if (pat) {
+    uint32_t flags = begin_change();
+    wrmsr(MSR_PAT, PAT_VALUE);
+    end_change(flags);
+  }
+  TRACE("MEMTYPE", 1, "pat %d, %d variable mtrrs", pat, mtrr ? mtrr_count : 0);
+}
+
+void memtype_init_ap(void) {
+  if (!pat && n_mtrr_writes == 0) {
+    return;
+  }
+  uint32_t flags = begin_change();
+  if (pat) {
+    wrmsr(MSR_PAT, PAT_VALUE);
+  }
+  for (uint32_t i = 0; i < n_mtrr_writes; i++) {
+    wrmsr(mtrr_writes[i].msr, mtrr_writes[i].value);
+  }
+  end_change(flags);
+}
+
+uint32_t memtype_flags(uint32_t physical, uint32_t size, memtype_t type) {
+  if (pat || type != MEMTYPE_WC) {
+    return cache_flags[type];
+  }
+  // Write-back pages in a write-combining MTRR range are write-combined.
+  uint32_t end = physical + size;
+  if (mtrr && end <= 0x100000 && mtrr_fixed && set_fixed(physical, end, TYPE_WC)) {
+    return cache_flags[MEMTYPE_WB];
+  }
+  if (mtrr && physical >= 0x100000 && set_variable(physical, size, TYPE_WC)) {
+    return cache_flags[MEMTYPE_WB];
+  }
+  return cache_flags[MEMTYPE_UC_MINUS];
+}
+
+void memtype_dump(void) {
+  kprintf("memory types: %s, mtrrs %s", pat ? "pat" : "no pat", mtrr ? "on" : "off");
+  if (mtrr) {
+    kprintf(" (%u of %u variable ranges taken here, fixed ranges %s)", mtrr_used, mtrr_count,
+            mtrr_fixed ? "on" : "off");
+  }
+  kprintf("\n");
+}
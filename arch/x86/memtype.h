@@ -0,0 +1,29 @@
+#ifndef MEMTYPE_H
+#define MEMTYPE_H
+
+#include "paging.h"
+#include <stdint.h>
+
+// How the CPU caches a mapping. Write-combining suits memory that is written
+// in bulk and rarely read, like video memory.
+typedef enum memtype_t {
+  MEMTYPE_WB,
+  MEMTYPE_WC,
+  // Uncached, unless an MTRR says otherwise.
+  MEMTYPE_UC_MINUS,
+  MEMTYPE_UC,
+} memtype_t;
+
+// Program the PAT, or find the MTRRs to fall back to. The PAT is set up so
+// that every type is selected by PWT and PCD alone and its own bit is unused.
+void memtype_init(void);
+// Give an application processor the same PAT, and the MTRRs the boot CPU
+// changed so far. Later changes do not reach CPUs already running.
+void memtype_init_ap(void);
+// Cache bits for mapping [physical, physical + size) as `type`. Without a PAT,
+// write-combining takes an MTRR that stays programmed. If none is free the
+// range is left uncached.
+uint32_t memtype_flags(uint32_t physical, uint32_t size, memtype_t type);
+void memtype_dump(void);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef ARCH_X86_MULTIBOOT_H
+#define ARCH_X86_MULTIBOOT_H
+
+#include <stdint.h>
+
+// Value of eax when the kernel is entered by a multiboot compliant boot loader.
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2badb002
+
+#define MULTIBOOT_INFO_MEMORY (1 << 0)
+#define MULTIBOOT_INFO_MEM_MAP (1 << 6)
+
+// The boot information structure passed in ebx. Only the fields up to the
+// memory map are described here.
+typedef struct multiboot_info_t {
+  uint32_t flags;
+  // Amount of lower and upper memory in KiB (MULTIBOOT_INFO_MEMORY).
+  uint32_t mem_lower;
+  uint32_t mem_upper;
+  uint32_t boot_device;
+  uint32_t cmdline;
+  uint32_t mods_count;
+  uint32_t mods_addr;
+  uint32_t syms[4];
+  // Buffer of multiboot_mmap_entry_t (MULTIBOOT_INFO_MEM_MAP).
+  uint32_t mmap_length;
+  uint32_t mmap_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+// `size` is the size of the rest of the entry, which may be larger than the
+// fields below.
+typedef struct multiboot_mmap_entry_t {
+  uint32_t size;
+  uint64_t addr;
+  uint64_t len;
+  uint32_t type;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+#endif
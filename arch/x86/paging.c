@@ -0,0 +1,284 @@
+#include "paging.h"
+#include "cpu.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include "memory_map.h"
+#include "mm/frame.h"
+#include <stddef.h>
+
+#define PTE_INDEX(address) (((address) >> PAGE_SHIFT) & (PAGE_ENTRIES - 1))
+
+// Built by enable_paging, used until paging_init switches to kernel_directory.
+pde_t boot_page_directory[PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+static pde_t kernel_directory[PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+// PAGE_GLOBAL if the CPU supports global pages.
+static uint32_t global;
+
+// Provided by the linker script.
+extern char _end[];
+
+static pde_t *current_directory(void) { return P2V(read_cr3()); }
+
+// Drop a stale TLB entry. Kernel mappings are shared by all directories and
+// may be global, so they are always flushed.
+static void flush(pde_t *directory, uint32_t virtual) {
+  if (virtual >= KERNEL_VIRTUAL_BASE || directory == current_directory()) {
+    invlpg(virtual);
+  }
+}
+
+static uint32_t n_pages(uint32_t virtual, uint32_t size) {
+  return ((virtual & ~PAGE_MASK) + size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+}
+
+// Whether the n pages from `virtual` cover the whole 4 MiB page it is in.
+static bool covers_large_page(uint32_t virtual, uint32_t n) {
+  return (virtual & ~LARGE_PAGE_MASK) == 0 && n >= PAGE_ENTRIES;
+}
+
+// Pages left in the page table `virtual` is in, to skip unmapped tables.
+static uint32_t table_remaining(uint32_t virtual, uint32_t n) {
+  uint32_t remaining = PAGE_ENTRIES - PTE_INDEX(virtual);
+  return remaining < n ? remaining : n;
+}
+
+// Replace a 4 MiB page by a page table mapping the same memory with the same
+// flags.
+static bool split(pde_t *directory, pde_t *pde, uint32_t virtual) {
+  uint32_t table = frame_alloc(0);
+  if (table == 0) {
+    return false;
+  }
+  pte_t *entries = P2V(table);
+  uint32_t physical = *pde & LARGE_PAGE_MASK;
+  uint32_t flags = *pde & PAGE_FLAGS & ~PAGE_LARGE;
+  for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+    entries[i] = (physical + i * PAGE_SIZE) | flags;
+  }
+  *pde = table | PAGE_PRESENT | PAGE_WRITE | (*pde & PAGE_USER);
+  flush(directory, virtual & LARGE_PAGE_MASK);
+  TRACE("PAGING", 2, "split the 4 MiB page at %x", virtual & LARGE_PAGE_MASK);
+  return true;
+}
+
+// The page table covering `virtual`, or NULL if there is none. With `create`,
+// a missing table is allocated and a 4 MiB page is split.
+static pte_t *page_table(pde_t *directory, uint32_t virtual, bool create) {
+  pde_t *pde = &directory[PDE_INDEX(virtual)];
+  if (!(*pde & PAGE_PRESENT)) {
+    if (!create) {
+      return NULL;
+    }
+    uint32_t table = frame_alloc_zeroed();
+    if (table == 0) {
+      return NULL;
+    }
+    // Page table entries decide the access rights, the directory entry only
+    // keeps user code out of kernel space.
+    *pde = table | PAGE_PRESENT | PAGE_WRITE | (virtual < KERNEL_VIRTUAL_BASE ? PAGE_USER : 0);
+  } else if (*pde & PAGE_LARGE) {
+    if (!create || !split(directory, pde, virtual)) {
+      return NULL;
+    }
+  }
+  return P2V(*pde & PAGE_MASK);
+}
+
+void paging_init(void) {
+  // enable_paging already relies on 4 MiB pages, so only global pages are
+  // optional.
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  if (edx & CPUID_EDX_PGE) {
+    write_cr4(read_cr4() | CR4_PGE);
+    global = PAGE_GLOBAL;
+  }
+
+  // Map everything the memory map knows to be RAM, ACPI tables included.
+  const memory_map_t *map = memory_map_get();
+  uint64_t top = V2P(_end);
+  for (size_t i = 0; i < map->n_regions; i++) {
+    const memory_region_t *region = &map->regions[i];
+    if (region->type != MEMORY_RESERVED && region->type != MEMORY_BAD && region->base + region->length > top) {
+      top = region->base + region->length;
+    }
+  }
+  if (top > DIRECT_MAP_SIZE) {
+    top = DIRECT_MAP_SIZE;
+  }
+  for (uint32_t physical = 0; physical < top; physical += LARGE_PAGE_SIZE) {
+    kernel_directory[PDE_INDEX(KERNEL_VIRTUAL_BASE + physical)] =
+        physical | PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE | global;
+  }
+
+  // Make read-only pages read-only for the kernel too.
+  write_cr0(read_cr0() | CR0_WP);
+  paging_switch(kernel_directory);
+  TRACE("PAGING", 1, "direct map of %d MiB", (uint32_t)((top + LARGE_PAGE_SIZE - 1) >> 20));
+}
+
+void paging_init_ap(void) {
+  if (global) {
+    write_cr4(read_cr4() | CR4_PGE);
+  }
+  write_cr0(read_cr0() | CR0_WP);
+}
+
+pde_t *paging_kernel_directory(void) { return kernel_directory; }
+
+void paging_switch(pde_t *directory) { write_cr3(V2P(directory)); }
+
+bool paging_map(pde_t *directory, uint32_t virtual, uint32_t physical, uint32_t size, uint32_t flags) {
+  uint32_t n = n_pages(virtual, size);
+  virtual &= PAGE_MASK;
+  physical &= PAGE_MASK;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t address = virtual + i * PAGE_SIZE;
+    pte_t *table = page_table(directory, address, true);
+    if (table == NULL) {
+      return false;
+    }
+    table[PTE_INDEX(address)] = (physical + i * PAGE_SIZE) | (flags & PAGE_FLAGS) | PAGE_PRESENT;
+    flush(directory, address);
+  }
+  return true;
+}
+
+void paging_unmap(pde_t *directory, uint32_t virtual, uint32_t size) {
+  uint32_t n = n_pages(virtual, size);
+  virtual &= PAGE_MASK;
+  for (uint32_t i = 0; i < n;) {
+    uint32_t address = virtual + i * PAGE_SIZE;
+    pde_t *pde = &directory[PDE_INDEX(address)];
+    if (!(*pde & PAGE_PRESENT)) {
+      i += table_remaining(address, n - i);
+      continue;
+    }
+    if (*pde & PAGE_LARGE && covers_large_page(address, n - i)) {
+      *pde = 0;
+      flush(directory, address);
+      i += PAGE_ENTRIES;
+      continue;
+    }
+    pte_t *table = page_table(directory, address, true);
+    if (table != NULL) {
+      table[PTE_INDEX(address)] = 0;
+      flush(directory, address);
+    }
+    i++;
+  }
+}
+
+// Keep the `keep` bits of the mapped pages in [virtual, virtual + size) and set
+// `set`.
+static bool update(pde_t *directory, uint32_t virtual, uint32_t size, uint32_t keep, uint32_t set) {
+  uint32_t n = n_pages(virtual, size);
+  virtual &= PAGE_MASK;
+  for (uint32_t i = 0; i < n;) {
+    uint32_t address = virtual + i * PAGE_SIZE;
+    pde_t *pde = &directory[PDE_INDEX(address)];
+    if (!(*pde & PAGE_PRESENT)) {
+      i += table_remaining(address, n - i);
+      continue;
+    }
+    if (*pde & PAGE_LARGE && covers_large_page(address, n - i)) {
+      *pde = (*pde & keep) | set | PAGE_LARGE | PAGE_PRESENT;
+      flush(directory, address);
+      i += PAGE_ENTRIES;
+      continue;
+    }
+    pte_t *table = page_table(directory, address, true);
+    if (table == NULL) {
+      return false;
+    }
+    pte_t *pte = &table[PTE_INDEX(address)];
+    if (*pte & PAGE_PRESENT) {
+      *pte = (*pte & keep) | set | PAGE_PRESENT;
+      flush(directory, address);
+    }
+    i++;
+  }
+  return true;
+}
+
+bool paging_protect(pde_t *directory, uint32_t virtual, uint32_t size, uint32_t flags) {
+  return update(directory, virtual, size, ~PAGE_FLAGS, flags & PAGE_FLAGS);
+}
+
+bool paging_set_cache(pde_t *directory, uint32_t virtual, uint32_t size, uint32_t cache) {
+  return update(directory, virtual, size, ~PAGE_CACHE_MASK, cache & PAGE_CACHE_MASK);
+}
+
+pte_t *paging_entry(pde_t *directory, uint32_t virtual, bool create) {
+  pte_t *table = page_table(directory, virtual, create);
+  return table == NULL ? NULL : &table[PTE_INDEX(virtual)];
+}
+
+void paging_flush(pde_t *directory, uint32_t virtual) { flush(directory, virtual & PAGE_MASK); }
+
+bool paging_translate(pde_t *directory, uint32_t virtual, uint32_t *physical, uint32_t *flags) {
+  pde_t pde = directory[PDE_INDEX(virtual)];
+  if (!(pde & PAGE_PRESENT)) {
+    return false;
+  }
+  uint32_t entry = pde;
+  uint32_t address = (pde & LARGE_PAGE_MASK) | (virtual & ~LARGE_PAGE_MASK);
+  if (!(pde & PAGE_LARGE)) {
+    entry = ((pte_t *)P2V(pde & PAGE_MASK))[PTE_INDEX(virtual)];
+    if (!(entry & PAGE_PRESENT)) {
+      return false;
+    }
+    address = (entry & PAGE_MASK) | (virtual & ~PAGE_MASK);
+  }
+  if (physical != NULL) {
+    *physical = address;
+  }
+  if (flags != NULL) {
+    *flags = entry & PAGE_FLAGS;
+  }
+  return true;
+}
+
+static void dump_run(uint32_t start, uint32_t end, uint32_t physical, uint32_t flags) {
+  kprintf("%x - %x -> %x %s%s%s%s\n", start, end - 1, physical, flags & PAGE_WRITE ? "rw" : "ro",
+          flags & PAGE_USER ? " user" : "", flags & PAGE_LARGE ? " 4M" : "", flags & PAGE_GLOBAL ? " global" : "");
+}
+
+// One line per run of entries that map contiguous memory with the same flags.
+void paging_dump(pde_t *directory) {
+  uint32_t start = 0, end = 0, physical = 0, flags = 0;
+  bool in_run = false;
+  for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+    pde_t pde = directory[i];
+    if (!(pde & PAGE_PRESENT)) {
+      continue;
+    }
+    uint32_t n = pde & PAGE_LARGE ? 1 : PAGE_ENTRIES;
+    uint32_t size = pde & PAGE_LARGE ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    pte_t *table = pde & PAGE_LARGE ? &directory[i] : P2V(pde & PAGE_MASK);
+    for (uint32_t j = 0; j < n; j++) {
+      uint32_t entry = table[j];
+      uint32_t address = (i << LARGE_PAGE_SHIFT) + j * size;
+      if (!(entry & PAGE_PRESENT)) {
+        continue;
+      }
+      uint32_t entry_flags = entry & (PAGE_WRITE | PAGE_USER | PAGE_GLOBAL | (pde & PAGE_LARGE));
+      uint32_t entry_physical = pde & PAGE_LARGE ? entry & LARGE_PAGE_MASK : entry & PAGE_MASK;
+      if (in_run && address == end && entry_physical == physical + (end - start) && entry_flags == flags) {
+        end += size;
+        continue;
+      }
+      if (in_run) {
+        dump_run(start, end, physical, flags);
+      }
+      in_run = true;
+      start = address;
+      end = address + size;
+      physical = entry_physical;
+      flags = entry_flags;
+    }
+  }
+  if (in_run) {
+    dump_run(start, end, physical, flags);
+  }
+}
@@ -0,0 +1,80 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+#define LARGE_PAGE_SHIFT 22
+#define LARGE_PAGE_SIZE (1 << LARGE_PAGE_SHIFT)
+#define LARGE_PAGE_MASK (~(LARGE_PAGE_SIZE - 1))
+#define PAGE_ENTRIES 1024
+#define PDE_INDEX(address) ((address) >> LARGE_PAGE_SHIFT)
+
+// The kernel is linked at KERNEL_VIRTUAL_BASE + its physical address and all
+// RAM below DIRECT_MAP_SIZE is mapped there, so physical memory the kernel
+// owns is reached with P2V() and turned back into a physical address with
+// V2P(). The rest of the top quarter is left for mappings made on demand.
+#define KERNEL_VIRTUAL_BASE 0xc0000000
+#define DIRECT_MAP_SIZE 0x30000000
+#define P2V(address) ((void *)((uint32_t)(address) + KERNEL_VIRTUAL_BASE))
+#define V2P(address) ((uint32_t)(address) - KERNEL_VIRTUAL_BASE)
+
+/* Page directory and page table entry bits */
+#define PAGE_PRESENT (1 << 0)
+#define PAGE_WRITE (1 << 1)
+#define PAGE_USER (1 << 2)
+#define PAGE_WRITE_THROUGH (1 << 3)
+#define PAGE_NO_CACHE (1 << 4)
+// Select the memory type, see arch/x86/memtype.h.
+#define PAGE_CACHE_MASK (PAGE_WRITE_THROUGH | PAGE_NO_CACHE)
+#define PAGE_ACCESSED (1 << 5)
+#define PAGE_DIRTY (1 << 6)
+// In a page directory entry: maps a 4 MiB page instead of a page table.
+#define PAGE_LARGE (1 << 7)
+// Kept in the TLB across address space switches.
+#define PAGE_GLOBAL (1 << 8)
+// Bits 9-11 are left to software. Read-only page shared copy-on-write.
+#define PAGE_COW (1 << 9)
+#define PAGE_FLAGS (PAGE_SIZE - 1)
+
+typedef uint32_t pde_t;
+typedef uint32_t pte_t;
+
+// Switch from the boot page directory to the kernel one, which maps the kernel
+// image and the direct map with 4 MiB pages and drops the identity mapping of
+// low memory. Needs the memory map.
+void paging_init(void);
+// Turn on the paging features paging_init() chose on an application
+// processor, which is already on the kernel directory.
+void paging_init_ap(void);
+pde_t *paging_kernel_directory(void);
+void paging_switch(pde_t *directory);
+
+// Map [virtual, virtual + size) to [physical, physical + size) with 4 KiB
+// pages, allocating page tables as needed. Existing mappings are replaced and
+// 4 MiB pages in the range are split. Returns false if a page table could not
+// be allocated, in which case part of the range may be mapped.
+bool paging_map(pde_t *directory, uint32_t virtual, uint32_t physical, uint32_t size, uint32_t flags);
+// Remove the mappings of [virtual, virtual + size). The frames are the
+// caller's.
+void paging_unmap(pde_t *directory, uint32_t virtual, uint32_t size);
+// Replace the flags of the mapped pages in [virtual, virtual + size). Whole
+// 4 MiB pages keep their size, others are split. Returns false if a page table
+// for a split could not be allocated.
+bool paging_protect(pde_t *directory, uint32_t virtual, uint32_t size, uint32_t flags);
+// Like paging_protect, replacing only the PAGE_CACHE_MASK bits.
+bool paging_set_cache(pde_t *directory, uint32_t virtual, uint32_t size, uint32_t cache);
+// The page table entry of `virtual`, NULL if there is no page table for it or
+// it is in a 4 MiB page. With `create`, the table is allocated or the 4 MiB
+// page split. Changes made through it must be followed by paging_flush().
+pte_t *paging_entry(pde_t *directory, uint32_t virtual, bool create);
+void paging_flush(pde_t *directory, uint32_t virtual);
+// Physical address and flags `virtual` is mapped to, false if it is unmapped.
+// `flags` may be NULL.
+bool paging_translate(pde_t *directory, uint32_t virtual, uint32_t *physical, uint32_t *flags);
+void paging_dump(pde_t *directory);
+
+#endif
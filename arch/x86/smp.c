@@ -0,0 +1,214 @@
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "isr.h"
+#include "kernel/kprintf.h"
+#include "kernel/thread.h"
+#include "kernel/trace.h"
+#include "libc/mem.h"
+#include "memory_map.h"
+#include "memtype.h"
+#include "mm/kmalloc.h"
+#include "paging.h"
+#include "timer.h"
+#include <stddef.h>
+
+#define AP_STACK_SIZE 16384
+// How long a started CPU gets to reach ap_main().
+#define AP_TIMEOUT_NS 100000000ull
+// Real mode code has to be in the first MiB.
+#define TRAMPOLINE_LIMIT 0x100000
+
+extern char trampoline_start[];
+extern char trampoline_end[];
+extern char _kernel_start[];
+extern char _end[];
+
+// Read by ap_entry in trampoline.asm for the CPU being started.
+uint32_t smp_boot_directory;
+uint32_t smp_boot_stack;
+
+static percpu_t cpus[SMP_MAX_CPUS];
+static uint32_t n_cpus = 1;
+static percpu_t *booting;
+
+static void call_interrupt(registers_t *r) {
+  (void)r;
+  percpu_t *cpu = this_cpu();
+  cpu->ipis++;
+  if (__atomic_load_n(&cpu->call_pending, __ATOMIC_ACQUIRE)) {
+    cpu->call_func(cpu->call_data);
+    __atomic_store_n(&cpu->call_pending, false, __ATOMIC_RELEASE);
+  }
+}
+
+// Only counted, the scheduler runs on the way out of the interrupt.
+static void reschedule_interrupt(registers_t *r) {
+  (void)r;
+  this_cpu()->ipis++;
+}
+
+static void percpu_init(percpu_t *cpu, uint32_t id, uint32_t apic_id) {
+  cpu->self = cpu;
+  cpu->id = id;
+  cpu->apic_id = apic_id;
+  gdt_init(id, (uint32_t)cpu, sizeof(*cpu));
+}
+
+void smp_early_init(void) {
+  percpu_init(&cpus[0], 0, 0);
+  cpus[0].online = true;
+}
+
+// Where the application processors come in, on their own stack and the
+// kernel page directory, with interrupts disabled.
+void ap_main(void) {
+  percpu_t *cpu = booting;
+  percpu_init(cpu, cpu->id, cpu->apic_id);
+  set_idt();
+  paging_init_ap();
+  memtype_init_ap();
+  fpu_init_ap();
+  apic_init_ap();
+  sched_init_ap();
+  __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+  // The idle thread of this CPU from here on.
+  interrupts_enable();
+  while (1) {
+    asm volatile("hlt");
+  }
+}
+
+// A free page for the trampoline: usable memory below 1 MiB that the kernel
+// image is not in. Page 0 has the real mode interrupt table. Nothing else
+// uses low memory once the kernel runs, the frame allocator leaves it alone.
+static uint32_t trampoline_page(void) {
+  const memory_map_t *map = memory_map_get();
+  uint32_t kernel_start = V2P(_kernel_start);
+  uint32_t kernel_end = V2P(_end);
+  for (size_t i = 0; i < map->n_regions; i++) {
+    const memory_region_t *region = &map->regions[i];
+    if (region->type != MEMORY_USABLE || region->base >= TRAMPOLINE_LIMIT) {
+      continue;
+    }
+    uint32_t end = region->base + region->length < TRAMPOLINE_LIMIT ? region->base + region->length
+                                                                     : TRAMPOLINE_LIMIT;
+    uint32_t page = (region->base + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    for (page = page > 0 ? page : PAGE_SIZE; page + PAGE_SIZE <= end; page += PAGE_SIZE) {
+      if (page + PAGE_SIZE <= kernel_start || page >= kernel_end) {
+        return page;
+      }
+    }
+  }
+  return 0;
+}
+
+// Start the CPU with `apic_id` as number `id`, and wait for it to come up.
+static bool start(uint32_t id, uint32_t apic_id, uint32_t page) {
+  percpu_t *cpu = &cpus[id];
+  void *stack = kmalloc(AP_STACK_SIZE, MEMTAG_THREAD);
+  if (stack == NULL) {
+    return false;
+  }
+  cpu->id = id;
+  cpu->apic_id = apic_id;
+  booting = cpu;
+  smp_boot_directory = V2P(paging_kernel_directory());
+  smp_boot_stack = (uint32_t)stack + AP_STACK_SIZE;
+  apic_start_cpu(apic_id, page);
+  uint64_t deadline = timer_ns() + AP_TIMEOUT_NS;
+  while (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+    if (timer_ns() > deadline) {
+      // It may still come up later and use the stack, so keep it.
+      return false;
+    }
+    cpu_relax();
+  }
+  return true;
+}
+
+void smp_init(void) {
+  const acpi_madt_t *madt = acpi_madt();
+  if (madt == NULL || !apic_enabled()) {
+    return;
+  }
+  cpus[0].apic_id = apic_id();
+  register_interrupt_handler(IRQ_IPI_CALL, call_interrupt);
+  register_interrupt_handler(IRQ_IPI_RESCHEDULE, reschedule_interrupt);
+  uint32_t page = trampoline_page();
+  if (page == 0) {
+    kprintf("smp: no low memory for the trampoline\n");
+    return;
+  }
+  memmove(P2V(page), trampoline_start, trampoline_end - trampoline_start);
+
+  for (uint32_t i = 0; i < madt->n_cpus; i++) {
+    uint32_t apic_id = madt->cpus[i].apic_id;
+    if (apic_id == cpus[0].apic_id) {
+      continue;
+    }
+    // A CPU that missed its chance could still start on the next one's
+    // stack, so stop at the first.
+    if (!start(n_cpus, apic_id, page)) {
+      kprintf("smp: cpu with apic id %u did not start\n", apic_id);
+      break;
+    }
+    n_cpus++;
+  }
+  TRACE("SMP", 1, "%d cpus, trampoline at %x", n_cpus, page);
+}
+
+uint32_t smp_cpus(void) { return n_cpus; }
+
+percpu_t *smp_cpu(uint32_t id) { return &cpus[id]; }
+
+void smp_reschedule(uint32_t id) {
+  percpu_t *cpu = &cpus[id];
+  __atomic_store_n(&cpu->need_resched, 1, __ATOMIC_RELEASE);
+  if (cpu != this_cpu()) {
+    apic_send_ipi(cpu->apic_id, IRQ_IPI_RESCHEDULE);
+  }
+}
+
+bool smp_call(uint32_t id, smp_func_t func, void *data) {
+  if (id >= n_cpus) {
+    return false;
+  }
+  percpu_t *cpu = &cpus[id];
+  if (cpu == this_cpu()) {
+    uint32_t flags = interrupts_save();
+    func(data);
+    interrupts_restore(flags);
+    return true;
+  }
+  while (__atomic_exchange_n(&cpu->call_busy, true, __ATOMIC_ACQUIRE)) {
+    cpu_relax();
+  }
+  cpu->call_func = func;
+  cpu->call_data = data;
+  __atomic_store_n(&cpu->call_pending, true, __ATOMIC_RELEASE);
+  apic_send_ipi(cpu->apic_id, IRQ_IPI_CALL);
+  while (__atomic_load_n(&cpu->call_pending, __ATOMIC_ACQUIRE)) {
+    cpu_relax();
+  }
+  __atomic_store_n(&cpu->call_busy, false, __ATOMIC_RELEASE);
+  return true;
+}
+
+static void ping(void *data) { (void)data; }
+
+void smp_dump(void) {
+  kprintf("%u cpus, this is cpu %u\n", n_cpus, cpu_id());
+  for (uint32_t id = 0; id < n_cpus; id++) {
+    const percpu_t *cpu = &cpus[id];
+    kprintf("cpu %u: apic id %u, %u ipis", id, cpu->apic_id, cpu->ipis);
+    if (id != cpu_id() && cpu_has(X86_FEATURE_TSC)) {
+      uint64_t start = rdtsc();
+      smp_call(id, ping, NULL);
+      kprintf(", round trip %u cycles", (uint32_t)(rdtsc() - start));
+    }
+    kprintf("\n");
+  }
+}
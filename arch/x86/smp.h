@@ -0,0 +1,80 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "acpi.h"
+#include "fpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SMP_MAX_CPUS ACPI_MAX_CPUS
+
+typedef void (*smp_func_t)(void *data);
+struct thread_t;
+
+// What each CPU keeps to itself. Its %gs segment is based at its own copy,
+// whose first word points back at it, so this_cpu() is a single load.
+typedef struct percpu_t {
+  struct percpu_t *self;
+  // Index in the order the CPUs came up, the boot CPU is 0.
+  uint32_t id;
+  uint32_t apic_id;
+  bool online;
+  // The thread running here, see kernel/thread.c.
+  struct thread_t *thread;
+  // preempt_disable() depth and whether to switch when it reaches 0.
+  uint32_t preempt_count;
+  uint32_t need_resched;
+  // The section with interrupts off being timed, see irqoff_start().
+  uint64_t irqoff_started;
+  uint32_t irqoff_site;
+  // Lazy FPU switching, see fpu.c.
+  fpu_state_t *fpu_owner;
+  fpu_state_t *fpu_current;
+  uint32_t fpu_kernel_flags;
+  // One smp_call() at a time: `call_busy` is taken by the caller, which
+  // waits for the IPI handler to clear `call_pending`.
+  smp_func_t call_func;
+  void *call_data;
+  bool call_busy;
+  bool call_pending;
+  uint32_t ipis;
+} percpu_t;
+
+static inline percpu_t *this_cpu(void) {
+  percpu_t *cpu;
+  asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+static inline uint32_t cpu_id(void) { return this_cpu()->id; }
+
+// Read or add to a 32-bit field of the running CPU's percpu_t in one
+// instruction, which a switch to another CPU cannot split.
+#define this_cpu_read(field)                                                                                        \
+  ({                                                                                                                \
+    uint32_t value_;                                                                                                \
+    asm volatile("movl %%gs:%c1, %0" : "=r"(value_) : "i"(offsetof(percpu_t, field)) : "memory");                  \
+    value_;                                                                                                         \
+  })
+#define this_cpu_add(field, n)                                                                                      \
+  asm volatile("addl %1, %%gs:%c0" : : "i"(offsetof(percpu_t, field)), "ri"((uint32_t)(n)) : "memory", "cc")
+
+// The boot CPU's per-CPU area and GDT. The first thing kernel_main does.
+void smp_early_init(void);
+// Start the other CPUs the MADT lists, one at a time, with INIT and two
+// STARTUP IPIs. Needs the local APIC, a calibrated timer and kmalloc(). The
+// new CPUs run threads whose affinity allows them.
+void smp_init(void);
+uint32_t smp_cpus(void);
+percpu_t *smp_cpu(uint32_t id);
+// Have CPU `id` call the scheduler, with an IPI if it is another one.
+void smp_reschedule(uint32_t id);
+// Run `func` on CPU `id` from its IPI handler and wait until it returns. Call
+// with interrupts enabled, so that a CPU calling this one meanwhile gets its
+// answer. Returns false if the CPU is not online.
+bool smp_call(uint32_t id, smp_func_t func, void *data);
+// The CPUs, with the time an IPI round trip to each one takes.
+void smp_dump(void);
+
+#endif
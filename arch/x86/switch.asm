@@ -0,0 +1,25 @@
+; --------------------------------------------------------------------------------
+; Context switch
+; --------------------------------------------------------------------------------
+; void switch_stack(uint32_t *save, uint32_t esp)
+; Pushes the registers the C calling convention wants preserved, stores the
+; stack pointer in *save and continues on `esp`, a stack saved the same way.
+; The call returns when something switches back to the saved stack. Threads
+; start on a stack made to look like this, returning into their entry.
+[bits 32]
+
+section .text
+    global switch_stack
+switch_stack:
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov eax, [esp + 20]     ; save
+    mov [eax], esp
+    mov esp, [esp + 24]     ; esp
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
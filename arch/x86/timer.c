@@ -1,12 +1,15 @@
 #include "timer.h"
+#include "apic.h"
+#include "cpu.h"
 #include "drivers/screen.h"
 #include "isr.h"
+#include "kernel/hrtimer.h"
+#include "kernel/spinlock.h"
+#include "kernel/thread.h"
+#include "kernel/trace.h"
 #include "libc/string.h"
 #include "ports.h"
 
-/* Get the PIT value: hardware clock at 1193180 Hz */
-#define PIT_HZ 1193180
-#define TIMER_FREQ 100
 #define PORT_CHANNEL0 0x40
 #define PORT_CHANNEL1 0x41
 #define PORT_CHANNEL2 0x42
@@ -34,13 +37,57 @@ Bits         Usage
 0            BCD/Binary mode: 0 = 16-bit binary, 1 = four-digit BCD
 */
 #define PORT_MODE 0x43
+// Bit 0 gates channel 2, bit 1 connects it to the speaker and bit 5 reads its
+// output.
+#define PORT_GATE 0x61
+#define GATE_CHANNEL2 0x01
+#define GATE_SPEAKER 0x02
+#define GATE_OUT2 0x20
+// Writes to this unused port take about a microsecond.
+#define PORT_DELAY 0x80
 
-uint32_t tick = 0;
+// The TSC is timed over 10 ms of the PIT a few times, keeping the shortest
+// run, which was least disturbed.
+#define CALIBRATE_COUNT (PIT_HZ / 100)
+#define CALIBRATE_RUNS 3
+// Fraction bits of tsc_mult.
+#define TSC_SHIFT 22
+
+// Longest wait one count of the PIT covers.
+#define ONESHOT_MAX_NS ((uint64_t)0xffff * 1000000000 / PIT_HZ)
+
+// Guards `ticks` and `programmed`, which the timer interrupts of every CPU
+// change.
+static spinlock_t lock = SPINLOCK_INIT("timer");
+// Number of timer interrupts since timer_init().
+static volatile uint32_t ticks = 0;
+// Whether the PIT interrupts once for the next timer instead of every tick.
+static bool oneshot;
+// The local APIC timer takes over one-shot interrupts from the PIT.
+static bool apic_timer;
+static uint32_t tsc_khz;
+// Nanoseconds per TSC cycle, scaled by 2^TSC_SHIFT.
+static uint32_t tsc_mult;
+// The TSC and the tick-based time when the TSC took over, so the clock goes
+// on from where the ticks left it.
+static uint64_t tsc_base;
+static uint64_t ns_base;
+// Expiry of the pending one-shot interrupt, to measure how late it comes.
+static uint64_t programmed = UINT64_MAX;
 
 static void timer_callback(registers_t *regs) {
-  if (tick > 0) {
-    tick--;
+  spin_lock(&lock);
+  ticks++;
+  if (oneshot && programmed != UINT64_MAX) {
+    // Interrupts for expiries too far away to program come early.
+    uint64_t now = timer_ns();
+    if (now >= programmed) {
+      interrupt_latency(regs->int_no, now - programmed, regs->eip);
+    }
+    programmed = UINT64_MAX;
   }
+  spin_unlock(&lock);
+  hrtimer_run();
 }
 
 void configure_pit_channel(uint8_t channel, uint8_t mode, uint16_t frequency) {
@@ -53,16 +100,159 @@ void configure_pit_channel(uint8_t channel, uint8_t mode, uint16_t frequency) {
   outb(channel, high);
 }
 
+// TSC cycles taken by CALIBRATE_COUNT periods of PIT channel 2, which only
+// drives the speaker.
+static uint64_t calibrate_run(void) {
+  uint8_t gate = inb(PORT_GATE);
+  outb(PORT_GATE, (gate & ~GATE_SPEAKER) | GATE_CHANNEL2);
+  // Channel 2 | lobyte/hibyte | Mode 0, whose output goes high at the end of
+  // the count.
+  outb(PORT_MODE, 0xb0);
+  outb(PORT_CHANNEL2, CALIBRATE_COUNT & 0xff);
+  outb(PORT_CHANNEL2, CALIBRATE_COUNT >> 8);
+  uint64_t start = rdtsc();
+  while (!(inb(PORT_GATE) & GATE_OUT2)) {
+  }
+  uint64_t cycles = rdtsc() - start;
+  outb(PORT_GATE, gate);
+  return cycles;
+}
+
+static void calibrate_tsc(void) {
+  if (!cpu_has(X86_FEATURE_TSC)) {
+    return;
+  }
+  uint32_t flags = interrupts_save();
+  uint64_t cycles = calibrate_run();
+  for (int i = 1; i < CALIBRATE_RUNS; i++) {
+    uint64_t run = calibrate_run();
+    cycles = run < cycles ? run : cycles;
+  }
+  uint32_t khz = div64(cycles * PIT_HZ, CALIBRATE_COUNT * 1000);
+  tsc_mult = div64((uint64_t)1000000 << TSC_SHIFT, khz);
+  // Still the tick-based time, as tsc_khz is 0.
+  ns_base = timer_ns();
+  tsc_base = rdtsc();
+  tsc_khz = khz;
+  interrupts_restore(flags);
+  TRACE("TIMER", 1, "tsc at %d kHz", tsc_khz);
+}
+
 void timer_init() {
   /* Install the function we just wrote */
   register_interrupt_handler(IRQ0, timer_callback);
-  uint32_t count = PIT_HZ / TIMER_FREQ;
-  configure_pit_channel(PORT_CHANNEL0, 2, count);
+  calibrate_tsc();
+  oneshot = tsc_khz != 0;
+  if (oneshot) {
+    // Stop the periodic interrupt the BIOS left running. It fires once more.
+    configure_pit_channel(PORT_CHANNEL0, 0, 0xffff);
+    if (apic_timer_init()) {
+      apic_timer = true;
+      register_interrupt_handler(IRQ_APIC_TIMER, timer_callback);
+    }
+  } else {
+    configure_pit_channel(PORT_CHANNEL0, 2, PIT_HZ / TIMER_FREQ);
+  }
+  TRACE("TIMER", 2, "%s", timer_source());
 }
 
+const char *timer_source(void) {
+  if (apic_timer) {
+    return "local apic one-shot";
+  }
+  return oneshot ? "pit one-shot" : "pit periodic";
+}
+
+void timer_program(uint64_t expires) {
+  uint32_t flags = spin_lock_irqsave(&lock);
+  programmed = expires;
+  spin_unlock_irqrestore(&lock, flags);
+  if (apic_timer) {
+    if (expires == UINT64_MAX) {
+      apic_timer_stop();
+    } else {
+      uint64_t now = timer_ns();
+      apic_timer_start(expires > now ? expires - now : 0);
+    }
+    return;
+  }
+  if (!oneshot || expires == UINT64_MAX) {
+    return;
+  }
+  uint64_t now = timer_ns();
+  uint32_t count = 1;
+  if (expires > now) {
+    // Rounded up, so the timer is not early. Later timers take several
+    // interrupts.
+    uint64_t delta = expires - now;
+    count = delta >= ONESHOT_MAX_NS ? 0xffff : div64(delta * PIT_HZ, 1000000000) + 1;
+  }
+  // Mode 0 interrupts once, when the count runs out.
+  configure_pit_channel(PORT_CHANNEL0, 0, count);
+}
+
+static void wake(hrtimer_t *timer) { *(volatile bool *)timer->data = true; }
+
 void timer_msleep(int32_t ms) {
-  tick = ms * TIMER_FREQ / 1000;
-  while (tick > 0) {
-    asm volatile("hlt");
+  if (thread_may_block()) {
+    thread_sleep((uint64_t)ms * 1000000);
+    return;
   }
-}
\ No newline at end of file
+  // Before the threads, or where they cannot block.
+  volatile bool done = false;
+  hrtimer_t timer;
+  hrtimer_init(&timer, wake, (void *)&done);
+  if (!hrtimer_start(&timer, timer_ns() + (uint64_t)ms * 1000000)) {
+    udelay(ms * 1000);
+    return;
+  }
+  uint32_t flags = interrupts_save();
+  while (!done) {
+    cpu_idle();
+  }
+  interrupts_restore(flags);
+}
+
+uint32_t timer_ticks() {
+  if (!oneshot) {
+    return ticks;
+  }
+  return div64(timer_ns(), 1000000000 / TIMER_FREQ);
+}
+
+uint64_t timer_ns(void) {
+  if (tsc_khz == 0) {
+    return (uint64_t)ticks * (1000000000 / TIMER_FREQ);
+  }
+  uint64_t cycles = rdtsc() - tsc_base;
+  // In two parts, so the product cannot overflow.
+  uint64_t low = cycles & ((1 << TSC_SHIFT) - 1);
+  return ns_base + (cycles >> TSC_SHIFT) * tsc_mult + ((low * tsc_mult) >> TSC_SHIFT);
+}
+
+uint32_t timer_tsc_khz(void) { return tsc_khz; }
+
+static void delay(uint64_t cycles) {
+  uint64_t start = rdtsc();
+  while (rdtsc() - start < cycles) {
+    cpu_relax();
+  }
+}
+
+void ndelay(uint32_t ns) {
+  if (tsc_khz == 0) {
+    udelay(ns / 1000 + 1);
+    return;
+  }
+  delay(div64((uint64_t)ns * tsc_khz, 1000000) + 1);
+}
+
+void udelay(uint32_t us) {
+  if (tsc_khz == 0) {
+    for (uint32_t i = 0; i < us; i++) {
+      outb(PORT_DELAY, 0);
+    }
+    return;
+  }
+  delay(div64((uint64_t)us * tsc_khz, 1000) + 1);
+}
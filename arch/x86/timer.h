@@ -1,9 +1,36 @@
 #ifndef TIMER_H
 #define TIMER_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define TIMER_FREQ 100
+// Input clock of the PIT.
+#define PIT_HZ 1193180
+
+// Calibrate the TSC against the PIT and start the timer interrupt. With a TSC
+// to keep time, the local APIC timer, or the PIT without an APIC, only
+// interrupts when the next hrtimer is due. Otherwise the PIT ticks at
+// TIMER_FREQ.
 void timer_init();
+// Sleep at least `ms` milliseconds. A thread blocks and lets others run,
+// other code halts until its hrtimer fires.
 void timer_msleep(int32_t ms);
+// Time since timer_init() in units of 1 / TIMER_FREQ seconds.
+uint32_t timer_ticks();
+// What raises the timer interrupt, for display.
+const char *timer_source(void);
+// Interrupt at `expires` in timer_ns() time, or never for UINT64_MAX. Has no
+// effect on a periodic timer.
+void timer_program(uint64_t expires);
+// Monotonic nanoseconds since timer_init(). Counted by the TSC when there is
+// one, in ticks otherwise.
+uint64_t timer_ns(void);
+// TSC frequency, or 0 if there is no TSC.
+uint32_t timer_tsc_khz(void);
+// Busy-wait at least `ns` nanoseconds or `us` microseconds, for waits far
+// shorter than a tick.
+void ndelay(uint32_t ns);
+void udelay(uint32_t us);
 
 #endif
@@ -0,0 +1,85 @@
+; --------------------------------------------------------------------------------
+; Application processor start
+; --------------------------------------------------------------------------------
+; smp_init copies trampoline_start up to trampoline_end to a page below 1 MiB
+; and points the STARTUP IPI at it. The CPU starts there in real mode with cs
+; at the page and ip 0, so the code only uses offsets from trampoline_start
+; and works out the linear addresses it needs from cs. It switches to
+; protected mode and to the boot page directory, which still maps low memory
+; at 0, and jumps to ap_entry in the higher half.
+KERNEL_VIRTUAL_BASE equ 0xc0000000
+CR0_PE              equ 1 << 0
+CR0_PG              equ 1 << 31
+CR4_PSE             equ 1 << 4
+CODE_SEGMENT        equ 0x08
+DATA_SEGMENT        equ 0x10
+
+[extern boot_page_directory]
+[extern smp_boot_directory]
+[extern smp_boot_stack]
+[extern ap_main]
+
+section .text
+    global trampoline_start
+    global trampoline_end
+
+[bits 16]
+    align 16
+trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    movzx ebx, ax
+    shl ebx, 4 ; Linear address of the copy
+    lea eax, [ebx + trampoline_gdt - trampoline_start]
+    mov [trampoline_gdtr - trampoline_start + 2], eax
+    lea eax, [ebx + trampoline_32 - trampoline_start]
+    mov [trampoline_far - trampoline_start], eax
+    lgdt [trampoline_gdtr - trampoline_start]
+    mov eax, cr0
+    or eax, CR0_PE
+    mov cr0, eax
+    o32 jmp far [trampoline_far - trampoline_start]
+
+[bits 32]
+trampoline_32:
+    mov ax, DATA_SEGMENT
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    mov eax, cr4
+    or eax, CR4_PSE
+    mov cr4, eax
+    mov eax, boot_page_directory - KERNEL_VIRTUAL_BASE
+    mov cr3, eax
+    mov eax, cr0
+    or eax, CR0_PG
+    mov cr0, eax
+    mov eax, ap_entry ; Absolute jump to the higher half
+    jmp eax
+
+    align 8
+trampoline_gdt:
+    dq 0
+    dq 0x00cf9a000000ffff ; 4 GiB ring 0 code
+    dq 0x00cf92000000ffff ; 4 GiB ring 0 data
+trampoline_gdtr:
+    dw trampoline_gdtr - trampoline_gdt - 1
+    dd 0 ; Filled in with the linear address of trampoline_gdt
+trampoline_far:
+    dd 0 ; Linear address of trampoline_32
+    dw CODE_SEGMENT
+trampoline_end:
+
+; The kernel directory and the stack may be above the 16 MiB the boot page
+; directory maps, so switch to the one before using the other. ap_main does
+; not return.
+ap_entry:
+    mov eax, [smp_boot_directory]
+    mov cr3, eax
+    mov esp, [smp_boot_stack]
+    call ap_main
+    jmp $
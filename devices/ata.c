@@ -9,6 +9,7 @@
 #include "drivers/screen.h"
 #include "kernel/kprintf.h"
 #include "kernel/trace.h"
+#include "kernel/wait.h"
 #include "partition.h"
 
 #define PORT_DATA(CHANNEL) ((CHANNEL)->port_base + 0)
@@ -40,7 +41,12 @@
 #define STATUS_DRQ 0x08
 #define STATUS_ERR 0x01
 
-#define MAX_BUSY_WAIT_TIME 3000
+// How long a drive may stay busy, or take to become idle, before we give up.
+#define BUSY_TIMEOUT_NS 30000000000ull
+#define IDLE_TIMEOUT_NS 10000000000ull
+// How long to sleep waiting for an interrupt before polling the channel
+// instead.
+#define IRQ_TIMEOUT_NS 1000000000ull
 
 // Support the two "legacy" ATA channels (bus) found in a standard PC.
 // The first two buses are called the Primary and Secondary ATA bus.
@@ -68,11 +74,23 @@ typedef struct ata_device {
   int id;
   struct ata_channel *channel;
   bool is_ata_disk;
+  // Sectors, from IDENTIFY.
+  uint32_t capacity;
 } ata_device;
 
 typedef struct ata_channel {
   uint16_t port_base;
   uint8_t irq;
+  // Held from selecting a drive until its transfer is over, so the commands
+  // of several threads do not mix.
+  semaphore_t busy;
+  // Set while a command holds the channel. Interrupts that come when it is
+  // clear, late ones from a polled command, are not counted.
+  bool in_flight;
+  // Counts the interrupts since the last command was sent.
+  completion_t done;
+  // An interrupt did not come, the status is polled from then on.
+  bool polled;
   ata_device devices[N_DEVICES_PER_CHANNEL];
 } ata_channel;
 
@@ -83,24 +101,27 @@ void ata_select_device(const ata_device *device) {
   uint16_t id = device->id == 1 ? SELECT_MASTER : SELECT_SLAVE;
   outb(PORT_DRIVE_SELECT(device->channel), id);
   inb(PORT_ALTERNATIVE_STATUS(device->channel));
-  // TOOD: We should wait 400 ns here. But, we currently only have msleep.
-  timer_msleep(1);
+  // The status is only valid 400 ns after selecting.
+  ndelay(400);
 }
 
 // The controller is idle when the BSY and DRQ bits are cleared.
 void wait_until_idle(const ata_device *device) {
-  for (size_t i = 0; i < 1000; i++) {
+  uint64_t deadline = timer_ns() + IDLE_TIMEOUT_NS;
+  do {
     uint16_t status = inb(PORT_ALTERNATIVE_STATUS(device->channel));
     if ((status & (STATUS_BSY | STATUS_DRQ)) == 0) {
       return;
     }
-    timer_msleep(10);
-  }
+  } while (timer_ns() < deadline);
 }
 
 bool wait_while_busy(const ata_device *device) {
-  // For any other value, poll the status port until bit 7 clears.
-  for (size_t i = 0; i < MAX_BUSY_WAIT_TIME; i++) {
+  // For any other value, poll the status port until bit 7 clears. Callers
+  // that may block slept until the interrupt first, so this is usually clear
+  // at once.
+  uint64_t deadline = timer_ns() + BUSY_TIMEOUT_NS;
+  do {
     uint8_t status = inb(PORT_ALTERNATIVE_STATUS(device->channel));
     if (!(status & STATUS_BSY)) {
       // Some ATAPI drives do not follow spec... So we need to check the
@@ -124,18 +145,53 @@ bool wait_while_busy(const ata_device *device) {
 
       return (status & STATUS_DRQ) != 0;
     }
-    timer_msleep(10);
-  }
+  } while (timer_ns() < deadline);
   kprintf("done busy waiting\n");
   return false;
 }
 
-static void sector_select(ata_device *device, uint32_t sector_index) {
+// The holder sleeps while the drive works. The file layer and the sector
+// cache reach the disk with sleeping locks, so only a fault on a file mapping
+// taken with interrupts or preemption off spins for the channel.
+static void channel_lock(ata_channel *channel) { semaphore_down_or_spin(&channel->busy); }
+
+static void channel_unlock(ata_channel *channel) {
+  // Acknowledge what a polled command raised, so it does not count for the
+  // next one.
+  inb(PORT_STATUS(channel));
+  __atomic_store_n(&channel->in_flight, false, __ATOMIC_RELEASE);
+  semaphore_up(&channel->busy);
+}
+
+static void send_command(const ata_device *device, uint8_t command) {
+  completion_reinit(&device->channel->done);
+  __atomic_store_n(&device->channel->in_flight, true, __ATOMIC_RELEASE);
+  outb(PORT_COMMAND(device->channel), command);
+}
+
+// Sleep until the drive interrupts, which it does when the data of a sector
+// can be read or a write has finished, if the caller may block. The caller
+// checks the status after, which is how code that cannot block waits.
+static void wait_for_interrupt(const ata_device *device) {
+  ata_channel *channel = device->channel;
+  if (channel->polled || !thread_may_block()) {
+    return;
+  }
+  if (!completion_wait_timeout(&channel->done, IRQ_TIMEOUT_NS)) {
+    kprintf("ata: no interrupt from %s, polling\n", device->name);
+    channel->polled = true;
+  }
+}
+
+// Takes the channel, the caller unlocks it once the transfer is over. A sector
+// count of 0 means 256 sectors.
+static void sector_select(ata_device *device, uint32_t sector_index, uint32_t count) {
+  channel_lock(device->channel);
   wait_until_idle(device);
   ata_select_device(device);
   wait_until_idle(device);
 
-  outb(PORT_SECTORCOUNT(device->channel), 1);
+  outb(PORT_SECTORCOUNT(device->channel), count & 0xff);
   // The LBA is 28 bits.
   outb(PORT_LBA_LO(device->channel), sector_index);
   outb(PORT_LBA_MID(device->channel), sector_index >> 8);
@@ -156,24 +212,58 @@ static void sector_out(const ata_device *device, void *buffer) {
 }
 
 static void read(void *device, uint32_t sector_index, void *buffer) {
-  sector_select((ata_device *)device, sector_index);
-  outb(PORT_COMMAND(((ata_device *)device)->channel), CMD_READ_SECTORS);
+  ata_channel *channel = ((ata_device *)device)->channel;
+  sector_select((ata_device *)device, sector_index, 1);
+  send_command(device, CMD_READ_SECTORS);
+  wait_for_interrupt(device);
   if (!wait_while_busy((ata_device *)device)) {
+    channel_unlock(channel);
     kprintf("failed to read disk\n");
     return;
   }
   sector_in((ata_device *)device, buffer);
+  channel_unlock(channel);
+}
+
+// Read several sectors with a single READ SECTORS command. The drive raises DRQ
+// once per sector, so we only pay for the command setup once.
+static bool read_sectors(void *device, uint32_t sector_index, uint32_t count, void *buffer) {
+  if (count == 0 || count > BLOCK_MAX_SECTORS_PER_REQUEST) {
+    return false;
+  }
+  ata_channel *channel = ((ata_device *)device)->channel;
+  sector_select((ata_device *)device, sector_index, count);
+  send_command(device, CMD_READ_SECTORS);
+  uint8_t *p = buffer;
+  for (uint32_t i = 0; i < count; i++) {
+    wait_for_interrupt(device);
+    if (!wait_while_busy((ata_device *)device)) {
+      channel_unlock(channel);
+      kprintf("failed to read disk\n");
+      return false;
+    }
+    sector_in((ata_device *)device, p);
+    p += BLOCK_SIZE_SECTOR;
+  }
+  channel_unlock(channel);
+  return true;
 }
 
 static void write(void *device, uint32_t sector_index, void *buffer) {
-  sector_select((ata_device *)device, sector_index);
-  outb(PORT_COMMAND(((ata_device *)device)->channel), CMD_WRITE_SECTORS);
+  ata_channel *channel = ((ata_device *)device)->channel;
+  sector_select((ata_device *)device, sector_index, 1);
+  // The drive asks for the data without an interrupt, and interrupts once it
+  // is written.
+  send_command(device, CMD_WRITE_SECTORS);
   if (!wait_while_busy((ata_device *)device)) {
+    channel_unlock(channel);
     kprintf("failed to write disk\n");
     return;
   }
   // TOOD: Need delay here (between every write, a.k.a, don't use rep outsl?)
   sector_out((ata_device *)device, buffer);
+  wait_for_interrupt(device);
+  channel_unlock(channel);
 }
 
 static void reset_channel(ata_channel *channel) {
@@ -238,12 +328,14 @@ static uint8_t *swap_byte_order_in_string(uint8_t *s, size_t n) {
 
 // All current BIOSes have standardized the use of the IDENTIFY command
 // to detect the existence of ATA bus devices, e.g., PATA, PATAPI, SATAPI, SATA.
-void ata_identify_device(ata_device *device) {
+// Returns whether it is a disk.
+static bool identify(ata_device *device) {
   ata_channel *channel = device->channel;
   uint8_t sector[BLOCK_SIZE_SECTOR];
 
   // To use the IDENTIFY command,
   // 1. Select the correct device.
+  channel_lock(channel);
   wait_until_idle(device);
   ata_select_device(device);
   wait_until_idle(device);
@@ -255,20 +347,23 @@ void ata_identify_device(ata_device *device) {
   outb(PORT_LBA_HI(channel), 0);
 
   // 3. Send the IDENTIFY command (CMD_IDENTIFY) to the command port.
-  outb(PORT_COMMAND(channel), CMD_IDENTIFY);
+  send_command(device, CMD_IDENTIFY);
 
   // 4. Read the status port (this is the same as the command port).
   uint8_t status = inb(PORT_ALTERNATIVE_STATUS(channel));
   // If the status is 0, the drive does not exist.
   if (status == 0) {
+    channel_unlock(channel);
     // Does not exist
     kprintf("drive does not exist\n");
-    return;
+    return false;
   }
 
+  wait_for_interrupt(device);
   if (!wait_while_busy(device)) {
+    channel_unlock(channel);
     device->is_ata_disk = false;
-    return;
+    return false;
   }
 
   kprintf("reading from ");
@@ -277,17 +372,25 @@ void ata_identify_device(ata_device *device) {
   // Data is ready to be sent. Read 256 16-bit values from the data port
   // and store that information.
   sector_in(device, sector);
+  channel_unlock(channel);
 
   uint8_t *serial_number = swap_byte_order_in_string(&sector[10 * 2], 10 * 2);
   sector[20 * 2] = '\0';
   uint8_t *model_number = swap_byte_order_in_string(&sector[27 * 2], 20 * 2);
   sector[47 * 2] = '\0';
-  uint32_t capacity = *(uint32_t *)&sector[60 * 2];
-
-  block_t *block = block_register(device, device->name, 0, capacity, read, write);
+  device->capacity = *(uint32_t *)&sector[60 * 2];
+  TRACE("ATA", 1, "capacity: %d, serial_number: %s, model_number: %s", device->capacity, serial_number,
+        model_number);
+  return true;
+}
 
+static void register_disk(ata_device *device) {
+  block_t *block = block_register(device, device->name, 0, device->capacity, read, write);
+  if (block == NULL) {
+    return;
+  }
+  block->read_sectors = read_sectors;
   read_partition_table(block);
-  TRACE("ATA", 1, "capacity: %d, serial_number: %s, model_number: %s", capacity, serial_number, model_number);
 }
 
 static void interrupt_handler(registers_t *regs) {
@@ -296,7 +399,11 @@ static void interrupt_handler(registers_t *regs) {
     if (regs->int_no != channel->irq) {
       continue;
     }
+    // Reading the status acknowledges the interrupt.
     inb(PORT_STATUS(channel));
+    if (__atomic_load_n(&channel->in_flight, __ATOMIC_ACQUIRE)) {
+      complete(&channel->done);
+    }
     TRACE("INTERRUPT", 1, "ata", 0);
   }
 }
@@ -325,16 +432,28 @@ void ata_init() {
       device->id = di;
     }
 
-    // Register interrupt handler.
+    // Register interrupt handler, and have the drives interrupt (nIEN clear).
+    semaphore_init(&channel->busy, 1, "ata channel");
+    completion_init(&channel->done, "ata");
     register_interrupt_handler(channel->irq, interrupt_handler);
+    outb(PORT_CONTROL(channel), 0);
 
     // Reset hardware.
     // reset_channel(channel);
 
     // Read hard disk identity information.
     for (size_t di = 0; di < N_DEVICES_PER_CHANNEL; di++) {
-      ata_device *device = &channel->devices[di];
-      ata_identify_device(device);
+      channel->devices[di].is_ata_disk = identify(&channel->devices[di]);
+    }
+  }
+
+  // Only once every drive is identified, as the probe sleeps holding the
+  // channels and the file systems on the disks do not.
+  for (size_t ci = 0; ci < N_CHANNELS; ci++) {
+    for (size_t di = 0; di < N_DEVICES_PER_CHANNEL; di++) {
+      if (channels[ci].devices[di].is_ata_disk) {
+        register_disk(&channels[ci].devices[di]);
+      }
     }
   }
 }
\ No newline at end of file
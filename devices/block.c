@@ -1,33 +1,44 @@
 #include "block.h"
 #include "kernel/kprintf.h"
+#include "kernel/spinlock.h"
+#include "mm/slab.h"
 #include <stddef.h>
 
-typedef struct block_array_t {
-  size_t length;
-  block_t data[10];
-} block_array_t;
+static slab_cache_t *block_cache;
+static block_t *blocks;
+// Guards `blocks`. Disks and partitions may be registered while others are
+// listed.
+static rwlock_t blocks_lock = RWLOCK_INIT("blocks");
 
-block_array_t blocks;
+void block_init(void) {
+  block_cache = slab_cache_create("block", sizeof(block_t), MEMTAG_BLOCK);
+  blocks = NULL;
+}
 
 block_t *block_register(const void *device, const char *name, const uint32_t start, const uint32_t size,
                         block_read_t read, block_write_t write) {
 
-  if (blocks.length >= 10) {
-    kprintf("too many block devices");
+  block_t *block = slab_alloc(block_cache);
+  if (block == NULL) {
+    kprintf("out of memory for block device %s", name);
     return 0;
   }
 
-  block_t *block = &blocks.data[blocks.length++];
-
-  for (size_t i = 0; i < 16 - 1 && *name; i++) {
+  size_t i = 0;
+  for (; i < 16 - 1 && *name; i++) {
     block->name[i] = *name++;
   }
-  block->name[16 - 1] = '\0';
+  block->name[i] = '\0';
   block->start = start;
   block->size = size;
   block->read = read;
   block->write = write;
+  block->read_sectors = NULL;
   block->device = device;
+  write_lock(&blocks_lock);
+  block->next = blocks;
+  blocks = block;
+  write_unlock(&blocks_lock);
 
   return block;
 }
@@ -48,4 +59,50 @@ void block_write(block_t *block, uint32_t sector, void *buffer) {
   } else {
     kprintf("writing to a sector outside block device: %s", block->name);
   }
+}
+
+bool block_read_sectors(block_t *block, uint32_t sector, uint32_t count, void *buffer) {
+  if (sector >= block->size || count > block->size - sector) {
+    kprintf("reading from a sector outside block device: %s", block->name);
+    return false;
+  }
+  uint8_t *p = buffer;
+  if (block->read_sectors != NULL) {
+    while (count > 0) {
+      uint32_t n = count < BLOCK_MAX_SECTORS_PER_REQUEST ? count : BLOCK_MAX_SECTORS_PER_REQUEST;
+      if (!block->read_sectors(block->device, block->start + sector, n, p)) {
+        return false;
+      }
+      sector += n;
+      count -= n;
+      p += n * BLOCK_SIZE_SECTOR;
+    }
+    return true;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    block->read(block->device, block->start + sector + i, p);
+    p += BLOCK_SIZE_SECTOR;
+  }
+  return true;
+}
+
+bool block_write_sectors(block_t *block, uint32_t sector, uint32_t count, const void *buffer) {
+  if (sector >= block->size || count > block->size - sector) {
+    kprintf("writing to a sector outside block device: %s", block->name);
+    return false;
+  }
+  const uint8_t *p = buffer;
+  for (uint32_t i = 0; i < count; i++) {
+    block->write(block->device, block->start + sector + i, (void *)p);
+    p += BLOCK_SIZE_SECTOR;
+  }
+  return true;
+}
+
+void block_dump(void) {
+  read_lock(&blocks_lock);
+  for (const block_t *block = blocks; block != NULL; block = block->next) {
+    kprintf("%s: %u sectors from sector %u\n", block->name, block->size, block->start);
+  }
+  read_unlock(&blocks_lock);
 }
\ No newline at end of file
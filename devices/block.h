@@ -1,12 +1,17 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define BLOCK_SIZE_SECTOR 512
 
 typedef void (*block_read_t)(void *device, uint32_t sector_index, void *buffer);
 typedef void (*block_write_t)(void *device, uint32_t sector_index, void *buffer);
+// Optional. Reads up to BLOCK_MAX_SECTORS_PER_REQUEST sectors with one request.
+typedef bool (*block_read_sectors_t)(void *device, uint32_t sector_index, uint32_t count, void *buffer);
+
+#define BLOCK_MAX_SECTORS_PER_REQUEST 256
 
 // A block device is a special file that provides buffered access to a hardware device.
 typedef struct block_t {
@@ -15,12 +20,21 @@ typedef struct block_t {
   uint32_t size;
   block_read_t read;
   block_write_t write;
+  block_read_sectors_t read_sectors;
   void *device;
+  struct block_t *next;
 } block_t;
 
+void block_init(void);
 block_t *block_register(const void *device, const char *name, const uint32_t start, const uint32_t size,
                         block_read_t read, block_write_t write);
 void block_read(block_t *block, uint32_t sector, void *buffer);
 void block_write(block_t *block, uint32_t sector, void *buffer);
+// Transfer `count` consecutive sectors between the device and `buffer` without
+// going through the cache. Returns false if the range is outside the device.
+bool block_read_sectors(block_t *block, uint32_t sector, uint32_t count, void *buffer);
+bool block_write_sectors(block_t *block, uint32_t sector, uint32_t count, const void *buffer);
+// The registered devices and partitions.
+void block_dump(void);
 
 #endif
\ No newline at end of file
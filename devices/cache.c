@@ -0,0 +1,157 @@
+#include "cache.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include "kernel/wait.h"
+#include "mm/slab.h"
+#include <stddef.h>
+
+// Small write-back sector cache shared by all block devices. Lookups are a
+// linear scan, which is fine for the handful of buffers we keep around.
+// Buffers are allocated as they are needed, up to CACHE_N_BUFFERS.
+static slab_cache_t *buffer_cache;
+static cache_buffer_t *buffers[CACHE_N_BUFFERS];
+static size_t n_buffers;
+static uint32_t clock;
+// Guards the buffer list and each buffer's state. A semaphore, so the holder
+// can sleep while the disk transfers.
+static semaphore_t lock = SEMAPHORE_INIT("cache", 1);
+
+void cache_init(void) {
+  buffer_cache = slab_cache_create("cache_buffer", sizeof(cache_buffer_t), MEMTAG_BUFFER_CACHE);
+  n_buffers = 0;
+  clock = 0;
+}
+
+// The holder of a pin may change the data meanwhile without the lock, so the
+// buffer is clean before the write starts and dirty again after such a change.
+static void write_back(cache_buffer_t *buffer) {
+  if (buffer->valid && buffer->dirty) {
+    buffer->dirty = false;
+    block_write(buffer->block, buffer->sector, buffer->data);
+  }
+}
+
+static cache_buffer_t *lookup(block_t *block, uint32_t sector) {
+  for (size_t i = 0; i < n_buffers; i++) {
+    cache_buffer_t *buffer = buffers[i];
+    if (buffer->valid && buffer->block == block && buffer->sector == sector) {
+      return buffer;
+    }
+  }
+  return NULL;
+}
+
+// Pick an invalid buffer if there is one, then a new buffer while below the
+// limit, otherwise the least recently used unpinned buffer.
+static cache_buffer_t *evict(void) {
+  for (size_t i = 0; i < n_buffers; i++) {
+    cache_buffer_t *buffer = buffers[i];
+    if (buffer->pins == 0 && !buffer->valid) {
+      return buffer;
+    }
+  }
+  if (n_buffers < CACHE_N_BUFFERS) {
+    cache_buffer_t *buffer = slab_alloc(buffer_cache);
+    if (buffer != NULL) {
+      buffer->pins = 0;
+      buffer->valid = false;
+      buffer->dirty = false;
+      buffers[n_buffers++] = buffer;
+      return buffer;
+    }
+  }
+
+  cache_buffer_t *victim = NULL;
+  for (size_t i = 0; i < n_buffers; i++) {
+    cache_buffer_t *buffer = buffers[i];
+    if (buffer->pins > 0) {
+      continue;
+    }
+    if (victim == NULL || buffer->last_used < victim->last_used) {
+      victim = buffer;
+    }
+  }
+  if (victim != NULL) {
+    write_back(victim);
+    victim->valid = false;
+  }
+  return victim;
+}
+
+static bool in_range(const cache_buffer_t *buffer, block_t *block, uint32_t sector, uint32_t count) {
+  return buffer->valid && buffer->block == block && buffer->sector >= sector && buffer->sector - sector < count;
+}
+
+cache_buffer_t *cache_get(block_t *block, uint32_t sector) {
+  semaphore_down_or_spin(&lock);
+  cache_buffer_t *buffer = lookup(block, sector);
+  if (buffer == NULL) {
+    buffer = evict();
+    if (buffer == NULL) {
+      semaphore_up(&lock);
+      kprintf("cache: all buffers are pinned\n");
+      return NULL;
+    }
+    buffer->block = block;
+    buffer->sector = sector;
+    buffer->dirty = false;
+    block_read(block, sector, buffer->data);
+    buffer->valid = true;
+  }
+  buffer->pins++;
+  buffer->last_used = ++clock;
+  semaphore_up(&lock);
+  return buffer;
+}
+
+void cache_mark_dirty(cache_buffer_t *buffer) { buffer->dirty = true; }
+
+void cache_release(cache_buffer_t *buffer) {
+  semaphore_down_or_spin(&lock);
+  if (buffer->pins == 0) {
+    TRACE("CACHE", 1, "release of unpinned buffer, sector: %d", buffer->sector);
+  } else {
+    buffer->pins--;
+  }
+  semaphore_up(&lock);
+}
+
+void cache_flush_range(block_t *block, uint32_t sector, uint32_t count) {
+  semaphore_down_or_spin(&lock);
+  for (size_t i = 0; i < n_buffers; i++) {
+    if (in_range(buffers[i], block, sector, count)) {
+      write_back(buffers[i]);
+    }
+  }
+  semaphore_up(&lock);
+}
+
+void cache_invalidate_range(block_t *block, uint32_t sector, uint32_t count) {
+  semaphore_down_or_spin(&lock);
+  for (size_t i = 0; i < n_buffers; i++) {
+    cache_buffer_t *buffer = buffers[i];
+    if (!in_range(buffer, block, sector, count)) {
+      continue;
+    }
+    if (buffer->pins > 0) {
+      // Someone is looking at the old contents. Keep the buffer but make sure
+      // it is never written back over the new data.
+      TRACE("CACHE", 2, "invalidating pinned buffer, sector: %d", buffer->sector);
+    }
+    buffer->dirty = false;
+    buffer->valid = buffer->pins > 0;
+    if (buffer->valid) {
+      block_read(block, buffer->sector, buffer->data);
+    }
+  }
+  semaphore_up(&lock);
+}
+
+// One buffer at a time, so the others can use the cache in between.
+void cache_flush(void) {
+  for (size_t i = 0; i < n_buffers; i++) {
+    semaphore_down_or_spin(&lock);
+    write_back(buffers[i]);
+    semaphore_up(&lock);
+  }
+}
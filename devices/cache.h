@@ -0,0 +1,37 @@
+#ifndef DEVICES_CACHE_H
+#define DEVICES_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "block.h"
+
+#define CACHE_N_BUFFERS 64
+
+// A cached copy of one sector of a block device. Buffers are pinned while a
+// caller holds them (cache_get() .. cache_release()) and are never evicted
+// while pinned.
+typedef struct cache_buffer_t {
+  block_t *block;
+  uint32_t sector;
+  uint32_t pins;
+  uint32_t last_used;
+  bool valid;
+  bool dirty;
+  uint8_t data[BLOCK_SIZE_SECTOR];
+} cache_buffer_t;
+
+void cache_init(void);
+cache_buffer_t *cache_get(block_t *block, uint32_t sector);
+void cache_mark_dirty(cache_buffer_t *buffer);
+void cache_release(cache_buffer_t *buffer);
+
+// Write back dirty buffers in [sector, sector + count) of `block`.
+void cache_flush_range(block_t *block, uint32_t sector, uint32_t count);
+// Drop buffers in [sector, sector + count) of `block` without writing them back.
+// Used after the range has been written directly to the device; pinned buffers
+// are re-read instead of dropped.
+void cache_invalidate_range(block_t *block, uint32_t sector, uint32_t count);
+void cache_flush(void);
+
+#endif
@@ -1,11 +1,18 @@
 #include "keyboard.h"
+#include "arch/x86/cpu.h"
 #include "arch/x86/isr.h"
 #include "arch/x86/ports.h"
-#include "kernel/console.h"
 #include "kernel/kprintf.h"
+#include "kernel/ring.h"
+#include "kernel/wait.h"
 #include "libc/string.h"
+#include <stddef.h>
+#include <stdint.h>
 
 #define SC_MAX 57
+// Scancodes waiting to be read, a power of two. Enough for a burst of typing
+// while a long command runs.
+#define PENDING_SIZE 256
 const char *sc_name[] = {"ERROR",     "Esc",     "1", "2", "3", "4", "5", "6", "7", "8", "9", "0", "-",      "=",
                          "Backspace", "Tab",     "Q", "W", "E", "R", "T", "Y", "U", "I", "O", "P", "[",      "]",
                          "Enter",     "Lctrl",   "A", "S", "D", "F", "G", "H", "J", "K", "L", ";", "'",      "`",
@@ -16,15 +23,40 @@ const char sc_ascii[] = {'?', '?', '1', '2', '3', '4', '5', '6', '7', '8', '9',
                          'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ';', '\'', '`', '?', '\\', 'Z',
                          'X', 'C', 'V', 'B', 'N', 'M', ',', '.', '/', '?', '?',  '?', ' '};
 
+// From the interrupt handler to keyboard_read(), raw, so the handler only
+// reads the port.
+static unsigned char pending_items[PENDING_SIZE];
+static ring_t pending;
+// Waiting in keyboard_read().
+static wait_queue_t readers = WAIT_QUEUE_INIT("keyboard");
+
+unsigned char keyboard_read(char *ascii) {
+  unsigned char scancode;
+  // Key releases and keys without a character are skipped here.
+  do {
+    wait_event(&readers, ring_get(&pending, &scancode));
+  } while (scancode > SC_MAX);
+  *ascii = sc_ascii[scancode];
+  return scancode;
+}
+
 static void keyboard_callback(registers_t *regs) {
+  (void)regs;
   /* The PIC leaves us the scancode in port 0x60 */
   unsigned char scancode = inb(0x60);
-  if (scancode > SC_MAX)
-    return;
-  prompt(scancode, sc_ascii[scancode]);
+  // A full ring counts the scancode as an overflow.
+  if (ring_put(&pending, &scancode)) {
+    wake_up(&readers);
+  }
 }
 
 void init_keyboard() {
+  ring_init(&pending, pending_items, sizeof(pending_items[0]), PENDING_SIZE);
   kprintf("register keyboard callback\n");
   register_interrupt_handler(IRQ1, keyboard_callback);
 }
+
+void keyboard_dump(void) {
+  kprintf("keyboard: %u scancodes pending, at most %u, %u dropped\n", pending.head - pending.tail, pending.peak,
+          pending.overflows);
+}
@@ -2,6 +2,11 @@
 #define KEYBOARD_H
 
 void init_keyboard();
+// Wait for the next key press and return its scancode, with its character in
+// `ascii`. For one thread at a time.
+unsigned char keyboard_read(char *ascii);
+// How full the scancode ring got and what did not fit.
+void keyboard_dump(void);
 
 #define BACKSPACE 0x0E
 #define ENTER 0x1C
@@ -5,7 +5,11 @@
 #define MAX_COLS 80
 
 /* Public kernel API */
+// Make video memory write-combined and clear the screen. Needs paging.
+void screen_init();
 void clear_screen();
+// Time scrolling with video memory uncached and write-combined.
+void screen_benchmark();
 void putchar(char c);
 unsigned short get_cursor();
 void set_cursor(unsigned char row, unsigned char col);
@@ -1,5 +1,13 @@
+#include "serial.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/isr.h"
 #include "arch/x86/ports.h"
+#include "kernel/kprintf.h"
+#include "kernel/ring.h"
+#include "kernel/spinlock.h"
+#include "kernel/wait.h"
 #include "libc/printf.h"
+#include <stdint.h>
 
 // COM1  0x3F8
 // COM2  0x2F8
@@ -109,6 +117,20 @@
 // Line Control Register
 #define LINE_CTRL_DLAB 0x80
 
+// Interrupt Enable Register
+#define INTERRUPT_RECEIVED 0x01
+#define INTERRUPT_TRANSMIT_EMPTY 0x02
+
+// Interrupt Identification Register. Bit 0 is clear while an interrupt is
+// pending, bits 1-3 say which, the ones below first.
+#define INTERRUPT_ID_NONE 0x01
+#define INTERRUPT_ID_MASK 0x0e
+#define INTERRUPT_ID_LINE_STATUS 0x06
+#define INTERRUPT_ID_RECEIVED 0x04
+#define INTERRUPT_ID_TIMEOUT 0x0c
+#define INTERRUPT_ID_TRANSMIT_EMPTY 0x02
+#define INTERRUPT_ID_MODEM_STATUS 0x00
+
 // Line Status Register
 // 0  Data ready (DR)                            Set if there is data that can be read
 // 1  Overrun error (OE)                         Set if there has been data lost
@@ -127,6 +149,27 @@
 #define LINE_STATUS_TEMP 0x40
 #define LINE_STATUS_ERR 0x80
 
+// Bytes the transmit FIFO takes once it is empty.
+#define FIFO_SIZE 16
+// Powers of two.
+#define TRANSMIT_SIZE 1024
+#define RECEIVE_SIZE 1024
+
+// Output waits in `transmit` for the transmit-empty interrupt, which moves it
+// to the FIFO, so a thread writing more than the FIFO takes blocks instead of
+// polling the line status. Input goes from the interrupt handler to the
+// reader through the `received` ring, which the reader takes from without the
+// lock.
+static spinlock_t lock = SPINLOCK_INIT("serial");
+static uint8_t interrupts;
+static char transmit[TRANSMIT_SIZE];
+static uint32_t transmit_head;
+static uint32_t transmit_tail;
+static char received_items[RECEIVE_SIZE];
+static ring_t received;
+static wait_queue_t writers = WAIT_QUEUE_INIT("serial write");
+static wait_queue_t readers = WAIT_QUEUE_INIT("serial read");
+
 // The serial controller (UART) has an internal clock which runs at 115200 ticks per second and a clock divisor which is
 // used to control the baud rate. This is exactly the same type of system used by the Programmable Interrupt Timer
 // (PIT).
@@ -142,6 +185,72 @@
 //  3. Send the most significant byte of the divisor value to [PORT + 1].
 //  4. Clear the most significant bit of the Line Control Register.
 
+static void set_interrupts(uint8_t enabled) {
+  if (enabled != interrupts) {
+    interrupts = enabled;
+    outb(PORT_INTERRUPT_ENABLE(COM1), enabled);
+  }
+}
+
+int is_transmit_empty() { return inb(PORT_READ_LINE_STATUS(COM1)) & LINE_STATUS_THRE; }
+
+// Move what waits to the FIFO if it is empty, and have the controller
+// interrupt when it is again while more waits. Called holding `lock`.
+static void flush(void) {
+  if (transmit_tail != transmit_head && is_transmit_empty()) {
+    for (int i = 0; i < FIFO_SIZE && transmit_tail != transmit_head; i++) {
+      outb(PORT_READ_WRITE(COM1), transmit[transmit_tail++ % TRANSMIT_SIZE]);
+    }
+  }
+  uint8_t enabled = interrupts & ~INTERRUPT_TRANSMIT_EMPTY;
+  set_interrupts(transmit_tail != transmit_head ? enabled | INTERRUPT_TRANSMIT_EMPTY : enabled);
+}
+
+// Called holding `lock`, which makes its callers one producer. A full ring
+// counts the bytes it drops. Returns whether a byte came.
+static bool drain_received(void) {
+  bool any = false;
+  while (inb(PORT_READ_LINE_STATUS(COM1)) & LINE_STATUS_DR) {
+    char c = inb(PORT_READ_WRITE(COM1));
+    any |= ring_put(&received, &c);
+  }
+  return any;
+}
+
+static void interrupt_handler(registers_t *regs) {
+  (void)regs;
+  spin_lock(&lock);
+  bool any = false;
+  uint8_t id;
+  while (!((id = inb(PORT_READ_INTERRUPT_ID(COM1))) & INTERRUPT_ID_NONE)) {
+    switch (id & INTERRUPT_ID_MASK) {
+    case INTERRUPT_ID_LINE_STATUS:
+      inb(PORT_READ_LINE_STATUS(COM1));
+      break;
+    case INTERRUPT_ID_RECEIVED:
+    case INTERRUPT_ID_TIMEOUT:
+      any |= drain_received();
+      break;
+    case INTERRUPT_ID_MODEM_STATUS:
+      inb(PORT_READ_MODEM_STATUS(COM1));
+      break;
+    case INTERRUPT_ID_TRANSMIT_EMPTY:
+      // Reading the identification cleared it, flush() refills the FIFO.
+      break;
+    }
+    flush();
+  }
+  bool room = transmit_head - transmit_tail < TRANSMIT_SIZE;
+  spin_unlock(&lock);
+  // Outside `lock`, which the scheduler's traces take below the wait queue's.
+  if (any) {
+    wake_up(&readers);
+  }
+  if (room) {
+    wake_up(&writers);
+  }
+}
+
 int serial_init() {
   outb(PORT_INTERRUPT_ENABLE(COM1), 0x00);    // Disable all interrupts
   outb(PORT_LINE_CTRL(COM1), LINE_CTRL_DLAB); // Enable DLAB (set baud rate divisor)
@@ -161,25 +270,59 @@ int serial_init() {
   // If serial is not faulty set it in normal operation mode
   // (not-loopback with IRQs enabled and OUT#1 and OUT#2 bits enabled)
   outb(PORT_MODEM_CTRL(COM1), 0x0f);
+  ring_init(&received, received_items, sizeof(received_items[0]), RECEIVE_SIZE);
+  register_interrupt_handler(IRQ4, interrupt_handler);
+  uint32_t flags = spin_lock_irqsave(&lock);
+  set_interrupts(INTERRUPT_RECEIVED);
+  spin_unlock_irqrestore(&lock, flags);
   return 0;
 }
 
 int serial_received() { return inb(PORT_READ_LINE_STATUS(COM1)) & LINE_STATUS_DR; }
 
 char serial_read_byte() {
-  while (serial_received() == 0)
-    ;
-
-  return inb(PORT_READ_WRITE(COM1));
+  char c;
+  if (thread_may_block()) {
+    wait_event(&readers, ring_get(&received, &c));
+    return c;
+  }
+  // Code that cannot block polls, the interrupt may not come to this CPU.
+  while (!ring_get(&received, &c)) {
+    uint32_t flags = spin_lock_irqsave(&lock);
+    drain_received();
+    spin_unlock_irqrestore(&lock, flags);
+    cpu_relax();
+  }
+  return c;
 }
 
-int is_transmit_empty() { return inb(PORT_READ_LINE_STATUS(COM1)) & LINE_STATUS_THRE; }
+static bool has_room(void) {
+  return __atomic_load_n(&transmit_head, __ATOMIC_RELAXED) - __atomic_load_n(&transmit_tail, __ATOMIC_ACQUIRE) <
+         TRANSMIT_SIZE;
+}
 
 void serial_putchar(char c) {
-  while (is_transmit_empty() == 0)
-    ;
-
-  outb(PORT_READ_WRITE(COM1), c);
+  bool may_block = thread_may_block();
+  uint32_t flags = spin_lock_irqsave(&lock);
+  while (transmit_head - transmit_tail == TRANSMIT_SIZE) {
+    if (may_block) {
+      spin_unlock_irqrestore(&lock, flags);
+      wait_event(&writers, has_room());
+      flags = spin_lock_irqsave(&lock);
+    } else {
+      flush();
+      cpu_relax();
+    }
+  }
+  transmit[transmit_head++ % TRANSMIT_SIZE] = c;
+  flush();
+  // Code that cannot block may be about to halt or crash, so it does not
+  // leave its output for an interrupt that might not come.
+  while (!may_block && transmit_tail != transmit_head) {
+    cpu_relax();
+    flush();
+  }
+  spin_unlock_irqrestore(&lock, flags);
 }
 
 void serial_printf(const char *format, ...) {
@@ -187,4 +330,9 @@ void serial_printf(const char *format, ...) {
   va_start(args, format);
   vprintf(serial_putchar, format, args);
   va_end(args);
+}
+
+void serial_dump(void) {
+  kprintf("serial: %u bytes received pending, at most %u, %u dropped\n", received.head - received.tail,
+          received.peak, received.overflows);
 }
\ No newline at end of file
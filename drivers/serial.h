@@ -1,7 +1,15 @@
 #ifndef DRIVERS_SERIAL_H
 #define DRIVERS_SERIAL_H
 
-void serial_init(void);
+// Returns non-zero if the controller failed its loopback test.
+int serial_init(void);
+// Queue a byte to send. Threads block while the buffer is full, other code
+// waits until everything it queued is sent.
+void serial_putchar(char c);
+// Wait for the next byte received.
+char serial_read_byte(void);
 void serial_printf(const char *format, ...);
+// How full the receive ring got and what did not fit.
+void serial_dump(void);
 
 #endif
\ No newline at end of file
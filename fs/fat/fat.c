@@ -0,0 +1,382 @@
+#include "fat.h"
+#include "devices/cache.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include "libc/mem.h"
+#include <stddef.h>
+
+#define FAT12_EOC 0xff8
+#define FAT16_EOC 0xfff8
+#define FAT32_EOC 0x0ffffff8
+#define FAT32_MASK 0x0fffffff
+
+// The BIOS Parameter Block found in the first sector of the volume, followed by
+// the FAT32 extended fields.
+typedef struct fat_bpb_t {
+  uint8_t jump[3];
+  uint8_t oem[8];
+  uint16_t bytes_per_sector;
+  uint8_t sectors_per_cluster;
+  uint16_t reserved_sectors;
+  uint8_t n_fats;
+  uint16_t root_entries;
+  uint16_t total_sectors_16;
+  uint8_t media;
+  uint16_t sectors_per_fat_16;
+  uint16_t sectors_per_track;
+  uint16_t heads;
+  uint32_t hidden_sectors;
+  uint32_t total_sectors_32;
+  uint32_t sectors_per_fat_32;
+  uint16_t flags;
+  uint16_t version;
+  uint32_t root_cluster;
+} __attribute__((packed)) fat_bpb_t;
+
+bool fat_mount(fat_volume_t *volume, block_t *block) {
+  cache_buffer_t *buffer = cache_get(block, 0);
+  if (buffer == NULL) {
+    return false;
+  }
+  const fat_bpb_t *bpb = (const fat_bpb_t *)buffer->data;
+  uint16_t signature = buffer->data[510] | (buffer->data[511] << 8);
+
+  if (signature != 0xaa55 || bpb->bytes_per_sector != BLOCK_SIZE_SECTOR || bpb->sectors_per_cluster == 0 ||
+      (bpb->sectors_per_cluster & (bpb->sectors_per_cluster - 1)) != 0 || bpb->n_fats == 0) {
+    kprintf("%s: not a FAT volume\n", block->name);
+    cache_release(buffer);
+    return false;
+  }
+
+  uint32_t total_sectors = bpb->total_sectors_16 ? bpb->total_sectors_16 : bpb->total_sectors_32;
+  uint32_t root_cluster = bpb->root_cluster;
+  volume->block = block;
+  volume->sectors_per_cluster = bpb->sectors_per_cluster;
+  volume->n_fats = bpb->n_fats;
+  volume->sectors_per_fat = bpb->sectors_per_fat_16 ? bpb->sectors_per_fat_16 : bpb->sectors_per_fat_32;
+  volume->fat_start = bpb->reserved_sectors;
+  volume->root_start = volume->fat_start + volume->n_fats * volume->sectors_per_fat;
+  volume->root_sectors = (bpb->root_entries * FAT_DIRENT_SIZE + BLOCK_SIZE_SECTOR - 1) / BLOCK_SIZE_SECTOR;
+  cache_release(buffer);
+  volume->data_start = volume->root_start + volume->root_sectors;
+  volume->n_clusters = (total_sectors - volume->data_start) / volume->sectors_per_cluster;
+  volume->next_free_hint = FAT_FIRST_CLUSTER;
+
+  // The FAT type is determined by the number of clusters and nothing else.
+  if (volume->n_clusters < 4085) {
+    volume->type = FAT_TYPE_12;
+  } else if (volume->n_clusters < 65525) {
+    volume->type = FAT_TYPE_16;
+  } else {
+    volume->type = FAT_TYPE_32;
+  }
+  volume->root_cluster = volume->type == FAT_TYPE_32 ? root_cluster : 0;
+
+  TRACE("FAT", 1, "type: %d, clusters: %d, sectors per cluster: %d, data start: %d", volume->type,
+        volume->n_clusters, volume->sectors_per_cluster, volume->data_start);
+  return true;
+}
+
+// Read `size` little endian bytes at byte `offset` of the first FAT.
+static uint32_t fat_read_bytes(fat_volume_t *volume, uint32_t offset, uint32_t size) {
+  uint32_t value = 0;
+  cache_buffer_t *buffer = NULL;
+  for (uint32_t i = 0; i < size; i++) {
+    uint32_t sector = volume->fat_start + (offset + i) / BLOCK_SIZE_SECTOR;
+    if (buffer == NULL || buffer->sector != sector) {
+      if (buffer != NULL) {
+        cache_release(buffer);
+      }
+      buffer = cache_get(volume->block, sector);
+      if (buffer == NULL) {
+        return 0;
+      }
+    }
+    value |= (uint32_t)buffer->data[(offset + i) % BLOCK_SIZE_SECTOR] << (8 * i);
+  }
+  cache_release(buffer);
+  return value;
+}
+
+// Write `size` little endian bytes at byte `offset` of every FAT copy.
+static void fat_write_bytes(fat_volume_t *volume, uint32_t offset, uint32_t size, uint32_t value) {
+  for (uint32_t copy = 0; copy < volume->n_fats; copy++) {
+    uint32_t base = volume->fat_start + copy * volume->sectors_per_fat;
+    cache_buffer_t *buffer = NULL;
+    for (uint32_t i = 0; i < size; i++) {
+      uint32_t sector = base + (offset + i) / BLOCK_SIZE_SECTOR;
+      if (buffer == NULL || buffer->sector != sector) {
+        if (buffer != NULL) {
+          cache_release(buffer);
+        }
+        buffer = cache_get(volume->block, sector);
+        if (buffer == NULL) {
+          return;
+        }
+        cache_mark_dirty(buffer);
+      }
+      buffer->data[(offset + i) % BLOCK_SIZE_SECTOR] = value >> (8 * i);
+    }
+    cache_release(buffer);
+  }
+}
+
+uint32_t fat_get_entry(fat_volume_t *volume, uint32_t cluster) {
+  switch (volume->type) {
+  case FAT_TYPE_12: {
+    // Two entries are packed into three bytes.
+    uint32_t value = fat_read_bytes(volume, cluster + cluster / 2, 2);
+    return (cluster & 1) ? value >> 4 : value & 0xfff;
+  }
+  case FAT_TYPE_16:
+    return fat_read_bytes(volume, cluster * 2, 2);
+  case FAT_TYPE_32:
+  default:
+    return fat_read_bytes(volume, cluster * 4, 4) & FAT32_MASK;
+  }
+}
+
+void fat_set_entry(fat_volume_t *volume, uint32_t cluster, uint32_t value) {
+  switch (volume->type) {
+  case FAT_TYPE_12: {
+    uint32_t offset = cluster + cluster / 2;
+    uint32_t old = fat_read_bytes(volume, offset, 2);
+    if (cluster & 1) {
+      value = (old & 0x000f) | ((value & 0xfff) << 4);
+    } else {
+      value = (old & 0xf000) | (value & 0xfff);
+    }
+    fat_write_bytes(volume, offset, 2, value);
+  } break;
+  case FAT_TYPE_16:
+    fat_write_bytes(volume, cluster * 2, 2, value);
+    break;
+  case FAT_TYPE_32: {
+    // The upper four bits are reserved and must be preserved.
+    uint32_t old = fat_read_bytes(volume, cluster * 4, 4);
+    fat_write_bytes(volume, cluster * 4, 4, (old & ~FAT32_MASK) | (value & FAT32_MASK));
+  } break;
+  }
+}
+
+uint32_t fat_eoc(const fat_volume_t *volume) {
+  switch (volume->type) {
+  case FAT_TYPE_12:
+    return 0xfff;
+  case FAT_TYPE_16:
+    return 0xffff;
+  case FAT_TYPE_32:
+  default:
+    return FAT32_MASK;
+  }
+}
+
+bool fat_is_eoc(const fat_volume_t *volume, uint32_t value) {
+  switch (volume->type) {
+  case FAT_TYPE_12:
+    return value >= FAT12_EOC;
+  case FAT_TYPE_16:
+    return value >= FAT16_EOC;
+  case FAT_TYPE_32:
+  default:
+    return value >= FAT32_EOC;
+  }
+}
+
+bool fat_is_bad(const fat_volume_t *volume, uint32_t value) {
+  switch (volume->type) {
+  case FAT_TYPE_12:
+    return value == FAT12_EOC - 1;
+  case FAT_TYPE_16:
+    return value == FAT16_EOC - 1;
+  case FAT_TYPE_32:
+  default:
+    return value == FAT32_EOC - 1;
+  }
+}
+
+uint32_t fat_allocate_cluster(fat_volume_t *volume, uint32_t previous) {
+  uint32_t last = volume->n_clusters + FAT_FIRST_CLUSTER;
+  uint32_t cluster = volume->next_free_hint;
+  for (uint32_t i = 0; i < volume->n_clusters; i++, cluster++) {
+    if (cluster >= last) {
+      cluster = FAT_FIRST_CLUSTER;
+    }
+    if (fat_get_entry(volume, cluster) != 0) {
+      continue;
+    }
+    fat_set_entry(volume, cluster, fat_eoc(volume));
+    if (previous != 0) {
+      fat_set_entry(volume, previous, cluster);
+    }
+    volume->next_free_hint = cluster + 1;
+    return cluster;
+  }
+  kprintf("%s: volume is full\n", volume->block->name);
+  return 0;
+}
+
+uint32_t fat_cluster_to_sector(const fat_volume_t *volume, uint32_t cluster) {
+  return volume->data_start + (cluster - FAT_FIRST_CLUSTER) * volume->sectors_per_cluster;
+}
+
+uint32_t fat_cluster_size(const fat_volume_t *volume) { return volume->sectors_per_cluster * BLOCK_SIZE_SECTOR; }
+
+uint32_t fat_dirent_cluster(const fat_dirent_t *dirent) { return (dirent->cluster_hi << 16) | dirent->cluster_lo; }
+
+void fat_dir_iter_init(fat_volume_t *volume, uint32_t cluster, fat_dir_iter_t *it) {
+  it->volume = volume;
+  if (cluster == 0 && volume->type != FAT_TYPE_32) {
+    it->cluster = 0;
+    it->sector = volume->root_start;
+    it->remaining = volume->root_sectors;
+    return;
+  }
+  if (cluster == 0) {
+    cluster = volume->root_cluster;
+  }
+  it->cluster = cluster;
+  it->sector = fat_cluster_to_sector(volume, cluster);
+  it->remaining = volume->sectors_per_cluster;
+}
+
+bool fat_dir_iter_next(fat_dir_iter_t *it, uint32_t *sector) {
+  fat_volume_t *volume = it->volume;
+  if (it->remaining == 0) {
+    // The fixed root directory of FAT12/16 has no cluster chain.
+    if (it->cluster == 0) {
+      return false;
+    }
+    uint32_t next = fat_get_entry(volume, it->cluster);
+    if (next < FAT_FIRST_CLUSTER || fat_is_eoc(volume, next) || next >= volume->n_clusters + FAT_FIRST_CLUSTER) {
+      return false;
+    }
+    it->cluster = next;
+    it->sector = fat_cluster_to_sector(volume, next);
+    it->remaining = volume->sectors_per_cluster;
+  }
+  *sector = it->sector++;
+  it->remaining--;
+  return true;
+}
+
+// Convert a path component such as "FILE.TXT" to the padded on-disk form
+// "FILE    TXT".
+static bool to_short_name(const char *component, size_t length, uint8_t name[11]) {
+  for (size_t i = 0; i < 11; i++) {
+    name[i] = ' ';
+  }
+  // "." and ".." are stored as is.
+  if ((length == 1 && component[0] == '.') || (length == 2 && component[0] == '.' && component[1] == '.')) {
+    name[0] = '.';
+    name[1] = length == 2 ? '.' : ' ';
+    return true;
+  }
+  size_t i = 0;
+  size_t n = 0;
+  for (; i < length && component[i] != '.'; i++) {
+    if (n >= 8) {
+      return false;
+    }
+    char c = component[i];
+    name[n++] = (c >= 'a' && c <= 'z') ? c - 32 : c;
+  }
+  if (i < length) {
+    i++; // Skip '.'
+  }
+  for (n = 8; i < length; i++) {
+    if (n >= 11) {
+      return false;
+    }
+    char c = component[i];
+    name[n++] = (c >= 'a' && c <= 'z') ? c - 32 : c;
+  }
+  return true;
+}
+
+static bool names_equal(const uint8_t *a, const uint8_t *b) {
+  for (size_t i = 0; i < 11; i++) {
+    if (a[i] != b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool find_in_dir(fat_volume_t *volume, uint32_t cluster, const uint8_t name[11], fat_dirent_t *dirent,
+                        fat_location_t *location) {
+  fat_dir_iter_t it;
+  uint32_t sector;
+  fat_dir_iter_init(volume, cluster, &it);
+  while (fat_dir_iter_next(&it, &sector)) {
+    cache_buffer_t *buffer = cache_get(volume->block, sector);
+    if (buffer == NULL) {
+      return false;
+    }
+    for (uint32_t offset = 0; offset < BLOCK_SIZE_SECTOR; offset += FAT_DIRENT_SIZE) {
+      fat_dirent_t *entry = (fat_dirent_t *)&buffer->data[offset];
+      if (entry->name[0] == 0) {
+        // No more entries in this directory.
+        cache_release(buffer);
+        return false;
+      }
+      if (entry->name[0] == FAT_DIRENT_FREE || entry->attributes == FAT_ATTR_LONG_NAME ||
+          (entry->attributes & FAT_ATTR_VOLUME_ID)) {
+        continue;
+      }
+      if (names_equal(entry->name, name)) {
+        memory_copy((char *)entry, (char *)dirent, sizeof(fat_dirent_t));
+        location->sector = sector;
+        location->offset = offset;
+        cache_release(buffer);
+        return true;
+      }
+    }
+    cache_release(buffer);
+  }
+  return false;
+}
+
+bool fat_lookup(fat_volume_t *volume, const char *path, fat_dirent_t *dirent, fat_location_t *location) {
+  uint32_t cluster = 0;
+  bool found = false;
+
+  while (*path) {
+    while (*path == '/') {
+      path++;
+    }
+    if (!*path) {
+      break;
+    }
+    if (found && !(dirent->attributes & FAT_ATTR_DIRECTORY)) {
+      return false;
+    }
+
+    size_t length = 0;
+    while (path[length] && path[length] != '/') {
+      length++;
+    }
+    uint8_t name[11];
+    if (!to_short_name(path, length, name) || !find_in_dir(volume, cluster, name, dirent, location)) {
+      return false;
+    }
+    found = true;
+    // A cluster of 0 in a ".." entry refers to the root directory.
+    cluster = fat_dirent_cluster(dirent);
+    path += length;
+  }
+  return found;
+}
+
+void fat_update_dirent(fat_volume_t *volume, const fat_location_t *location, uint32_t cluster, uint32_t size) {
+  cache_buffer_t *buffer = cache_get(volume->block, location->sector);
+  if (buffer == NULL) {
+    return;
+  }
+  fat_dirent_t *entry = (fat_dirent_t *)&buffer->data[location->offset];
+  entry->cluster_hi = cluster >> 16;
+  entry->cluster_lo = cluster & 0xffff;
+  entry->size = size;
+  cache_mark_dirty(buffer);
+  cache_release(buffer);
+}
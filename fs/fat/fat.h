@@ -0,0 +1,98 @@
+#ifndef FS_FAT_FAT_H
+#define FS_FAT_FAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "devices/block.h"
+
+#define FAT_ATTR_READ_ONLY 0x01
+#define FAT_ATTR_HIDDEN 0x02
+#define FAT_ATTR_SYSTEM 0x04
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define FAT_ATTR_LONG_NAME 0x0f
+
+#define FAT_DIRENT_SIZE 32
+#define FAT_DIRENT_FREE 0xe5
+
+// First valid data cluster. Entries 0 and 1 of the FAT are reserved.
+#define FAT_FIRST_CLUSTER 2
+
+typedef enum fat_type_t {
+  FAT_TYPE_12,
+  FAT_TYPE_16,
+  FAT_TYPE_32,
+} fat_type_t;
+
+typedef struct fat_dirent_t {
+  uint8_t name[11];
+  uint8_t attributes;
+  uint8_t reserved;
+  uint8_t create_time_tenth;
+  uint16_t create_time;
+  uint16_t create_date;
+  uint16_t access_date;
+  uint16_t cluster_hi;
+  uint16_t write_time;
+  uint16_t write_date;
+  uint16_t cluster_lo;
+  uint32_t size;
+} __attribute__((packed)) fat_dirent_t;
+
+typedef struct fat_volume_t {
+  block_t *block;
+  fat_type_t type;
+  uint32_t sectors_per_cluster;
+  uint32_t n_fats;
+  uint32_t sectors_per_fat;
+  uint32_t fat_start;
+  // Fixed root directory region (FAT12/16 only).
+  uint32_t root_start;
+  uint32_t root_sectors;
+  // Cluster of the root directory (FAT32 only).
+  uint32_t root_cluster;
+  uint32_t data_start;
+  uint32_t n_clusters;
+  uint32_t next_free_hint;
+} fat_volume_t;
+
+// Where a directory entry lives on disk, so it can be updated in place.
+typedef struct fat_location_t {
+  uint32_t sector;
+  uint32_t offset;
+} fat_location_t;
+
+// Walks the sectors of a directory, following its cluster chain.
+typedef struct fat_dir_iter_t {
+  fat_volume_t *volume;
+  uint32_t cluster;
+  uint32_t sector;
+  uint32_t remaining;
+} fat_dir_iter_t;
+
+bool fat_mount(fat_volume_t *volume, block_t *block);
+
+uint32_t fat_get_entry(fat_volume_t *volume, uint32_t cluster);
+void fat_set_entry(fat_volume_t *volume, uint32_t cluster, uint32_t value);
+bool fat_is_eoc(const fat_volume_t *volume, uint32_t value);
+bool fat_is_bad(const fat_volume_t *volume, uint32_t value);
+uint32_t fat_eoc(const fat_volume_t *volume);
+// Allocate a free cluster, mark it as end of chain and link it after `previous`
+// (if non-zero). Returns 0 if the volume is full.
+uint32_t fat_allocate_cluster(fat_volume_t *volume, uint32_t previous);
+
+uint32_t fat_cluster_to_sector(const fat_volume_t *volume, uint32_t cluster);
+uint32_t fat_cluster_size(const fat_volume_t *volume);
+uint32_t fat_dirent_cluster(const fat_dirent_t *dirent);
+
+// A cluster of 0 refers to the root directory.
+void fat_dir_iter_init(fat_volume_t *volume, uint32_t cluster, fat_dir_iter_t *it);
+bool fat_dir_iter_next(fat_dir_iter_t *it, uint32_t *sector);
+
+// Resolve an absolute path of 8.3 names, e.g. "/DIR/FILE.TXT".
+bool fat_lookup(fat_volume_t *volume, const char *path, fat_dirent_t *dirent, fat_location_t *location);
+void fat_update_dirent(fat_volume_t *volume, const fat_location_t *location, uint32_t cluster, uint32_t size);
+
+#endif
@@ -0,0 +1,521 @@
+#include "fsck.h"
+#include "arch/x86/timer.h"
+#include "devices/cache.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include "libc/mem.h"
+#include "mm/kmalloc.h"
+#include "mm/vm.h"
+#include <stddef.h>
+
+// The FAT and the directories are read straight from the device in chunks of
+// this many sectors, bypassing the sector cache.
+#define FSCK_CHUNK_SECTORS 64
+#define FSCK_CHUNK_SIZE (FSCK_CHUNK_SECTORS * BLOCK_SIZE_SECTOR)
+#define FSCK_MAX_PENDING_DIRS 256
+
+typedef struct fsck_dir_t {
+  uint32_t cluster;
+  uint32_t n_clusters;
+} fsck_dir_t;
+
+typedef struct fsck_t {
+  fat_volume_t *volume;
+  fat_fsck_t *result;
+  bool repair;
+  uint32_t end_cluster;
+  uint32_t free_run;
+  size_t n_pending;
+  // Set when a directory could not be queued. Its clusters are never marked
+  // as seen, so pass 3 must not run.
+  bool incomplete;
+} fsck_t;
+
+// Called for every data cluster while streaming the FAT. Returns true if
+// `value` was changed and the entry must be written back.
+typedef bool (*fsck_visit_t)(fsck_t *fsck, uint32_t cluster, uint32_t *value);
+
+// Working memory, allocated for the duration of a check.
+static uint8_t *chunk;
+static uint8_t *mirror;
+// One bit per cluster: clusters that some FAT entry points to.
+static uint32_t *referenced;
+// One bit per cluster: clusters reached by walking the directory tree.
+static uint32_t *seen;
+static fsck_dir_t pending[FSCK_MAX_PENDING_DIRS];
+
+static bool bitmap_test(const uint32_t *bitmap, uint32_t bit) { return bitmap[bit / 32] & (1u << (bit % 32)); }
+
+static bool bitmap_test_and_set(uint32_t *bitmap, uint32_t bit) {
+  bool set = bitmap_test(bitmap, bit);
+  bitmap[bit / 32] |= 1u << (bit % 32);
+  return set;
+}
+
+static bool sector_equal(const uint8_t *a, const uint8_t *b) {
+  const uint32_t *x = (const uint32_t *)a;
+  const uint32_t *y = (const uint32_t *)b;
+  for (size_t i = 0; i < BLOCK_SIZE_SECTOR / 4; i++) {
+    if (x[i] != y[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool read_sectors(fsck_t *fsck, uint32_t sector, uint32_t count, void *buffer) {
+  if (!block_read_sectors(fsck->volume->block, sector, count, buffer)) {
+    return false;
+  }
+  fsck->result->bytes_read += count * BLOCK_SIZE_SECTOR;
+  return true;
+}
+
+static void write_sectors(fsck_t *fsck, uint32_t sector, uint32_t count, const void *buffer) {
+  block_write_sectors(fsck->volume->block, sector, count, buffer);
+  cache_invalidate_range(fsck->volume->block, sector, count);
+}
+
+static uint32_t chunk_get(const fat_volume_t *volume, uint32_t cluster) {
+  switch (volume->type) {
+  case FAT_TYPE_12: {
+    uint32_t offset = cluster + cluster / 2;
+    uint32_t value = chunk[offset] | (chunk[offset + 1] << 8);
+    return (cluster & 1) ? value >> 4 : value & 0xfff;
+  }
+  case FAT_TYPE_16: {
+    uint32_t offset = (cluster * 2) % FSCK_CHUNK_SIZE;
+    return chunk[offset] | (chunk[offset + 1] << 8);
+  }
+  case FAT_TYPE_32:
+  default: {
+    uint32_t offset = (cluster * 4) % FSCK_CHUNK_SIZE;
+    return *(uint32_t *)&chunk[offset] & 0x0fffffff;
+  }
+  }
+}
+
+static void chunk_set(const fat_volume_t *volume, uint32_t cluster, uint32_t value) {
+  switch (volume->type) {
+  case FAT_TYPE_12: {
+    uint32_t offset = cluster + cluster / 2;
+    if (cluster & 1) {
+      chunk[offset] = (chunk[offset] & 0x0f) | ((value << 4) & 0xf0);
+      chunk[offset + 1] = value >> 4;
+    } else {
+      chunk[offset] = value;
+      chunk[offset + 1] = (chunk[offset + 1] & 0xf0) | ((value >> 8) & 0x0f);
+    }
+  } break;
+  case FAT_TYPE_16: {
+    uint32_t offset = (cluster * 2) % FSCK_CHUNK_SIZE;
+    chunk[offset] = value;
+    chunk[offset + 1] = value >> 8;
+  } break;
+  case FAT_TYPE_32: {
+    uint32_t *entry = (uint32_t *)&chunk[(cluster * 4) % FSCK_CHUNK_SIZE];
+    *entry = (*entry & 0xf0000000) | (value & 0x0fffffff);
+  } break;
+  }
+}
+
+// Stream the first FAT through `visit`, FSCK_CHUNK_SECTORS at a time. Modified
+// chunks are written to every FAT copy. With `compare`, the other copies are
+// read as well and mismatching sectors are counted.
+static bool stream_fat(fsck_t *fsck, fsck_visit_t visit, bool compare) {
+  fat_volume_t *volume = fsck->volume;
+  uint32_t entries_per_sector = volume->type == FAT_TYPE_32 ? BLOCK_SIZE_SECTOR / 4 : BLOCK_SIZE_SECTOR / 2;
+
+  // FAT12 entries straddle sectors, but a FAT12 FAT is small enough to be
+  // processed as a single chunk.
+  if (volume->type == FAT_TYPE_12 && volume->sectors_per_fat > FSCK_CHUNK_SECTORS) {
+    kprintf("fsck: FAT12 table too large\n");
+    return false;
+  }
+
+  for (uint32_t first = 0; first < volume->sectors_per_fat; first += FSCK_CHUNK_SECTORS) {
+    uint32_t n = volume->sectors_per_fat - first;
+    if (n > FSCK_CHUNK_SECTORS) {
+      n = FSCK_CHUNK_SECTORS;
+    }
+    if (!read_sectors(fsck, volume->fat_start + first, n, chunk)) {
+      return false;
+    }
+
+    uint32_t begin = FAT_FIRST_CLUSTER;
+    uint32_t end = fsck->end_cluster;
+    if (volume->type != FAT_TYPE_12) {
+      uint32_t chunk_begin = first * entries_per_sector;
+      uint32_t chunk_end = (first + n) * entries_per_sector;
+      begin = chunk_begin > begin ? chunk_begin : begin;
+      end = chunk_end < end ? chunk_end : end;
+    }
+
+    bool modified = false;
+    for (uint32_t cluster = begin; cluster < end; cluster++) {
+      uint32_t value = chunk_get(volume, cluster);
+      if (visit(fsck, cluster, &value)) {
+        chunk_set(volume, cluster, value);
+        modified = true;
+      }
+    }
+
+    bool mirrors_differ = false;
+    for (uint32_t copy = 1; compare && copy < volume->n_fats; copy++) {
+      if (!read_sectors(fsck, volume->fat_start + copy * volume->sectors_per_fat + first, n, mirror)) {
+        return false;
+      }
+      for (uint32_t sector = 0; sector < n; sector++) {
+        if (!sector_equal(&chunk[sector * BLOCK_SIZE_SECTOR], &mirror[sector * BLOCK_SIZE_SECTOR])) {
+          fsck->result->fat_mismatches++;
+          mirrors_differ = true;
+        }
+      }
+    }
+
+    if (fsck->repair && (modified || mirrors_differ)) {
+      for (uint32_t copy = 0; copy < volume->n_fats; copy++) {
+        write_sectors(fsck, volume->fat_start + copy * volume->sectors_per_fat + first, n, chunk);
+      }
+      if (mirrors_differ) {
+        fsck->result->repaired++;
+      }
+    }
+  }
+  return true;
+}
+
+// Pass 1: classify every cluster and remember which clusters are pointed to.
+static bool visit_links(fsck_t *fsck, uint32_t cluster, uint32_t *value) {
+  (void)cluster;
+  fat_volume_t *volume = fsck->volume;
+  fat_fsck_t *result = fsck->result;
+  uint32_t next = *value;
+
+  if (next == 0) {
+    result->clusters_free++;
+    return false;
+  }
+  if (fat_is_bad(volume, next)) {
+    result->clusters_bad++;
+    return false;
+  }
+  result->clusters_used++;
+  if (fat_is_eoc(volume, next)) {
+    return false;
+  }
+  if (next < FAT_FIRST_CLUSTER || next >= fsck->end_cluster) {
+    TRACE("FSCK", 1, "cluster %d links to invalid cluster %x", cluster, next);
+    result->invalid_links++;
+    if (fsck->repair) {
+      *value = fat_eoc(volume);
+      result->repaired++;
+      return true;
+    }
+    return false;
+  }
+  if (bitmap_test_and_set(referenced, next)) {
+    TRACE("FSCK", 2, "cluster %d is linked from more than one cluster", next);
+    result->cross_links++;
+  }
+  return false;
+}
+
+// Pass 3: anything allocated but not reached from the directory tree is lost.
+// Also measures free space fragmentation.
+static bool visit_lost(fsck_t *fsck, uint32_t cluster, uint32_t *value) {
+  fat_volume_t *volume = fsck->volume;
+  fat_fsck_t *result = fsck->result;
+
+  if (*value == 0) {
+    if (fsck->free_run++ == 0) {
+      result->free_extents++;
+    }
+    if (fsck->free_run > result->largest_free_extent) {
+      result->largest_free_extent = fsck->free_run;
+    }
+    return false;
+  }
+  fsck->free_run = 0;
+  if (fat_is_bad(volume, *value) || bitmap_test(seen, cluster)) {
+    return false;
+  }
+
+  result->lost_clusters++;
+  if (!bitmap_test(referenced, cluster)) {
+    TRACE("FSCK", 3, "lost chain starting at cluster %d", cluster);
+    result->lost_chains++;
+  }
+  if (fsck->repair) {
+    *value = 0;
+    result->repaired++;
+    return true;
+  }
+  return false;
+}
+
+static bool valid_cluster(const fsck_t *fsck, uint32_t cluster) {
+  return cluster >= FAT_FIRST_CLUSTER && cluster < fsck->end_cluster;
+}
+
+// Free the chain starting at `cluster`, stopping at clusters owned by someone
+// else.
+static void free_chain(fsck_t *fsck, uint32_t cluster) {
+  while (valid_cluster(fsck, cluster)) {
+    uint32_t next = fat_get_entry(fsck->volume, cluster);
+    fat_set_entry(fsck->volume, cluster, 0);
+    if (fat_is_eoc(fsck->volume, next) || bitmap_test(seen, next)) {
+      break;
+    }
+    cluster = next;
+  }
+}
+
+// Walk the chain starting at `cluster`, claiming its clusters. `expected` is
+// the number of clusters the file needs, or 0 for directories (no limit).
+// Returns the number of clusters claimed.
+static uint32_t claim_chain(fsck_t *fsck, uint32_t cluster, uint32_t expected) {
+  fat_volume_t *volume = fsck->volume;
+  uint32_t length = 0;
+
+  while (valid_cluster(fsck, cluster)) {
+    if (bitmap_test_and_set(seen, cluster)) {
+      TRACE("FSCK", 4, "cluster %d is claimed twice", cluster);
+      fsck->result->cross_links++;
+      break;
+    }
+    length++;
+    uint32_t next = fat_get_entry(volume, cluster);
+    if (expected != 0 && length == expected) {
+      if (!fat_is_eoc(volume, next)) {
+        TRACE("FSCK", 5, "chain is longer than the file at cluster %d", cluster);
+        fsck->result->size_mismatches++;
+        if (fsck->repair) {
+          fat_set_entry(volume, cluster, fat_eoc(volume));
+          free_chain(fsck, next);
+          fsck->result->repaired++;
+          break;
+        }
+        // Keep claiming the tail so it is not reported as lost as well.
+        expected = 0;
+      } else {
+        break;
+      }
+    }
+    if (fat_is_eoc(volume, next) || fat_is_bad(volume, next)) {
+      break;
+    }
+    cluster = next;
+  }
+  return length;
+}
+
+static void check_entry(fsck_t *fsck, const fat_dirent_t *dirent, const fat_location_t *location) {
+  fat_volume_t *volume = fsck->volume;
+  uint32_t cluster = fat_dirent_cluster(dirent);
+  uint32_t cluster_size = fat_cluster_size(volume);
+
+  if (cluster != 0 && !valid_cluster(fsck, cluster)) {
+    TRACE("FSCK", 6, "entry at sector %d starts at invalid cluster %x", location->sector, cluster);
+    fsck->result->invalid_links++;
+    if (fsck->repair) {
+      fat_update_dirent(volume, location, 0, 0);
+      fsck->result->repaired++;
+    }
+    return;
+  }
+  if (cluster != 0 && bitmap_test(referenced, cluster)) {
+    // Some other chain runs into the first cluster of this one.
+    TRACE("FSCK", 7, "entry at sector %d starts inside another chain", location->sector);
+    fsck->result->cross_links++;
+  }
+
+  if (dirent->attributes & FAT_ATTR_DIRECTORY) {
+    fsck->result->directories++;
+    if (cluster == 0) {
+      return;
+    }
+    uint32_t n_clusters = claim_chain(fsck, cluster, 0);
+    if (fsck->n_pending >= FSCK_MAX_PENDING_DIRS) {
+      kprintf("fsck: too many directories waiting to be checked\n");
+      fsck->incomplete = true;
+      return;
+    }
+    pending[fsck->n_pending].cluster = cluster;
+    pending[fsck->n_pending].n_clusters = n_clusters;
+    fsck->n_pending++;
+    return;
+  }
+
+  fsck->result->files++;
+  uint32_t expected = (dirent->size + cluster_size - 1) / cluster_size;
+  if (cluster == 0) {
+    if (expected != 0) {
+      fsck->result->size_mismatches++;
+      if (fsck->repair) {
+        fat_update_dirent(volume, location, 0, 0);
+        fsck->result->repaired++;
+      }
+    }
+    return;
+  }
+  if (expected == 0) {
+    // An empty file should not own any clusters.
+    fsck->result->size_mismatches++;
+    if (fsck->repair && !bitmap_test(seen, cluster)) {
+      free_chain(fsck, cluster);
+      fat_update_dirent(volume, location, 0, 0);
+      fsck->result->repaired++;
+    } else {
+      claim_chain(fsck, cluster, 0);
+    }
+    return;
+  }
+
+  uint32_t length = claim_chain(fsck, cluster, expected);
+  if (length < expected) {
+    TRACE("FSCK", 8, "file at sector %d is larger than its chain", location->sector);
+    fsck->result->size_mismatches++;
+    if (fsck->repair) {
+      fat_update_dirent(volume, location, cluster, length * cluster_size);
+      fsck->result->repaired++;
+    }
+  }
+}
+
+// Check the entries of `n_sectors` directory sectors starting at `sector`.
+// Returns false once the end-of-directory marker is found.
+static bool check_entries(fsck_t *fsck, uint32_t sector, uint32_t n_sectors) {
+  for (uint32_t offset = 0; offset < n_sectors * BLOCK_SIZE_SECTOR; offset += FAT_DIRENT_SIZE) {
+    const fat_dirent_t *dirent = (const fat_dirent_t *)&chunk[offset];
+    if (dirent->name[0] == 0) {
+      return false;
+    }
+    if (dirent->name[0] == FAT_DIRENT_FREE || dirent->name[0] == '.' || dirent->attributes == FAT_ATTR_LONG_NAME ||
+        (dirent->attributes & FAT_ATTR_VOLUME_ID)) {
+      continue;
+    }
+    fat_location_t location = {
+        .sector = sector + offset / BLOCK_SIZE_SECTOR,
+        .offset = offset % BLOCK_SIZE_SECTOR,
+    };
+    check_entry(fsck, dirent, &location);
+  }
+  return true;
+}
+
+// Read a directory of `n_clusters` clusters in runs of consecutive clusters and
+// check its entries. Returns false if it could not be read.
+static bool check_directory(fsck_t *fsck, uint32_t cluster, uint32_t n_clusters) {
+  fat_volume_t *volume = fsck->volume;
+  uint32_t max_clusters = FSCK_CHUNK_SECTORS / volume->sectors_per_cluster;
+
+  while (n_clusters > 0 && valid_cluster(fsck, cluster)) {
+    uint32_t first = cluster;
+    uint32_t run = 1;
+    uint32_t next = fat_get_entry(volume, cluster);
+    while (run < n_clusters && run < max_clusters && next == cluster + 1) {
+      cluster = next;
+      next = fat_get_entry(volume, cluster);
+      run++;
+    }
+
+    uint32_t sector = fat_cluster_to_sector(volume, first);
+    uint32_t n_sectors = run * volume->sectors_per_cluster;
+    // Entries may have been updated through the cache by an earlier repair.
+    cache_flush_range(volume->block, sector, n_sectors);
+    if (!read_sectors(fsck, sector, n_sectors, chunk)) {
+      return false;
+    }
+    if (!check_entries(fsck, sector, n_sectors)) {
+      break;
+    }
+    n_clusters -= run;
+    cluster = next;
+  }
+  return true;
+}
+
+static bool check_tree(fsck_t *fsck) {
+  fat_volume_t *volume = fsck->volume;
+
+  if (volume->type == FAT_TYPE_32) {
+    uint32_t n_clusters = claim_chain(fsck, volume->root_cluster, 0);
+    if (!check_directory(fsck, volume->root_cluster, n_clusters)) {
+      return false;
+    }
+  } else {
+    cache_flush_range(volume->block, volume->root_start, volume->root_sectors);
+    for (uint32_t first = 0; first < volume->root_sectors; first += FSCK_CHUNK_SECTORS) {
+      uint32_t n = volume->root_sectors - first;
+      if (n > FSCK_CHUNK_SECTORS) {
+        n = FSCK_CHUNK_SECTORS;
+      }
+      if (!read_sectors(fsck, volume->root_start + first, n, chunk)) {
+        return false;
+      }
+      if (!check_entries(fsck, volume->root_start + first, n)) {
+        break;
+      }
+    }
+  }
+
+  while (fsck->n_pending > 0) {
+    fsck->n_pending--;
+    fsck_dir_t dir = pending[fsck->n_pending];
+    if (!check_directory(fsck, dir.cluster, dir.n_clusters)) {
+      return false;
+    }
+  }
+  // Whatever the skipped directories own would be freed as lost.
+  return !fsck->incomplete;
+}
+
+bool fat_fsck(fat_volume_t *volume, bool repair, fat_fsck_t *result) {
+  fsck_t fsck = {
+      .volume = volume,
+      .result = result,
+      .repair = repair,
+      .end_cluster = volume->n_clusters + FAT_FIRST_CLUSTER,
+      .free_run = 0,
+      .n_pending = 0,
+      .incomplete = false,
+  };
+  memory_set((unsigned char *)result, 0, sizeof(fat_fsck_t));
+
+  uint32_t bitmap_size = (fsck.end_cluster + 31) / 32 * 4;
+  chunk = kmalloc(FSCK_CHUNK_SIZE, MEMTAG_FSCK);
+  mirror = kmalloc(FSCK_CHUNK_SIZE, MEMTAG_FSCK);
+  // Only the parts of the bitmaps covering used clusters are ever touched.
+  referenced = vmalloc(bitmap_size, MEMTAG_FSCK);
+  seen = vmalloc(bitmap_size, MEMTAG_FSCK);
+  bool ok = chunk != NULL && mirror != NULL && referenced != NULL && seen != NULL;
+  if (!ok) {
+    kprintf("fsck: out of memory\n");
+  }
+
+  uint32_t start = timer_ticks();
+  // The device is read directly below, so it has to be up to date.
+  cache_flush();
+
+  ok = ok && stream_fat(&fsck, visit_links, true) && check_tree(&fsck);
+  cache_flush();
+  ok = ok && stream_fat(&fsck, visit_lost, false);
+  cache_flush();
+
+  kfree(chunk, MEMTAG_FSCK);
+  kfree(mirror, MEMTAG_FSCK);
+  vfree(referenced, MEMTAG_FSCK);
+  vfree(seen, MEMTAG_FSCK);
+
+  if (repair) {
+    volume->next_free_hint = FAT_FIRST_CLUSTER;
+  }
+  result->ticks = timer_ticks() - start;
+  if (!ok) {
+    return false;
+  }
+  uint32_t problems = result->invalid_links + result->cross_links + result->lost_clusters + result->size_mismatches +
+                      result->fat_mismatches;
+  return problems == 0 || (repair && result->cross_links == 0);
+}
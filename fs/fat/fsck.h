@@ -0,0 +1,39 @@
+#ifndef FS_FAT_FSCK_H
+#define FS_FAT_FSCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fat.h"
+
+typedef struct fat_fsck_t {
+  uint32_t clusters_used;
+  uint32_t clusters_free;
+  uint32_t clusters_bad;
+  uint32_t free_extents;
+  uint32_t largest_free_extent;
+  uint32_t files;
+  uint32_t directories;
+  // FAT entries pointing outside the volume or at reserved values.
+  uint32_t invalid_links;
+  // Clusters claimed by more than one chain, or chains that loop.
+  uint32_t cross_links;
+  // Allocated clusters not reachable from any directory entry.
+  uint32_t lost_clusters;
+  uint32_t lost_chains;
+  // Files whose size does not match the length of their cluster chain.
+  uint32_t size_mismatches;
+  // FAT sectors that differ between the FAT copies.
+  uint32_t fat_mismatches;
+  uint32_t repaired;
+  uint32_t bytes_read;
+  uint32_t ticks;
+} fat_fsck_t;
+
+// Check the volume and, with `repair`, fix what can be fixed: invalid links are
+// terminated, lost chains are freed, over-long chains are truncated, sizes are
+// clamped to the chain and FAT copies are resynchronised. Cross-links are only
+// reported. Returns true if the volume is clean (after repair).
+bool fat_fsck(fat_volume_t *volume, bool repair, fat_fsck_t *result);
+
+#endif
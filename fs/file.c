@@ -0,0 +1,397 @@
+#include "file.h"
+#include "devices/cache.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include "kernel/wait.h"
+#include "libc/mem.h"
+#include "mm/slab.h"
+#include "page_cache.h"
+#include <stddef.h>
+
+static slab_cache_t *inode_cache;
+static slab_cache_t *file_cache;
+// Inodes of open files.
+static inode_t *inodes;
+static semaphore_t lock = SEMAPHORE_INIT("file", 1);
+
+void file_init(void) {
+  inode_cache = slab_cache_create("inode", sizeof(inode_t), MEMTAG_FILE);
+  file_cache = slab_cache_create("file", sizeof(file_t), MEMTAG_FILE);
+  inodes = NULL;
+}
+
+static inode_t *inode_get(file_system_t *file_system, const fat_dirent_t *dirent, const fat_location_t *location) {
+  for (inode_t *inode = inodes; inode != NULL; inode = inode->next) {
+    if (inode->file_system == file_system && inode->location.sector == location->sector &&
+        inode->location.offset == location->offset) {
+      __atomic_fetch_add(&inode->refs, 1, __ATOMIC_RELAXED);
+      return inode;
+    }
+  }
+
+  inode_t *inode = slab_alloc(inode_cache);
+  if (inode == NULL) {
+    kprintf("out of memory for inodes\n");
+    return NULL;
+  }
+  inode->file_system = file_system;
+  inode->location = *location;
+  inode->cluster = fat_dirent_cluster(dirent);
+  inode->size = dirent->size;
+  inode->attributes = dirent->attributes;
+  inode->refs = 1;
+  inode->pages = NULL;
+  inode->dirty_pages = 0;
+  inode->prev = NULL;
+  inode->next = inodes;
+  if (inodes != NULL) {
+    inodes->prev = inode;
+  }
+  inodes = inode;
+  return inode;
+}
+
+void file_lock(void) { semaphore_down_or_spin(&lock); }
+
+void file_unlock(void) { semaphore_up(&lock); }
+
+// The caller already holds a reference, so the inode cannot go away and the
+// lock is not needed.
+void inode_ref(inode_t *inode) { __atomic_fetch_add(&inode->refs, 1, __ATOMIC_RELAXED); }
+
+static void put(inode_t *inode) {
+  if (__atomic_sub_fetch(&inode->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  page_cache_release(inode);
+  if (inode->prev != NULL) {
+    inode->prev->next = inode->next;
+  } else {
+    inodes = inode->next;
+  }
+  if (inode->next != NULL) {
+    inode->next->prev = inode->prev;
+  }
+  slab_free(inode_cache, inode);
+}
+
+void inode_put(inode_t *inode) {
+  file_lock();
+  put(inode);
+  file_unlock();
+}
+
+static void inode_sync(inode_t *inode) {
+  fat_update_dirent(&inode->file_system->fat, &inode->location, inode->cluster, inode->size);
+}
+
+static file_t *open(const char *path, int flags) {
+  file_system_t *file_system = file_system_get();
+  if (file_system == NULL) {
+    return NULL;
+  }
+
+  fat_dirent_t dirent;
+  fat_location_t location;
+  if (!fat_lookup(&file_system->fat, path, &dirent, &location)) {
+    return NULL;
+  }
+  if (dirent.attributes & FAT_ATTR_DIRECTORY) {
+    return NULL;
+  }
+  if ((dirent.attributes & FAT_ATTR_READ_ONLY) && (flags & O_ACCMODE) != O_RDONLY) {
+    return NULL;
+  }
+
+  file_t *file = slab_alloc(file_cache);
+  if (file == NULL) {
+    kprintf("out of memory for files\n");
+    return NULL;
+  }
+
+  file->inode = inode_get(file_system, &dirent, &location);
+  if (file->inode == NULL) {
+    slab_free(file_cache, file);
+    return NULL;
+  }
+  file->offset = 0;
+  file->flags = flags;
+  file->cluster_index = 0;
+  file->cluster = 0;
+  return file;
+}
+
+file_t *file_open(const char *path, int flags) {
+  file_lock();
+  file_t *file = open(path, flags);
+  file_unlock();
+  return file;
+}
+
+void file_close(file_t *file) {
+  file_lock();
+  put(file->inode);
+  file_unlock();
+  slab_free(file_cache, file);
+  // Write back data and metadata so the volume is consistent on disk.
+  cache_flush();
+}
+
+bool file_seek(file_t *file, uint32_t offset) {
+  if (offset > file->inode->size) {
+    return false;
+  }
+  file->offset = offset;
+  return true;
+}
+
+uint32_t file_size(const file_t *file) { return file->inode->size; }
+
+// Returns the cluster holding cluster `index` of the file, or 0 past the end of
+// the chain. With `allocate` the chain is extended as needed.
+static uint32_t file_cluster(file_t *file, uint32_t index, bool allocate) {
+  inode_t *inode = file->inode;
+  fat_volume_t *volume = &inode->file_system->fat;
+  uint32_t cluster = file->cluster;
+  uint32_t i = file->cluster_index;
+
+  if (cluster == 0 || i > index) {
+    cluster = inode->cluster;
+    i = 0;
+    if (cluster == 0) {
+      if (!allocate || (cluster = fat_allocate_cluster(volume, 0)) == 0) {
+        return 0;
+      }
+      inode->cluster = cluster;
+      inode_sync(inode);
+    }
+  }
+
+  while (i < index) {
+    uint32_t next = fat_get_entry(volume, cluster);
+    if (next < FAT_FIRST_CLUSTER || fat_is_eoc(volume, next)) {
+      if (!allocate || (next = fat_allocate_cluster(volume, cluster)) == 0) {
+        return 0;
+      }
+    }
+    cluster = next;
+    i++;
+  }
+
+  file->cluster_index = index;
+  file->cluster = cluster;
+  return cluster;
+}
+
+// Map the file offset `position` to a run of physically consecutive sectors.
+// Clusters that follow each other on disk are merged, up to `max_sectors`.
+static uint32_t file_sector_run(file_t *file, uint32_t position, uint32_t max_sectors, uint32_t *n_sectors) {
+  fat_volume_t *volume = &file->inode->file_system->fat;
+  uint32_t cluster_size = fat_cluster_size(volume);
+  uint32_t index = position / cluster_size;
+  uint32_t cluster = file_cluster(file, index, false);
+  if (cluster == 0) {
+    return 0;
+  }
+
+  uint32_t first = (position % cluster_size) / BLOCK_SIZE_SECTOR;
+  uint32_t sector = fat_cluster_to_sector(volume, cluster) + first;
+  uint32_t n = volume->sectors_per_cluster - first;
+  while (n < max_sectors) {
+    uint32_t next = fat_get_entry(volume, cluster);
+    if (next != cluster + 1) {
+      break;
+    }
+    cluster = next;
+    file->cluster_index = ++index;
+    file->cluster = cluster;
+    n += volume->sectors_per_cluster;
+  }
+  *n_sectors = n < max_sectors ? n : max_sectors;
+  return sector;
+}
+
+static int file_read_direct(file_t *file, uint8_t *buffer, uint32_t count) {
+  inode_t *inode = file->inode;
+  block_t *block = inode->file_system->block;
+  uint32_t available = inode->size - file->offset;
+  // The device can only transfer whole sectors, so the tail of the last sector
+  // of the file is transferred as well but not counted.
+  uint32_t transfer = count;
+  if (available < count) {
+    transfer = (available + BLOCK_SIZE_SECTOR - 1) / BLOCK_SIZE_SECTOR * BLOCK_SIZE_SECTOR;
+  }
+
+  uint32_t done = 0;
+  while (done < transfer) {
+    uint32_t n;
+    uint32_t sector = file_sector_run(file, file->offset + done, (transfer - done) / BLOCK_SIZE_SECTOR, &n);
+    if (sector == 0) {
+      break;
+    }
+    // Dirty cached copies are newer than what is on disk.
+    cache_flush_range(block, sector, n);
+    if (!block_read_sectors(block, sector, n, buffer + done)) {
+      return -1;
+    }
+    done += n * BLOCK_SIZE_SECTOR;
+  }
+
+  if (done > available) {
+    done = available;
+  }
+  file->offset += done;
+  return done;
+}
+
+static int file_write_direct(file_t *file, const uint8_t *buffer, uint32_t count) {
+  inode_t *inode = file->inode;
+  block_t *block = inode->file_system->block;
+  uint32_t cluster_size = fat_cluster_size(&inode->file_system->fat);
+
+  // Extend the cluster chain up front so the runs below can be merged.
+  if (file_cluster(file, (file->offset + count - 1) / cluster_size, true) == 0) {
+    return -1;
+  }
+
+  uint32_t done = 0;
+  while (done < count) {
+    uint32_t n;
+    uint32_t sector = file_sector_run(file, file->offset + done, (count - done) / BLOCK_SIZE_SECTOR, &n);
+    if (sector == 0 || !block_write_sectors(block, sector, n, buffer + done)) {
+      break;
+    }
+    // Cached copies of these sectors are now stale.
+    cache_invalidate_range(block, sector, n);
+    done += n * BLOCK_SIZE_SECTOR;
+  }
+
+  file->offset += done;
+  if (file->offset > inode->size) {
+    inode->size = file->offset;
+    inode_sync(inode);
+  }
+  return done;
+}
+
+int file_read_locked(file_t *file, void *buffer, uint32_t count) {
+  if ((file->flags & O_ACCMODE) == O_WRONLY) {
+    return -1;
+  }
+  inode_t *inode = file->inode;
+  // Pages written through shared mappings are newer than the disk.
+  if (inode->dirty_pages > 0) {
+    page_cache_sync(inode);
+  }
+  if (file->offset >= inode->size || count == 0) {
+    return 0;
+  }
+  if (file->flags & O_DIRECT) {
+    if (file->offset % BLOCK_SIZE_SECTOR != 0 || count % BLOCK_SIZE_SECTOR != 0) {
+      return -1;
+    }
+    return file_read_direct(file, buffer, count);
+  }
+
+  if (count > inode->size - file->offset) {
+    count = inode->size - file->offset;
+  }
+
+  fat_volume_t *volume = &inode->file_system->fat;
+  uint8_t *p = buffer;
+  uint32_t done = 0;
+  while (done < count) {
+    uint32_t n_sectors;
+    uint32_t sector = file_sector_run(file, file->offset, 1, &n_sectors);
+    if (sector == 0) {
+      break;
+    }
+    uint32_t offset = file->offset % BLOCK_SIZE_SECTOR;
+    uint32_t n = BLOCK_SIZE_SECTOR - offset;
+    if (n > count - done) {
+      n = count - done;
+    }
+    cache_buffer_t *cached = cache_get(volume->block, sector);
+    if (cached == NULL) {
+      break;
+    }
+    memory_copy((char *)&cached->data[offset], (char *)p + done, n);
+    cache_release(cached);
+    done += n;
+    file->offset += n;
+  }
+  return done;
+}
+
+int file_read(file_t *file, void *buffer, uint32_t count) {
+  file_lock();
+  int done = file_read_locked(file, buffer, count);
+  file_unlock();
+  return done;
+}
+
+static int file_write_cached(file_t *file, const void *buffer, uint32_t count) {
+  inode_t *inode = file->inode;
+  fat_volume_t *volume = &inode->file_system->fat;
+  uint32_t cluster_size = fat_cluster_size(volume);
+  const uint8_t *p = buffer;
+  uint32_t done = 0;
+  while (done < count) {
+    if (file_cluster(file, file->offset / cluster_size, true) == 0) {
+      break;
+    }
+    uint32_t n_sectors;
+    uint32_t sector = file_sector_run(file, file->offset, 1, &n_sectors);
+    uint32_t offset = file->offset % BLOCK_SIZE_SECTOR;
+    uint32_t n = BLOCK_SIZE_SECTOR - offset;
+    if (n > count - done) {
+      n = count - done;
+    }
+    cache_buffer_t *cached = cache_get(volume->block, sector);
+    if (cached == NULL) {
+      break;
+    }
+    memory_copy((char *)p + done, (char *)&cached->data[offset], n);
+    cache_mark_dirty(cached);
+    cache_release(cached);
+    done += n;
+    file->offset += n;
+  }
+
+  if (file->offset > inode->size) {
+    inode->size = file->offset;
+    inode_sync(inode);
+  }
+  return done;
+}
+
+int file_write_locked(file_t *file, const void *buffer, uint32_t count) {
+  if ((file->flags & O_ACCMODE) == O_RDONLY) {
+    return -1;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  uint32_t offset = file->offset;
+  int done;
+  if (file->flags & O_DIRECT) {
+    if (file->offset % BLOCK_SIZE_SECTOR != 0 || count % BLOCK_SIZE_SECTOR != 0) {
+      return -1;
+    }
+    done = file_write_direct(file, buffer, count);
+  } else {
+    done = file_write_cached(file, buffer, count);
+  }
+  // Keep mappings of the file in step.
+  if (done > 0) {
+    page_cache_update(file->inode, offset, buffer, done);
+  }
+  return done;
+}
+
+int file_write(file_t *file, const void *buffer, uint32_t count) {
+  file_lock();
+  int done = file_write_locked(file, buffer, count);
+  file_unlock();
+  return done;
+}
@@ -0,0 +1,62 @@
+#ifndef FS_FILE_H
+#define FS_FILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "file_system.h"
+
+#define O_RDONLY 0x0000
+#define O_WRONLY 0x0001
+#define O_RDWR 0x0002
+#define O_ACCMODE 0x0003
+// Bypass the sector cache. Reads and writes go straight between the device and
+// the caller's buffer, so the file offset and the length of every transfer must
+// be multiples of BLOCK_SIZE_SECTOR.
+#define O_DIRECT 0x4000
+
+// In-memory state of a file, shared by every open file referring to it.
+typedef struct inode_t {
+  file_system_t *file_system;
+  fat_location_t location;
+  uint32_t cluster;
+  uint32_t size;
+  uint8_t attributes;
+  uint32_t refs;
+  // Cached pages of the file, see page_cache.h.
+  struct page_t *pages;
+  uint32_t dirty_pages;
+  struct inode_t *prev;
+  struct inode_t *next;
+} inode_t;
+
+typedef struct file_t {
+  inode_t *inode;
+  uint32_t offset;
+  int flags;
+  // The last cluster looked up, so sequential access does not walk the chain
+  // from the start every time.
+  uint32_t cluster_index;
+  uint32_t cluster;
+} file_t;
+
+void file_init(void);
+// Guards the inodes, the FAT and the page cache, which call into each other.
+// The calls below take it. A semaphore, so the holder can sleep on the disk.
+void file_lock(void);
+void file_unlock(void);
+file_t *file_open(const char *path, int flags);
+void file_close(file_t *file);
+// Returns the number of bytes transferred, or -1 on error.
+int file_read(file_t *file, void *buffer, uint32_t count);
+int file_write(file_t *file, const void *buffer, uint32_t count);
+// file_read() and file_write() for callers that hold the lock.
+int file_read_locked(file_t *file, void *buffer, uint32_t count);
+int file_write_locked(file_t *file, const void *buffer, uint32_t count);
+bool file_seek(file_t *file, uint32_t offset);
+uint32_t file_size(const file_t *file);
+// Keep an inode around without an open file, as mappings do.
+void inode_ref(inode_t *inode);
+void inode_put(inode_t *inode);
+
+#endif
@@ -1,8 +1,24 @@
 #include "file_system.h"
+#include "file.h"
+#include "kernel/trace.h"
+#include <stddef.h>
 
 static file_system_t file_system;
 
+// The disk probe mounts while other threads may look the file system up. The
+// file lock makes them wait until it is complete.
 void file_system_init(block_t *block, file_system_type_t type) {
-  file_system.block = block;
-  file_system.type = type;
+  file_lock();
+  if (file_system.type != FILE_SYSTEM_NONE) {
+    file_unlock();
+    TRACE("FS", 1, "already mounted, ignoring %s", block->name);
+    return;
+  }
+  if (type == FILE_SYSTEM_FAT && fat_mount(&file_system.fat, block)) {
+    file_system.block = block;
+    file_system.type = type;
+  }
+  file_unlock();
 }
+
+file_system_t *file_system_get(void) { return file_system.type == FILE_SYSTEM_NONE ? NULL : &file_system; }
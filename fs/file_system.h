@@ -2,17 +2,21 @@
 #define FS_FILE_SYSTEM_H
 
 #include "devices/block.h"
+#include "fs/fat/fat.h"
 
 typedef enum file_system_type_t {
   FILE_SYSTEM_NONE,
-  FILE_SYSTEM_FAT16,
+  FILE_SYSTEM_FAT,
 } file_system_type_t;
 
 typedef struct file_system_t {
   block_t *block;
   file_system_type_t type;
+  fat_volume_t fat;
 } file_system_t;
 
 void file_system_init(block_t *block, file_system_type_t type);
+// The mounted root file system, or NULL if no volume could be mounted.
+file_system_t *file_system_get(void);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,228 @@
+#include "page_cache.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include "libc/mem.h"
+#include "mm/frame.h"
+#include "mm/memstat.h"
+#include "mm/slab.h"
+#include <stddef.h>
+
+#define PAGE_CACHE_BUCKETS 256
+
+static slab_cache_t *page_cache;
+// Cached pages hashed by inode and index.
+static page_t *buckets[PAGE_CACHE_BUCKETS];
+static page_cache_stats_t stats;
+
+static uint32_t hash(const inode_t *inode, uint32_t index) {
+  return ((uint32_t)inode / sizeof(inode_t) + index) % PAGE_CACHE_BUCKETS;
+}
+
+static page_t *lookup(const inode_t *inode, uint32_t index) {
+  for (page_t *page = buckets[hash(inode, index)]; page != NULL; page = page->hash_next) {
+    if (page->inode == inode && page->index == index) {
+      return page;
+    }
+  }
+  return NULL;
+}
+
+void page_cache_init(void) {
+  page_cache = slab_cache_create("page", sizeof(page_t), MEMTAG_PAGE_CACHE);
+  for (size_t i = 0; i < PAGE_CACHE_BUCKETS; i++) {
+    buckets[i] = NULL;
+  }
+}
+
+static page_t *get(inode_t *inode, uint32_t index, bool *read) {
+  page_t *page = lookup(inode, index);
+  if (page != NULL) {
+    stats.hits++;
+    return page;
+  }
+  if (index >= (inode->size + PAGE_SIZE - 1) >> PAGE_SHIFT) {
+    return NULL;
+  }
+
+  page = slab_alloc(page_cache);
+  uint32_t frame = frame_alloc_zeroed();
+  if (page == NULL || frame == 0) {
+    kprintf("page cache: out of memory\n");
+    if (page != NULL) {
+      slab_free(page_cache, page);
+    }
+    if (frame != 0) {
+      frame_free(frame, 0);
+    } else {
+      memstat_failed(MEMTAG_PAGE_CACHE);
+    }
+    stats.failed++;
+    return NULL;
+  }
+  // Read straight into the page, the tail past the end of the file stays zero.
+  file_t file = {.inode = inode, .offset = index << PAGE_SHIFT, .flags = O_RDONLY | O_DIRECT};
+  if (file_read_locked(&file, P2V(frame), PAGE_SIZE) < 0) {
+    slab_free(page_cache, page);
+    frame_free(frame, 0);
+    stats.failed++;
+    return NULL;
+  }
+
+  page->inode = inode;
+  page->index = index;
+  page->frame = frame;
+  page->dirty = false;
+  uint32_t bucket = hash(inode, index);
+  page->hash_next = buckets[bucket];
+  buckets[bucket] = page;
+  page->inode_next = inode->pages;
+  inode->pages = page;
+  stats.pages++;
+  stats.reads++;
+  // The frame is charged to the cache for as long as the cache holds it, even
+  // when mappings keep it alive longer.
+  memstat_alloc(MEMTAG_PAGE_CACHE, P2V(frame), PAGE_SIZE, MEMSTAT_SITE);
+  *read = true;
+  TRACE("PAGE_CACHE", 1, "read page %d of inode %x", index, inode);
+  return page;
+}
+
+page_t *page_cache_get(inode_t *inode, uint32_t index, bool *read) {
+  file_lock();
+  page_t *page = get(inode, index, read);
+  file_unlock();
+  return page;
+}
+
+void page_cache_update(inode_t *inode, uint32_t offset, const void *data, uint32_t count) {
+  if (inode->pages == NULL) {
+    return;
+  }
+  const uint8_t *p = data;
+  uint32_t end = offset + count;
+  while (offset < end) {
+    uint32_t in_page = offset & (PAGE_SIZE - 1);
+    uint32_t n = PAGE_SIZE - in_page < end - offset ? PAGE_SIZE - in_page : end - offset;
+    page_t *page = lookup(inode, offset >> PAGE_SHIFT);
+    if (page != NULL) {
+      memory_copy((char *)p, (char *)P2V(page->frame) + in_page, n);
+    }
+    p += n;
+    offset += n;
+  }
+}
+
+// Write the part of the page inside the file. Whole sectors go straight to the
+// device, a partial last sector through the sector cache so the file does not
+// grow.
+static bool write_page(page_t *page) {
+  inode_t *inode = page->inode;
+  uint32_t offset = page->index << PAGE_SHIFT;
+  if (offset < inode->size) {
+    uint32_t count = inode->size - offset < PAGE_SIZE ? inode->size - offset : PAGE_SIZE;
+    uint32_t whole = count & ~(BLOCK_SIZE_SECTOR - 1);
+    uint8_t *data = P2V(page->frame);
+    file_t file = {.inode = inode, .offset = offset, .flags = O_RDWR | O_DIRECT};
+    if (whole > 0 && file_write_locked(&file, data, whole) != (int)whole) {
+      return false;
+    }
+    file.flags = O_RDWR;
+    if (count > whole && file_write_locked(&file, data + whole, count - whole) != (int)(count - whole)) {
+      return false;
+    }
+    stats.writebacks++;
+  }
+  page->dirty = false;
+  inode->dirty_pages--;
+  return true;
+}
+
+bool page_cache_sync(inode_t *inode) {
+  bool ok = true;
+  for (page_t *page = inode->pages; page != NULL && inode->dirty_pages > 0; page = page->inode_next) {
+    if (page->dirty && !write_page(page)) {
+      kprintf("page cache: write back of page %u failed\n", page->index);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+void page_cache_release(inode_t *inode) {
+  page_cache_sync(inode);
+  while (inode->pages != NULL) {
+    page_t *page = inode->pages;
+    inode->pages = page->inode_next;
+    page_t **link = &buckets[hash(inode, page->index)];
+    while (*link != page) {
+      link = &(*link)->hash_next;
+    }
+    *link = page->hash_next;
+    memstat_free(MEMTAG_PAGE_CACHE, P2V(page->frame), PAGE_SIZE);
+    frame_unref(page->frame);
+    slab_free(page_cache, page);
+    stats.pages--;
+  }
+  inode->dirty_pages = 0;
+}
+
+static uint32_t map_page(vm_area_t *area, uint32_t index, bool *major) {
+  page_t *page = page_cache_get(area->object, index, major);
+  if (page == NULL) {
+    return 0;
+  }
+  frame_ref(page->frame);
+  return page->frame;
+}
+
+static void map_dirty(vm_area_t *area, uint32_t index) {
+  inode_t *inode = area->object;
+  file_lock();
+  page_t *page = lookup(inode, index);
+  if (page != NULL && !page->dirty) {
+    page->dirty = true;
+    inode->dirty_pages++;
+  }
+  file_unlock();
+}
+
+static void map_sync(vm_area_t *area) {
+  file_lock();
+  page_cache_sync(area->object);
+  file_unlock();
+}
+
+static void map_open(vm_area_t *area) { inode_ref(area->object); }
+
+static void map_close(vm_area_t *area) { inode_put(area->object); }
+
+static const vm_ops_t file_vm_ops = {
+    .page = map_page,
+    .dirty = map_dirty,
+    .sync = map_sync,
+    .open = map_open,
+    .close = map_close,
+};
+
+void *file_mmap(file_t *file, vm_space_t *space, uint32_t address, uint32_t size, uint32_t offset, uint32_t flags) {
+  int mode = file->flags & O_ACCMODE;
+  if (offset & (PAGE_SIZE - 1) || mode == O_WRONLY || (flags & VM_SHARED && flags & VM_WRITE && mode == O_RDONLY)) {
+    return NULL;
+  }
+  if (address == 0 && (address = vm_find_free(space, size)) == 0) {
+    return NULL;
+  }
+  inode_ref(file->inode);
+  if (!vm_map_object(space, address, size, flags, &file_vm_ops, file->inode, offset >> PAGE_SHIFT)) {
+    inode_put(file->inode);
+    return NULL;
+  }
+  return (void *)address;
+}
+
+const page_cache_stats_t *page_cache_stats(void) { return &stats; }
+
+void page_cache_dump(void) {
+  kprintf("page cache: %u pages, %u hits, %u reads, %u write-backs, %u failed\n", stats.pages, stats.hits, stats.reads,
+          stats.writebacks, stats.failed);
+}
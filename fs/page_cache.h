@@ -0,0 +1,50 @@
+#ifndef FS_PAGE_CACHE_H
+#define FS_PAGE_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "file.h"
+#include "mm/vm.h"
+
+// A page of a file. Pages stay cached until the last reference to the inode
+// is gone, so every mapping of a file sees the same frames.
+typedef struct page_t {
+  inode_t *inode;
+  uint32_t index;
+  uint32_t frame;
+  bool dirty;
+  struct page_t *hash_next;
+  struct page_t *inode_next;
+} page_t;
+
+typedef struct page_cache_stats_t {
+  uint32_t pages;
+  uint32_t hits;
+  uint32_t reads;
+  uint32_t writebacks;
+  uint32_t failed;
+} page_cache_stats_t;
+
+void page_cache_init(void);
+// Page `index` of the file, read in if needed, in which case `read` is set.
+// NULL past the end of the file or if it could not be read.
+page_t *page_cache_get(inode_t *inode, uint32_t index, bool *read);
+// The file layer calls the next three with the file lock held.
+// Copy data file_write() wrote to the file into the cached pages.
+void page_cache_update(inode_t *inode, uint32_t offset, const void *data, uint32_t count);
+// Write the dirty pages of the file back.
+bool page_cache_sync(inode_t *inode);
+// Write back and drop the pages of an inode that is going away.
+void page_cache_release(inode_t *inode);
+
+// Map `size` bytes of the file from `offset`, which must be page aligned, at
+// `address` in `space`, or wherever there is room if `address` is 0. Pages are
+// read on first touch. With VM_SHARED, writes reach the file when they are
+// synced with vm_sync() or unmapped; otherwise they stay private. Returns the
+// address of the mapping or NULL.
+void *file_mmap(file_t *file, vm_space_t *space, uint32_t address, uint32_t size, uint32_t offset, uint32_t flags);
+const page_cache_stats_t *page_cache_stats(void);
+void page_cache_dump(void);
+
+#endif
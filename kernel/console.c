@@ -1,11 +1,50 @@
 #include "../drivers/keyboard.h"
 #include "../libc/mem.h"
 #include "../libc/string.h"
+#include "arch/x86/acpi.h"
+#include "arch/x86/apic.h"
+#include "arch/x86/fpu.h"
+#include "arch/x86/isr.h"
+#include "arch/x86/memory_map.h"
+#include "arch/x86/memtype.h"
+#include "arch/x86/paging.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/timer.h"
+#include "devices/block.h"
 #include "drivers/screen.h"
+#include "drivers/serial.h"
+#include "fs/fat/fsck.h"
+#include "fs/file.h"
+#include "fs/file_system.h"
+#include "fs/page_cache.h"
+#include "hrtimer.h"
 #include "kprintf.h"
+#include "lockstat.h"
+#include "softirq.h"
+#include "spinlock.h"
+#include "thread.h"
+#include "mm/frame.h"
+#include "mm/kmalloc.h"
+#include "mm/memstat.h"
+#include "mm/vm.h"
+#include <stdbool.h>
+#include <stddef.h>
 
 #define BUFFER_LEN 256
-char cmd[BUFFER_LEN];
+// How long each thread of the SPIN command counts.
+#define SPIN_NS 500000000ull
+
+typedef struct spin_result_t {
+  uint32_t loops;
+  // Where it finished.
+  uint32_t cpu;
+  bool done;
+} spin_result_t;
+
+// The line being typed. Commands run on a copy, so they may sleep.
+static char cmd[BUFFER_LEN];
+static spinlock_t cmd_lock = SPINLOCK_INIT("console");
+static spin_result_t spin_results[SMP_MAX_CPUS];
 
 void backspace() {
   int offset = get_cursor() - 2;
@@ -18,11 +57,132 @@ void backspace() {
   kprintf(" ");
 }
 
-static void parse_cmd() {
-  if (strcmp(cmd, "")) {
+static void fsck_command(bool repair) {
+  file_system_t *file_system = file_system_get();
+  if (file_system == NULL) {
+    kprintf("No file system mounted\n");
+    return;
+  }
+
+  fat_fsck_t result;
+  // Nothing may change the volume under the check.
+  file_lock();
+  bool clean = fat_fsck(&file_system->fat, repair, &result);
+  file_unlock();
+  kprintf("clusters: %u used, %u free, %u bad\n", result.clusters_used, result.clusters_free, result.clusters_bad);
+  kprintf("free space: %u extents, largest %u clusters\n", result.free_extents, result.largest_free_extent);
+  kprintf("%u files, %u directories\n", result.files, result.directories);
+  kprintf("invalid links: %u, cross-links: %u, size mismatches: %u, FAT mismatches: %u\n", result.invalid_links,
+          result.cross_links, result.size_mismatches, result.fat_mismatches);
+  kprintf("lost: %u clusters in %u chains\n", result.lost_clusters, result.lost_chains);
+  if (repair) {
+    kprintf("repaired: %u\n", result.repaired);
+  }
+
+  uint32_t ms = result.ticks * 1000 / TIMER_FREQ;
+  uint32_t kib = result.bytes_read / 1024;
+  kprintf("read %u KiB in %u ms", kib, ms);
+  if (ms > 0) {
+    kprintf(", %u KiB/s", result.bytes_read / ms * 1000 / 1024);
+  }
+  kprintf("\n%s\n", clean ? "clean" : "errors found");
+}
+
+// Count for SPIN_NS on any CPU. Touches nothing shared, so it is safe to run
+// beside the threads of the boot CPU.
+static void spin(void *data) {
+  spin_result_t *result = data;
+  uint64_t end = timer_ns() + SPIN_NS;
+  uint32_t loops = 0;
+  while (timer_ns() < end) {
+    loops++;
+  }
+  result->loops = loops;
+  result->cpu = cpu_id();
+  __atomic_store_n(&result->done, true, __ATOMIC_RELEASE);
+}
+
+// A thread per CPU, which count as far as each gets. With the load spread
+// they all get about as far.
+static void spin_command(void) {
+  uint32_t n = smp_cpus();
+  for (uint32_t i = 0; i < n; i++) {
+    spin_results[i] = (spin_result_t){0};
+    if (thread_create("spin", THREAD_PRIORITY_LOW, THREAD_ANY_CPU, spin, &spin_results[i]) == NULL) {
+      n = i;
+      break;
+    }
+  }
+  thread_sleep(SPIN_NS + SPIN_NS / 4);
+  for (uint32_t i = 0; i < n; i++) {
+    spin_result_t *result = &spin_results[i];
+    if (__atomic_load_n(&result->done, __ATOMIC_ACQUIRE)) {
+      kprintf("spin %u: %u loops, finished on cpu %u\n", i, result->loops, result->cpu);
+    } else {
+      kprintf("spin %u: not finished\n", i);
+    }
+  }
+}
+
+static void parse_cmd(char *line) {
+  if (strcmp(line, "")) {
     // do nothing
-  } else if (strcmp(cmd, "HELLO")) {
+  } else if (strcmp(line, "HELLO")) {
     kprintf("WORLD\n");
+  } else if (strcmp(line, "MEMORY")) {
+    memory_map_dump();
+    frame_dump();
+  } else if (strcmp(line, "PAGING")) {
+    paging_dump(paging_kernel_directory());
+    memtype_dump();
+  } else if (strcmp(line, "VM")) {
+    vm_dump();
+    page_cache_dump();
+  } else if (strcmp(line, "SCREEN")) {
+    screen_benchmark();
+  } else if (strcmp(line, "APIC")) {
+    acpi_dump();
+    apic_dump();
+  } else if (strcmp(line, "CPUS")) {
+    smp_dump();
+  } else if (strcmp(line, "SPIN")) {
+    spin_command();
+  } else if (strcmp(line, "THREADS")) {
+    thread_dump();
+  } else if (strcmp(line, "TIMERS")) {
+    hrtimer_dump();
+  } else if (strcmp(line, "IRQSTAT")) {
+    interrupt_stats_dump(kprintf);
+    softirq_dump();
+  } else if (strcmp(line, "IRQSTAT HIST")) {
+    interrupt_histograms_dump(serial_printf);
+    kprintf("written to serial\n");
+  } else if (strcmp(line, "IRQSTAT RESET")) {
+    interrupt_stats_reset();
+  } else if (strcmp(line, "LOCKSTAT")) {
+    lockstat_dump();
+  } else if (strcmp(line, "LOCKSTAT RESET")) {
+    lockstat_reset();
+  } else if (strcmp(line, "BLOCKS")) {
+    block_dump();
+  } else if (strcmp(line, "INPUT")) {
+    keyboard_dump();
+    serial_dump();
+  } else if (strcmp(line, "FPU")) {
+    fpu_dump();
+  } else if (strcmp(line, "MEMSTAT")) {
+    memstat_dump(kprintf);
+    memstat_dump(serial_printf);
+  } else if (strcmp(line, "MEMSTAT LEAKS")) {
+    // Too long for the screen.
+    memstat_leaks(MEMTAG_NONE, serial_printf);
+    kprintf("written to serial\n");
+  } else if (strcmp(line, "SLAB")) {
+    kmalloc_dump();
+  } else if (strcmp(line, "FSCK")) {
+    fsck_command(false);
+  } else if (strcmp(line, "FSCK REPAIR")) {
+    fsck_command(true);
   } else {
     kprintf("Command not found\n");
   }
@@ -32,13 +192,28 @@ void prompt(unsigned char scancode, char ascii) {
   if (scancode == BACKSPACE) {
     backspace();
   } else if (scancode == ENTER) {
-    kprintf("\n");
-    parse_cmd();
+    char line[BUFFER_LEN];
+    uint32_t flags = spin_lock_irqsave(&cmd_lock);
+    memmove(line, cmd, BUFFER_LEN);
     memory_set((unsigned char *)cmd, 0, BUFFER_LEN);
+    spin_unlock_irqrestore(&cmd_lock, flags);
+    kprintf("\n");
+    parse_cmd(line);
     kprintf("> ");
   } else {
     char buf[2] = {ascii, 0};
     kprintf(buf);
+    uint32_t flags = spin_lock_irqsave(&cmd_lock);
     strcat(cmd, buf, BUFFER_LEN);
+    spin_unlock_irqrestore(&cmd_lock, flags);
+  }
+}
+
+void console_run(void *data) {
+  (void)data;
+  while (1) {
+    char ascii;
+    unsigned char scancode = keyboard_read(&ascii);
+    prompt(scancode, ascii);
   }
 }
\ No newline at end of file
@@ -2,5 +2,7 @@
 #define SHELL_H
 
 void prompt(unsigned char scancode, char ascii);
+// The shell thread: reads keys and runs the commands typed.
+void console_run(void *data);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include "hrtimer.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/timer.h"
+#include "kernel/kprintf.h"
+#include "kernel/spinlock.h"
+#include <stddef.h>
+
+// Pending timers in a binary min-heap on expiry, so the next one is always at
+// the root and starting or cancelling a timer is O(log n). Any CPU may start
+// them and the interrupt of the CPU that programmed the next expiry runs them.
+static spinlock_t lock = SPINLOCK_INIT("hrtimer");
+static hrtimer_t *queue[HRTIMER_MAX];
+static uint32_t n_queued;
+// Expiry the hardware was last asked to interrupt for.
+static uint64_t programmed = UINT64_MAX;
+// Passes running callbacks, which reprogram once at the end.
+static uint32_t running;
+// The timer whose callback each CPU is running, which its owner may not reuse
+// until the callback returns.
+static hrtimer_t *running_timers[SMP_MAX_CPUS];
+static hrtimer_stats_t stats;
+
+static void place(uint32_t i, hrtimer_t *timer) {
+  queue[i] = timer;
+  timer->slot = i + 1;
+}
+
+static void sift_up(uint32_t i) {
+  hrtimer_t *timer = queue[i];
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (queue[parent]->expires <= timer->expires) {
+      break;
+    }
+    place(i, queue[parent]);
+    i = parent;
+  }
+  place(i, timer);
+}
+
+static void sift_down(uint32_t i) {
+  hrtimer_t *timer = queue[i];
+  while (1) {
+    uint32_t child = 2 * i + 1;
+    if (child >= n_queued) {
+      break;
+    }
+    if (child + 1 < n_queued && queue[child + 1]->expires < queue[child]->expires) {
+      child++;
+    }
+    if (timer->expires <= queue[child]->expires) {
+      break;
+    }
+    place(i, queue[child]);
+    i = child;
+  }
+  place(i, timer);
+}
+
+static void dequeue(hrtimer_t *timer) {
+  uint32_t i = timer->slot - 1;
+  timer->slot = 0;
+  n_queued--;
+  if (i == n_queued) {
+    return;
+  }
+  place(i, queue[n_queued]);
+  sift_up(i);
+  sift_down(queue[i]->slot - 1);
+}
+
+// Have the hardware interrupt at the earliest expiry, if that changed.
+static void program(void) {
+  uint64_t next = n_queued > 0 ? queue[0]->expires : UINT64_MAX;
+  if (running || next == programmed) {
+    return;
+  }
+  programmed = next;
+  timer_program(next);
+}
+
+void hrtimer_init(hrtimer_t *timer, hrtimer_callback_t callback, void *data) {
+  timer->expires = 0;
+  timer->callback = callback;
+  timer->data = data;
+  timer->slot = 0;
+}
+
+bool hrtimer_start(hrtimer_t *timer, uint64_t expires) {
+  uint32_t flags = spin_lock_irqsave(&lock);
+  if (timer->slot != 0) {
+    dequeue(timer);
+  } else if (n_queued == HRTIMER_MAX) {
+    spin_unlock_irqrestore(&lock, flags);
+    return false;
+  }
+  timer->expires = expires;
+  queue[n_queued++] = timer;
+  sift_up(n_queued - 1);
+  stats.started++;
+  program();
+  spin_unlock_irqrestore(&lock, flags);
+  return true;
+}
+
+// Whether another CPU is running the callback of `timer`. A callback may
+// cancel its own timer, which must not wait for itself.
+static bool running_elsewhere(const hrtimer_t *timer) {
+  for (uint32_t id = 0; id < smp_cpus(); id++) {
+    if (id != cpu_id() && running_timers[id] == timer) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool hrtimer_cancel(hrtimer_t *timer) {
+  uint32_t flags = spin_lock_irqsave(&lock);
+  bool pending = timer->slot != 0;
+  if (pending) {
+    dequeue(timer);
+    stats.cancelled++;
+    program();
+  }
+  while (running_elsewhere(timer)) {
+    spin_unlock(&lock);
+    cpu_relax();
+    spin_lock(&lock);
+  }
+  spin_unlock_irqrestore(&lock, flags);
+  return pending;
+}
+
+bool hrtimer_pending(const hrtimer_t *timer) { return timer->slot != 0; }
+
+void hrtimer_run(void) {
+  spin_lock(&lock);
+  stats.interrupts++;
+  running++;
+  uint64_t now = timer_ns();
+  while (n_queued > 0 && queue[0]->expires <= now) {
+    hrtimer_t *timer = queue[0];
+    dequeue(timer);
+    uint64_t late = now - timer->expires;
+    if (late > stats.max_late_ns) {
+      stats.max_late_ns = late > UINT32_MAX ? UINT32_MAX : late;
+    }
+    stats.fired++;
+    // Callbacks start and cancel timers themselves. The timer is not
+    // touched after its callback, which may have let the owner free it.
+    running_timers[cpu_id()] = timer;
+    spin_unlock(&lock);
+    timer->callback(timer);
+    spin_lock(&lock);
+    running_timers[cpu_id()] = NULL;
+  }
+  running--;
+  // The event that got us here is used up.
+  programmed = UINT64_MAX;
+  program();
+  spin_unlock(&lock);
+}
+
+const hrtimer_stats_t *hrtimer_stats(void) { return &stats; }
+
+void hrtimer_dump(void) {
+  kprintf("timers: %u pending, %u started, %u fired, %u cancelled\n", n_queued, stats.started, stats.fired,
+          stats.cancelled);
+  kprintf("%u interrupts from the %s timer, fired up to %u us late\n", stats.interrupts, timer_source(),
+          stats.max_late_ns / 1000);
+}
@@ -0,0 +1,53 @@
+#ifndef KERNEL_HRTIMER_H
+#define KERNEL_HRTIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Most timers pending at once.
+#define HRTIMER_MAX 256
+
+typedef struct hrtimer_t hrtimer_t;
+// Runs from the timer interrupt with interrupts disabled. May start timers,
+// the one that fired included.
+typedef void (*hrtimer_callback_t)(hrtimer_t *timer);
+
+// A one-shot timer, owned by the caller. All zero is a valid idle timer.
+struct hrtimer_t {
+  // When to fire, in timer_ns() time.
+  uint64_t expires;
+  hrtimer_callback_t callback;
+  void *data;
+  // 1 + position in the queue, 0 when not pending.
+  uint32_t slot;
+};
+
+typedef struct hrtimer_stats_t {
+  uint32_t started;
+  uint32_t fired;
+  uint32_t cancelled;
+  // Timer interrupts, including the ones for timers that were too far away
+  // to program in one go.
+  uint32_t interrupts;
+  // Most nanoseconds a timer fired after its expiry.
+  uint32_t max_late_ns;
+} hrtimer_stats_t;
+
+void hrtimer_init(hrtimer_t *timer, hrtimer_callback_t callback, void *data);
+// Fire `timer` at `expires`, or on the next interrupt if that has passed. A
+// pending timer is moved. Fails if HRTIMER_MAX timers are pending.
+bool hrtimer_start(hrtimer_t *timer, uint64_t expires);
+// Returns whether the timer was pending. Waits for a callback of the timer
+// running on another CPU, so the timer may be reused or freed afterwards.
+bool hrtimer_cancel(hrtimer_t *timer);
+// Whether the timer is queued. It is not while its callback runs, so the
+// owner has to hrtimer_cancel() before reusing it.
+bool hrtimer_pending(const hrtimer_t *timer);
+// Fire the expired timers and have the hardware interrupt at the next
+// expiry. Called from the timer interrupt.
+void hrtimer_run(void);
+
+const hrtimer_stats_t *hrtimer_stats(void);
+void hrtimer_dump(void);
+
+#endif
@@ -1,21 +1,93 @@
+#include "arch/x86/acpi.h"
+#include "arch/x86/alternative.h"
+#include "arch/x86/apic.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/fpu.h"
 #include "arch/x86/isr.h"
+#include "arch/x86/memtype.h"
+#include "arch/x86/memory_map.h"
+#include "arch/x86/multiboot.h"
+#include "arch/x86/paging.h"
+#include "arch/x86/smp.h"
 #include "arch/x86/timer.h"
 #include "devices/ata.h"
+#include "devices/block.h"
+#include "devices/cache.h"
 #include "drivers/keyboard.h"
 #include "drivers/screen.h"
 #include "drivers/serial.h"
+#include "fs/file.h"
+#include "fs/page_cache.h"
+#include "kernel/console.h"
+#include "kernel/kprintf.h"
+#include "kernel/thread.h"
+#include "libc/mem.h"
+#include "mm/frame.h"
+#include "mm/kmalloc.h"
+#include "mm/slab.h"
+#include "mm/vm.h"
+#include <stddef.h>
 
-void kernel_main() {
+// How often the flush thread writes dirty buffers back.
+#define FLUSH_INTERVAL_NS 5000000000ull
+
+static void probe_disks(void *data) {
+  (void)data;
+  ata_init();
+}
+
+static void flush_buffers(void *data) {
+  (void)data;
+  while (1) {
+    thread_sleep(FLUSH_INTERVAL_NS);
+    cache_flush();
+  }
+}
+
+// `info` is the physical address of the multiboot information.
+void kernel_main(uint32_t magic, uint32_t info) {
+  smp_early_init();
   isr_install();
   asm volatile("sti");
   serial_init();
-  clear_screen();
+  cpu_features_init();
+  fpu_init();
+  alternatives_apply();
+#ifdef DEBUG
+  if (!mem_selftest()) {
+    kprintf("mem: self test failed\n");
+  }
+#endif
+  memory_map_init(magic, P2V(info));
+  paging_init();
+  memtype_init();
+  frame_init();
+  slab_init();
+  kmalloc_init();
+  vm_init();
+  block_init();
+  cache_init();
+  file_init();
+  page_cache_init();
+  screen_init();
+  if (acpi_init()) {
+    apic_init();
+  }
   init_keyboard();
   timer_init();
-  ata_init();
+  smp_init();
+  sched_init();
+  // The drivers, file systems and allocators only keep out the local CPU, so
+  // the threads that use them stay on this one.
+  thread_create("console", THREAD_PRIORITY_HIGH, THREAD_CPU(0), console_run, NULL);
+  thread_create("ata", THREAD_PRIORITY_NORMAL, THREAD_CPU(0), probe_disks, NULL);
+  thread_create("flush", THREAD_PRIORITY_LOW, THREAD_CPU(0), flush_buffers, NULL);
 
+  // This is the idle thread now. Prepare zeroed frames while there is nothing
+  // else to do.
   while (1) {
-    // timer_msleep(100);
-    // kprint("Hello\n");
+    if (!frame_zero_idle()) {
+      asm volatile("hlt");
+    }
   }
 }
\ No newline at end of file
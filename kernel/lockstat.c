@@ -0,0 +1,72 @@
+#include "lockstat.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/timer.h"
+#include "kprintf.h"
+#include "libc/mem.h"
+
+// The classes with a lock taken since boot, newest first. Only ever pushed to.
+static lockstat_t *classes;
+
+uint64_t lockstat_now(void) { return timer_ns(); }
+
+void lockstat_acquired(lockstat_t *class, uint64_t started, bool contended) {
+  if (class == NULL) {
+    return;
+  }
+  if (!__atomic_exchange_n(&class->listed, true, __ATOMIC_ACQ_REL)) {
+    class->next = __atomic_load_n(&classes, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&classes, &class->next, class, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+  // An interrupt taking a lock of the same class in between may lose its
+  // counts, which is fine for statistics.
+  lockstat_cpu_t *stat = &class->cpus[cpu_id()];
+  stat->acquired++;
+  stat->contended += contended;
+  stat->wait_ns += lockstat_now() - started;
+}
+
+void lockstat_released(lockstat_t *class, uint64_t held_since) {
+  if (class == NULL) {
+    return;
+  }
+  uint64_t held = lockstat_now() - held_since;
+  lockstat_cpu_t *stat = &class->cpus[cpu_id()];
+  stat->hold_ns += held;
+  if (held > stat->max_hold_ns) {
+    stat->max_hold_ns = held;
+  }
+}
+
+void lockstat_dump(void) {
+#ifndef LOCK_STAT
+  kprintf("lock statistics need a build with LOCK_STAT=1\n");
+#else
+  for (lockstat_t *class = __atomic_load_n(&classes, __ATOMIC_ACQUIRE); class != NULL; class = class->next) {
+    lockstat_cpu_t total = {0};
+    for (uint32_t id = 0; id < smp_cpus(); id++) {
+      const lockstat_cpu_t *stat = &class->cpus[id];
+      total.acquired += stat->acquired;
+      total.contended += stat->contended;
+      total.wait_ns += stat->wait_ns;
+      total.hold_ns += stat->hold_ns;
+      if (stat->max_hold_ns > total.max_hold_ns) {
+        total.max_hold_ns = stat->max_hold_ns;
+      }
+    }
+    if (total.acquired == 0) {
+      continue;
+    }
+    kprintf("%s: %u acquired, %u contended, %u ns wait and %u ns hold on average, %u ns longest hold\n", class->name,
+            total.acquired, total.contended, (uint32_t)div64(total.wait_ns, total.acquired),
+            (uint32_t)div64(total.hold_ns, total.acquired),
+            total.max_hold_ns > UINT32_MAX ? UINT32_MAX : (uint32_t)total.max_hold_ns);
+  }
+#endif
+}
+
+void lockstat_reset(void) {
+  for (lockstat_t *class = __atomic_load_n(&classes, __ATOMIC_ACQUIRE); class != NULL; class = class->next) {
+    memory_set((unsigned char *)class->cpus, 0, sizeof(class->cpus));
+  }
+}
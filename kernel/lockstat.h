@@ -0,0 +1,52 @@
+#ifndef KERNEL_LOCKSTAT_H
+#define KERNEL_LOCKSTAT_H
+
+#include "arch/x86/smp.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// What LOCK_STAT builds count for a lock class on one CPU. Only that CPU
+// writes them, after taking a lock of the class, so they need no atomics.
+typedef struct lockstat_cpu_t {
+  uint32_t acquired;
+  // Acquisitions that found the lock taken.
+  uint32_t contended;
+  uint64_t wait_ns;
+  uint64_t hold_ns;
+  uint64_t max_hold_ns;
+} lockstat_cpu_t;
+
+// The locks initialised at one place share a class, like all the thread
+// locks. Classes join the list the first time one of their locks is taken.
+typedef struct lockstat_t {
+  const char *name;
+  bool listed;
+  struct lockstat_t *next;
+  lockstat_cpu_t cpus[SMP_MAX_CPUS];
+} lockstat_t;
+
+#define LOCKSTAT_INIT(class_name) {.name = (class_name)}
+
+#ifdef LOCK_STAT
+// A class of its own for the place this is written at.
+#define LOCKSTAT_CLASS(class_name)                                                                                     \
+  ({                                                                                                                   \
+    static lockstat_t class_ = LOCKSTAT_INIT(class_name);                                                              \
+    &class_;                                                                                                           \
+  })
+#else
+#define LOCKSTAT_CLASS(class_name) NULL
+#endif
+
+// Timestamps for the locks, in timer_ns() time.
+uint64_t lockstat_now(void);
+// Called by the locks of LOCK_STAT builds. A NULL class is not counted.
+void lockstat_acquired(lockstat_t *class, uint64_t started, bool contended);
+void lockstat_released(lockstat_t *class, uint64_t held_since);
+
+// The classes with acquisitions, summed over the CPUs.
+void lockstat_dump(void);
+void lockstat_reset(void);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef KERNEL_PREEMPT_H
+#define KERNEL_PREEMPT_H
+
+// Keep the running thread on the CPU, for short sections that other threads
+// must not see halfway. Nests. Interrupts still come in. Holding a spinlock
+// counts as well.
+void preempt_disable(void);
+void preempt_enable(void);
+
+#endif
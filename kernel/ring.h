@@ -0,0 +1,73 @@
+#ifndef KERNEL_RING_H
+#define KERNEL_RING_H
+
+#include "arch/x86/cpu.h"
+#include "libc/mem.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// A ring of fixed-size items from one producer, like an interrupt handler, to
+// one consumer, like the thread reading the device. Neither takes a lock or
+// masks interrupts: each only writes its own index and publishes the items
+// with it. Several producers or consumers need a lock among themselves.
+typedef struct ring_t {
+  // Read by both and written by neither after ring_init().
+  uint8_t *items;
+  uint32_t item_size;
+  // Items it holds minus 1, the capacity is a power of two.
+  uint32_t mask;
+  // Written by the producer. Counts up, the slot is `head & mask`.
+  uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+  // Items the producer had no room for.
+  uint32_t overflows;
+  // Most items there were at once.
+  uint32_t peak;
+  // Written by the consumer.
+  uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+} ring_t;
+
+// `items` holds `capacity` items of `item_size` bytes, a power of two of them.
+static inline void ring_init(ring_t *ring, void *items, uint32_t item_size, uint32_t capacity) {
+  ring->items = items;
+  ring->item_size = item_size;
+  ring->mask = capacity - 1;
+  ring->head = 0;
+  ring->overflows = 0;
+  ring->peak = 0;
+  ring->tail = 0;
+}
+
+// Producer only. Returns false and counts an overflow if the ring is full.
+static inline bool ring_put(ring_t *ring, const void *item) {
+  uint32_t head = ring->head;
+  uint32_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (used > ring->mask) {
+    ring->overflows++;
+    return false;
+  }
+  memmove(ring->items + (head & ring->mask) * ring->item_size, item, ring->item_size);
+  // The item is written before the consumer can see the new head.
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  if (used + 1 > ring->peak) {
+    ring->peak = used + 1;
+  }
+  return true;
+}
+
+// Consumer only. Returns false if the ring is empty.
+static inline bool ring_get(ring_t *ring, void *item) {
+  uint32_t tail = ring->tail;
+  if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  memmove(item, ring->items + (tail & ring->mask) * ring->item_size, ring->item_size);
+  // The slot is read before the producer can reuse it.
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+static inline bool ring_empty(const ring_t *ring) {
+  return __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+#endif
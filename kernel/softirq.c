@@ -0,0 +1,64 @@
+#include "softirq.h"
+#include "arch/x86/cpu.h"
+#include "kernel/kprintf.h"
+#include "kernel/thread.h"
+#include <stddef.h>
+
+// Scheduled tasklets, oldest first.
+static tasklet_t *head;
+static tasklet_t **tail = &head;
+// Set during a pass, so interrupts that come in meanwhile leave their
+// tasklets to it instead of nesting.
+static bool running;
+static softirq_stats_t stats;
+
+void tasklet_init(tasklet_t *tasklet, tasklet_func_t func, void *data) {
+  tasklet->func = func;
+  tasklet->data = data;
+  tasklet->next = NULL;
+  tasklet->scheduled = false;
+}
+
+bool tasklet_schedule(tasklet_t *tasklet) {
+  uint32_t flags = interrupts_save();
+  bool queued = !tasklet->scheduled;
+  if (queued) {
+    tasklet->scheduled = true;
+    tasklet->next = NULL;
+    *tail = tasklet;
+    tail = &tasklet->next;
+    stats.scheduled++;
+  }
+  interrupts_restore(flags);
+  return queued;
+}
+
+void softirq_run(void) {
+  if (running || head == NULL) {
+    return;
+  }
+  running = true;
+  // The pass belongs to no thread, it finishes before anything else runs.
+  preempt_disable();
+  stats.passes++;
+  while (head != NULL) {
+    tasklet_t *tasklet = head;
+    head = tasklet->next;
+    if (head == NULL) {
+      tail = &head;
+    }
+    tasklet->scheduled = false;
+    stats.run++;
+    interrupts_enable();
+    tasklet->func(tasklet);
+    interrupts_disable();
+  }
+  preempt_enable();
+  running = false;
+}
+
+const softirq_stats_t *softirq_stats(void) { return &stats; }
+
+void softirq_dump(void) {
+  kprintf("tasklets: %u scheduled, %u run in %u passes\n", stats.scheduled, stats.run, stats.passes);
+}
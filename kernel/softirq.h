@@ -0,0 +1,42 @@
+#ifndef KERNEL_SOFTIRQ_H
+#define KERNEL_SOFTIRQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct tasklet_t tasklet_t;
+// Runs in softirq context: after the hard interrupt handler, with the EOI sent
+// and interrupts enabled, so it can take its time without holding up the
+// timer or the disks. Must not wait for another tasklet, which would only run
+// once it returns.
+typedef void (*tasklet_func_t)(tasklet_t *tasklet);
+
+// Deferred work, owned by the caller. Interrupt handlers do the minimum with
+// the device and schedule a tasklet for the rest.
+struct tasklet_t {
+  tasklet_func_t func;
+  void *data;
+  tasklet_t *next;
+  bool scheduled;
+};
+
+typedef struct softirq_stats_t {
+  uint32_t scheduled;
+  uint32_t run;
+  // Passes over the queue, each started by an interrupt exit.
+  uint32_t passes;
+} softirq_stats_t;
+
+void tasklet_init(tasklet_t *tasklet, tasklet_func_t func, void *data);
+// Queue `tasklet` to run once. Scheduling it again before it starts does
+// nothing and returns false; from its own function it queues it again.
+bool tasklet_schedule(tasklet_t *tasklet);
+// Run the scheduled tasklets, in order, until none are left. Called on
+// interrupt exit with interrupts disabled, returns with them disabled. Does
+// nothing when it interrupted a pass already running.
+void softirq_run(void);
+
+const softirq_stats_t *softirq_stats(void);
+void softirq_dump(void);
+
+#endif
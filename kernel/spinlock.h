@@ -0,0 +1,185 @@
+#ifndef KERNEL_SPINLOCK_H
+#define KERNEL_SPINLOCK_H
+
+#include "arch/x86/cpu.h"
+#include "lockstat.h"
+#include "preempt.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// A ticket lock: CPUs get the lock in the order they asked for it, so none
+// waits forever while others keep taking it. Keeps out the other CPUs, not
+// the interrupts of this one: use the irqsave variants if an interrupt
+// handler takes it too. The holder is not preempted, or a higher priority
+// thread on its CPU could spin on it forever. Never sleep holding one.
+typedef struct spinlock_t {
+  // The ticket being served. Only the holder changes it, when it unlocks.
+  uint16_t owner;
+  // The ticket the next CPU to ask gets.
+  uint16_t next;
+#ifdef LOCK_STAT
+  lockstat_t *class;
+  uint64_t held_since;
+#endif
+} spinlock_t;
+
+// For locks at file scope, where the compound literal is static. `name` names
+// the class in the LOCKSTAT dump.
+#ifdef LOCK_STAT
+#define SPINLOCK_INIT(name) {.class = &(lockstat_t)LOCKSTAT_INIT(name)}
+#else
+#define SPINLOCK_INIT(name) {0}
+#endif
+
+// The locks initialised at the same place share the class `name`.
+#define spin_init(lock, name) spin_init_class((lock), LOCKSTAT_CLASS(name))
+
+static inline void spin_init_class(spinlock_t *lock, lockstat_t *class) {
+  lock->owner = 0;
+  lock->next = 0;
+#ifdef LOCK_STAT
+  lock->class = class;
+#else
+  (void)class;
+#endif
+}
+
+// Take and release the lock without touching the preemption count.
+static inline void spin_acquire(spinlock_t *lock) {
+#ifdef LOCK_STAT
+  uint64_t started = lockstat_now();
+#endif
+  uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+  bool contended = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket;
+  if (contended) {
+    // Plain reads, so the waiters share the cache line until it is written.
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+      cpu_relax();
+    }
+  }
+#ifdef LOCK_STAT
+  lock->held_since = lockstat_now();
+  lockstat_acquired(lock->class, started, contended);
+#endif
+}
+
+static inline void spin_release(spinlock_t *lock) {
+#ifdef LOCK_STAT
+  lockstat_released(lock->class, lock->held_since);
+#endif
+  __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+  preempt_disable();
+  spin_acquire(lock);
+}
+
+// Take the lock only if nobody holds or waits for it.
+static inline bool spin_trylock(spinlock_t *lock) {
+  preempt_disable();
+  uint16_t ticket = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+  // The owner cannot move while the lock is free, so `next` still being
+  // `ticket` means the lock was free and is now ours.
+  if (!__atomic_compare_exchange_n(&lock->next, &ticket, (uint16_t)(ticket + 1), false, __ATOMIC_ACQUIRE,
+                                   __ATOMIC_RELAXED)) {
+    preempt_enable();
+    return false;
+  }
+#ifdef LOCK_STAT
+  lock->held_since = lockstat_now();
+  lockstat_acquired(lock->class, lock->held_since, false);
+#endif
+  return true;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+  spin_release(lock);
+  preempt_enable();
+}
+
+static inline bool spin_is_locked(spinlock_t *lock) {
+  return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) != __atomic_load_n(&lock->next, __ATOMIC_RELAXED);
+}
+
+// Disable interrupts and take the lock, returning the flags for
+// spin_unlock_irqrestore(). Always inlined, like interrupts_save(), so the
+// irqs-off sections are charged to the caller. The unlocks enable preemption
+// after interrupts, so a thread woken meanwhile runs at once.
+static inline __attribute__((always_inline)) uint32_t spin_lock_irqsave(spinlock_t *lock) {
+  uint32_t flags = interrupts_save();
+  spin_lock(lock);
+  return flags;
+}
+
+static inline __attribute__((always_inline)) void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+  spin_release(lock);
+  interrupts_restore(flags);
+  preempt_enable();
+}
+
+// Any number of readers or one writer. Everyone queues on the ticket lock to
+// get in, so a waiting writer keeps new readers out and is not starved.
+// Readers only hold it while they register, a writer until it unlocks.
+typedef struct rwlock_t {
+  spinlock_t lock;
+  uint32_t readers;
+} rwlock_t;
+
+#define RWLOCK_INIT(name) {.lock = SPINLOCK_INIT(name)}
+
+#define rwlock_init(rwlock, name) rwlock_init_class((rwlock), LOCKSTAT_CLASS(name))
+
+static inline void rwlock_init_class(rwlock_t *rwlock, lockstat_t *class) {
+  spin_init_class(&rwlock->lock, class);
+  rwlock->readers = 0;
+}
+
+static inline void read_lock(rwlock_t *rwlock) {
+  preempt_disable();
+  spin_acquire(&rwlock->lock);
+  __atomic_fetch_add(&rwlock->readers, 1, __ATOMIC_RELAXED);
+  spin_release(&rwlock->lock);
+}
+
+static inline void read_unlock(rwlock_t *rwlock) {
+  __atomic_fetch_sub(&rwlock->readers, 1, __ATOMIC_RELEASE);
+  preempt_enable();
+}
+
+static inline void write_lock(rwlock_t *rwlock) {
+  spin_lock(&rwlock->lock);
+  while (__atomic_load_n(&rwlock->readers, __ATOMIC_ACQUIRE) != 0) {
+    cpu_relax();
+  }
+}
+
+static inline void write_unlock(rwlock_t *rwlock) { spin_unlock(&rwlock->lock); }
+
+// A reader interrupted by a handler that queues behind a waiting writer would
+// never finish, so everyone uses these if a handler takes the lock.
+static inline __attribute__((always_inline)) uint32_t read_lock_irqsave(rwlock_t *rwlock) {
+  uint32_t flags = interrupts_save();
+  read_lock(rwlock);
+  return flags;
+}
+
+static inline __attribute__((always_inline)) void read_unlock_irqrestore(rwlock_t *rwlock, uint32_t flags) {
+  __atomic_fetch_sub(&rwlock->readers, 1, __ATOMIC_RELEASE);
+  interrupts_restore(flags);
+  preempt_enable();
+}
+
+static inline __attribute__((always_inline)) uint32_t write_lock_irqsave(rwlock_t *rwlock) {
+  uint32_t flags = interrupts_save();
+  write_lock(rwlock);
+  return flags;
+}
+
+static inline __attribute__((always_inline)) void write_unlock_irqrestore(rwlock_t *rwlock, uint32_t flags) {
+  spin_release(&rwlock->lock);
+  interrupts_restore(flags);
+  preempt_enable();
+}
+
+#endif
@@ -0,0 +1,532 @@
+#include "thread.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/timer.h"
+#include "hrtimer.h"
+#include "kernel/kprintf.h"
+#include "mm/kmalloc.h"
+#include <stddef.h>
+
+// At the bottom of every stack, checked on switches to catch overflows.
+#define STACK_MAGIC 0x5ac0ffee
+
+// In switch.asm.
+void switch_stack(uint32_t *save, uint32_t esp);
+
+typedef struct run_queue_t {
+  thread_t *head;
+  thread_t *tail;
+} run_queue_t;
+
+// What the scheduler keeps for each CPU. Only that CPU changes it, except for
+// the queues, which other CPUs add to on wake-ups and take from when they run
+// out of work, under `lock`. The running thread and whether to switch are in
+// its percpu_t.
+typedef struct cpu_sched_t {
+  spinlock_t lock;
+  // Runnable threads by priority, the idle thread is never queued.
+  run_queue_t queues[THREAD_PRIORITIES];
+  uint32_t queued;
+  // The code this CPU started in, which becomes its idle thread.
+  thread_t idle;
+  // Priority of the running thread, for the CPUs that wake one up.
+  thread_priority_t priority;
+  // The thread switched away from, which the one switched to finishes off.
+  thread_t *previous;
+  // Ends the slice of the running thread.
+  hrtimer_t slice_timer;
+  // When the running thread got the CPU, in timer_ns() time.
+  uint64_t switched_in;
+  uint32_t switches;
+  uint32_t steals;
+  uint32_t stolen;
+} cpu_sched_t;
+
+static cpu_sched_t scheds[SMP_MAX_CPUS];
+// Guards the list of all threads, the ids and the dead threads.
+static spinlock_t threads_lock = SPINLOCK_INIT("threads");
+static thread_t *all;
+// Exited threads the boot CPU frees, the allocators only keep out the local
+// CPU.
+static thread_t *dead;
+static uint32_t next_id;
+
+static const char *state_names[] = {
+    [THREAD_RUNNING] = "running",
+    [THREAD_RUNNABLE] = "runnable",
+    [THREAD_BLOCKED] = "blocked",
+    [THREAD_DEAD] = "dead",
+};
+
+static thread_t *current(void) { return (thread_t *)this_cpu_read(thread); }
+
+static bool allowed(const thread_t *thread, uint32_t cpu) { return thread->affinity & THREAD_CPU(cpu); }
+
+static bool is_idle(uint32_t cpu) { return smp_cpu(cpu)->thread == &scheds[cpu].idle; }
+
+// Called with the queue locked.
+static void enqueue(cpu_sched_t *sched, thread_t *thread) {
+  run_queue_t *queue = &sched->queues[thread->priority];
+  thread->next = NULL;
+  if (queue->tail == NULL) {
+    queue->head = thread;
+  } else {
+    queue->tail->next = thread;
+  }
+  queue->tail = thread;
+  sched->queued++;
+}
+
+// Called with the queue locked.
+static void unlink(cpu_sched_t *sched, run_queue_t *queue, thread_t *before, thread_t *thread) {
+  if (before == NULL) {
+    queue->head = thread->next;
+  } else {
+    before->next = thread->next;
+  }
+  if (queue->tail == thread) {
+    queue->tail = before;
+  }
+  sched->queued--;
+}
+
+// The first thread of the highest priority, NULL if there is none. Called with
+// the queue locked.
+static thread_t *pick(cpu_sched_t *sched) {
+  for (int priority = THREAD_PRIORITIES - 1; priority > THREAD_PRIORITY_IDLE; priority--) {
+    run_queue_t *queue = &sched->queues[priority];
+    if (queue->head != NULL) {
+      thread_t *thread = queue->head;
+      unlink(sched, queue, NULL, thread);
+      return thread;
+    }
+  }
+  return NULL;
+}
+
+// A thread of the highest priority `thief` may run, one whose cache went cold
+// if there is one. Called with the queue locked.
+static thread_t *take(cpu_sched_t *sched, uint32_t thief, uint64_t now) {
+  for (int priority = THREAD_PRIORITIES - 1; priority > THREAD_PRIORITY_IDLE; priority--) {
+    run_queue_t *queue = &sched->queues[priority];
+    thread_t *hot = NULL;
+    thread_t *hot_before = NULL;
+    thread_t *before = NULL;
+    for (thread_t *thread = queue->head; thread != NULL; before = thread, thread = thread->next) {
+      // Queued again on its way off the CPU, whose stack it is still on.
+      if (!allowed(thread, thief) || __atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE)) {
+        continue;
+      }
+      if (now - thread->last_ran >= THREAD_CACHE_HOT_NS) {
+        unlink(sched, queue, before, thread);
+        return thread;
+      }
+      if (hot == NULL) {
+        hot = thread;
+        hot_before = before;
+      }
+    }
+    if (hot != NULL) {
+      unlink(sched, queue, hot_before, hot);
+      return hot;
+    }
+  }
+  return NULL;
+}
+
+// Out of work: take a thread from the CPU with the most queued.
+static thread_t *steal(uint32_t cpu, uint64_t now) {
+  cpu_sched_t *victim = NULL;
+  uint32_t most = 0;
+  for (uint32_t i = 0; i < smp_cpus(); i++) {
+    uint32_t queued = __atomic_load_n(&scheds[i].queued, __ATOMIC_RELAXED);
+    if (i != cpu && queued > most) {
+      victim = &scheds[i];
+      most = queued;
+    }
+  }
+  if (victim == NULL) {
+    return NULL;
+  }
+  spin_lock(&victim->lock);
+  thread_t *thread = take(victim, cpu, now);
+  if (thread != NULL) {
+    victim->stolen++;
+    scheds[cpu].steals++;
+  }
+  spin_unlock(&victim->lock);
+  return thread;
+}
+
+// Where a thread that became runnable goes. Its last CPU still has its data
+// cached, so it stays there unless that one is busy and another is idle.
+static uint32_t place(const thread_t *thread) {
+  if (allowed(thread, thread->cpu) && is_idle(thread->cpu)) {
+    return thread->cpu;
+  }
+  uint32_t shortest = thread->cpu;
+  uint32_t fewest = UINT32_MAX;
+  for (uint32_t i = 0; i < smp_cpus(); i++) {
+    if (!allowed(thread, i)) {
+      continue;
+    }
+    if (is_idle(i)) {
+      return i;
+    }
+    if (scheds[i].queued < fewest) {
+      shortest = i;
+      fewest = scheds[i].queued;
+    }
+  }
+  return allowed(thread, thread->cpu) ? thread->cpu : shortest;
+}
+
+// Queue a thread that became runnable and have its CPU switch to it if it
+// beats the running one. Called with interrupts disabled.
+static void activate(thread_t *thread) {
+  uint32_t cpu = place(thread);
+  cpu_sched_t *sched = &scheds[cpu];
+  thread->cpu = cpu;
+  spin_lock(&sched->lock);
+  enqueue(sched, thread);
+  spin_unlock(&sched->lock);
+  if (thread->priority > sched->priority) {
+    smp_reschedule(cpu);
+  }
+}
+
+// Wake an idle CPU that may take a thread waiting here.
+static void kick_idle(uint32_t cpu) {
+  for (uint32_t i = 0; i < smp_cpus(); i++) {
+    if (i != cpu && is_idle(i)) {
+      smp_reschedule(i);
+      return;
+    }
+  }
+}
+
+static void slice_expired(hrtimer_t *timer) { smp_reschedule((uint32_t)timer->data); }
+
+// Free the threads that exited. On the boot CPU, with interrupts disabled.
+static void reap(void) {
+  spin_lock(&threads_lock);
+  thread_t *list = dead;
+  dead = NULL;
+  spin_unlock(&threads_lock);
+  while (list != NULL) {
+    thread_t *thread = list;
+    list = thread->next;
+    kfree(thread->stack, MEMTAG_THREAD);
+    kfree(thread, MEMTAG_THREAD);
+  }
+}
+
+// Let the thread switched away from go. Runs on the new stack, since the old
+// one may be freed or run by another CPU as soon as that is done.
+static void finish_switch(void) {
+  uint32_t cpu = cpu_id();
+  thread_t *thread = scheds[cpu].previous;
+  if (thread->state == THREAD_DEAD) {
+    fpu_state_release(&thread->fpu);
+    spin_lock(&threads_lock);
+    thread->next = dead;
+    dead = thread;
+    spin_unlock(&threads_lock);
+  } else {
+    __atomic_store_n(&thread->on_cpu, false, __ATOMIC_RELEASE);
+  }
+  if (cpu == 0 && dead != NULL) {
+    reap();
+  }
+}
+
+// Give the CPU to the best runnable thread, which may be the running one.
+// Called with interrupts disabled and preemption enabled.
+static void schedule(void) {
+  percpu_t *cpu = this_cpu();
+  cpu_sched_t *sched = &scheds[cpu->id];
+  cpu->need_resched = 0;
+  thread_t *prev = cpu->thread;
+  uint64_t now = timer_ns();
+  spin_lock(&sched->lock);
+  if (prev->state == THREAD_RUNNING) {
+    prev->state = THREAD_RUNNABLE;
+    if (prev != &sched->idle) {
+      enqueue(sched, prev);
+    }
+  }
+  thread_t *next = pick(sched);
+  uint32_t waiting = sched->queued;
+  spin_unlock(&sched->lock);
+  if (next == NULL) {
+    next = steal(cpu->id, now);
+  }
+  if (next == NULL) {
+    next = &sched->idle;
+  } else if (waiting > 0) {
+    kick_idle(cpu->id);
+  }
+  next->state = THREAD_RUNNING;
+  next->cpu = cpu->id;
+  sched->priority = next->priority;
+  if (next == &sched->idle) {
+    hrtimer_cancel(&sched->slice_timer);
+  } else {
+    hrtimer_start(&sched->slice_timer, now + THREAD_SLICE_NS);
+  }
+  if (next == prev) {
+    return;
+  }
+
+  if (prev->stack != NULL && prev->stack[0] != STACK_MAGIC) {
+    kprintf("thread: %s overran its stack\n", prev->name);
+  }
+  prev->runtime_ns += now - sched->switched_in;
+  prev->last_ran = now;
+  sched->switched_in = now;
+  next->switches++;
+  sched->switches++;
+  // Another CPU may run it next, which cannot get at the registers here.
+  if (prev->affinity != THREAD_CPU(cpu->id)) {
+    fpu_save(&prev->fpu);
+  }
+  fpu_switch(&next->fpu);
+  next->on_cpu = true;
+  sched->previous = prev;
+  cpu->thread = next;
+  switch_stack(&prev->esp, next->esp);
+  // Back, maybe on another CPU.
+  finish_switch();
+}
+
+// Switch now if that is due and allowed.
+static void preempt_check(void) {
+  if (this_cpu_read(need_resched) && this_cpu_read(preempt_count) == 0 && interrupts_enabled()) {
+    uint32_t flags = interrupts_save();
+    schedule();
+    interrupts_restore(flags);
+  }
+}
+
+// Where new threads come out of switch_stack().
+static void thread_start(void) {
+  finish_switch();
+  interrupts_enable();
+  thread_t *thread = current();
+  thread->func(thread->data);
+  thread_exit();
+}
+
+// The running code becomes the idle thread of this CPU.
+static void init_idle(void) {
+  percpu_t *cpu = this_cpu();
+  cpu_sched_t *sched = &scheds[cpu->id];
+  thread_t *idle = &sched->idle;
+  spin_init(&sched->lock, "run queue");
+  spin_init(&idle->lock, "idle thread");
+  ksnprintf(idle->name, sizeof(idle->name), "idle");
+  idle->priority = THREAD_PRIORITY_IDLE;
+  idle->state = THREAD_RUNNING;
+  idle->affinity = THREAD_CPU(cpu->id);
+  idle->cpu = cpu->id;
+  idle->on_cpu = true;
+  fpu_state_init(&idle->fpu);
+  fpu_switch(&idle->fpu);
+  sched->priority = THREAD_PRIORITY_IDLE;
+  hrtimer_init(&sched->slice_timer, slice_expired, (void *)cpu->id);
+  sched->switched_in = timer_ns();
+  spin_lock(&threads_lock);
+  idle->id = next_id++;
+  idle->next_all = all;
+  all = idle;
+  spin_unlock(&threads_lock);
+  cpu->thread = idle;
+}
+
+void sched_init(void) { init_idle(); }
+
+void sched_init_ap(void) { init_idle(); }
+
+thread_t *thread_create(const char *name, thread_priority_t priority, uint32_t affinity, thread_func_t func,
+                        void *data) {
+  thread_t *thread = kzalloc(sizeof(thread_t), MEMTAG_THREAD);
+  // Zeroed, so the dump can tell how deep it got.
+  uint32_t *stack = kzalloc(THREAD_STACK_SIZE, MEMTAG_THREAD);
+  if (thread == NULL || stack == NULL) {
+    kfree(thread, MEMTAG_THREAD);
+    kfree(stack, MEMTAG_THREAD);
+    return NULL;
+  }
+  ksnprintf(thread->name, sizeof(thread->name), "%s", name);
+  thread->priority = priority;
+  thread->affinity = affinity;
+  thread->func = func;
+  thread->data = data;
+  thread->stack = stack;
+  stack[0] = STACK_MAGIC;
+  spin_init(&thread->lock, "thread");
+  fpu_state_init(&thread->fpu);
+
+  // What switch_stack() pops: edi, esi, ebx, ebp and the return address, and
+  // a return address for thread_start(), which never returns.
+  uint32_t *sp = (uint32_t *)((uint8_t *)stack + THREAD_STACK_SIZE);
+  *--sp = 0;
+  *--sp = (uint32_t)thread_start;
+  for (int i = 0; i < 4; i++) {
+    *--sp = 0;
+  }
+  thread->esp = (uint32_t)sp;
+
+  uint32_t flags = interrupts_save();
+  spin_lock(&threads_lock);
+  thread->id = next_id++;
+  thread->next_all = all;
+  all = thread;
+  spin_unlock(&threads_lock);
+  thread->cpu = cpu_id();
+  thread->state = THREAD_RUNNABLE;
+  activate(thread);
+  interrupts_restore(flags);
+  preempt_check();
+  return thread;
+}
+
+thread_t *thread_current(void) { return current(); }
+
+void thread_yield(void) {
+  uint32_t flags = interrupts_save();
+  schedule();
+  interrupts_restore(flags);
+}
+
+void thread_block(void) {
+  thread_t *thread = current();
+  if (this_cpu_read(preempt_count) != 0) {
+    kprintf("thread: %s blocks with preemption disabled\n", thread->name);
+  }
+  spin_lock(&thread->lock);
+  if (thread->woken) {
+    thread->woken = false;
+    spin_unlock(&thread->lock);
+    return;
+  }
+  thread->state = THREAD_BLOCKED;
+  spin_unlock(&thread->lock);
+  schedule();
+}
+
+void thread_wake(thread_t *thread) {
+  uint32_t flags = interrupts_save();
+  spin_lock(&thread->lock);
+  if (thread->state != THREAD_BLOCKED) {
+    thread->woken = true;
+    spin_unlock(&thread->lock);
+    interrupts_restore(flags);
+    return;
+  }
+  thread->state = THREAD_RUNNABLE;
+  spin_unlock(&thread->lock);
+  // It blocked on another CPU, which may not be off its stack yet.
+  while (__atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE)) {
+    cpu_relax();
+  }
+  activate(thread);
+  interrupts_restore(flags);
+  preempt_check();
+}
+
+static void wake_sleeper(hrtimer_t *timer) { thread_wake(timer->data); }
+
+void thread_sleep(uint64_t ns) {
+  hrtimer_t timer;
+  hrtimer_init(&timer, wake_sleeper, current());
+  uint32_t flags = interrupts_save();
+  if (hrtimer_start(&timer, timer_ns() + ns)) {
+    while (hrtimer_pending(&timer)) {
+      thread_block();
+    }
+    // wake_sleeper() may still be running on another CPU, with the timer
+    // on this stack.
+    hrtimer_cancel(&timer);
+  }
+  interrupts_restore(flags);
+}
+
+bool thread_may_block(void) {
+  const thread_t *thread = current();
+  return thread != NULL && thread->priority != THREAD_PRIORITY_IDLE && this_cpu_read(preempt_count) == 0 &&
+         interrupts_enabled();
+}
+
+void thread_exit(void) {
+  interrupts_disable();
+  thread_t *thread = current();
+  spin_lock(&threads_lock);
+  thread_t **link = &all;
+  while (*link != thread) {
+    link = &(*link)->next_all;
+  }
+  *link = thread->next_all;
+  spin_unlock(&threads_lock);
+  thread->state = THREAD_DEAD;
+  schedule();
+  __builtin_unreachable();
+}
+
+void preempt_disable(void) { this_cpu_add(preempt_count, 1); }
+
+void preempt_enable(void) {
+  this_cpu_add(preempt_count, -1);
+  preempt_check();
+}
+
+void thread_preempt(void) {
+  percpu_t *cpu = this_cpu();
+  if (cpu->need_resched && cpu->preempt_count == 0 && cpu->thread != NULL) {
+    schedule();
+  }
+}
+
+void sched_stats(uint32_t cpu, sched_stats_t *stats) {
+  const cpu_sched_t *sched = &scheds[cpu];
+  stats->queued = sched->queued;
+  stats->switches = sched->switches;
+  stats->steals = sched->steals;
+  stats->stolen = sched->stolen;
+}
+
+// Bytes of the stack that were ever used.
+static uint32_t stack_used(const thread_t *thread) {
+  uint32_t words = THREAD_STACK_SIZE / 4;
+  uint32_t i = 1;
+  while (i < words && thread->stack[i] == 0) {
+    i++;
+  }
+  return (words - i) * 4;
+}
+
+void thread_dump(void) {
+  uint32_t flags = interrupts_save();
+  for (uint32_t cpu = 0; cpu < smp_cpus(); cpu++) {
+    sched_stats_t stats;
+    sched_stats(cpu, &stats);
+    kprintf("cpu %u: %u queued, %u switches, %u steals, %u stolen\n", cpu, stats.queued, stats.switches,
+            stats.steals, stats.stolen);
+  }
+  spin_lock(&threads_lock);
+  uint64_t now = timer_ns();
+  for (thread_t *thread = all; thread != NULL; thread = thread->next_all) {
+    uint64_t runtime = thread->runtime_ns;
+    if (thread->state == THREAD_RUNNING) {
+      runtime += now - scheds[thread->cpu].switched_in;
+    }
+    kprintf("%u %s: priority %u, %s on cpu %u, %u ms, %u switches", thread->id, thread->name, thread->priority,
+            state_names[thread->state], thread->cpu, (uint32_t)div64(runtime, 1000000), thread->switches);
+    if (thread->stack != NULL) {
+      kprintf(", %u of %u B stack", stack_used(thread), THREAD_STACK_SIZE);
+    }
+    kprintf("\n");
+  }
+  spin_unlock(&threads_lock);
+  interrupts_restore(flags);
+}
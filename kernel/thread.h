@@ -0,0 +1,122 @@
+#ifndef KERNEL_THREAD_H
+#define KERNEL_THREAD_H
+
+#include "arch/x86/fpu.h"
+#include "kernel/preempt.h"
+#include "kernel/spinlock.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// As big as the boot stack.
+#define THREAD_STACK_SIZE 16384
+#define THREAD_NAME_LEN 16
+// How long a thread runs before the next one of its priority gets a turn.
+#define THREAD_SLICE_NS 10000000ull
+// A thread that ran this recently still has its data in that CPU's cache, so
+// another CPU looking for work rather takes one that did not.
+#define THREAD_CACHE_HOT_NS 500000ull
+
+// Affinity masks, a bit per CPU id.
+#define THREAD_CPU(id) (1u << (id))
+#define THREAD_ANY_CPU UINT32_MAX
+
+// Higher runs first. Threads of the same priority take turns.
+typedef enum thread_priority_t {
+  // Only the idle thread, which runs when nothing else can.
+  THREAD_PRIORITY_IDLE,
+  THREAD_PRIORITY_LOW,
+  THREAD_PRIORITY_NORMAL,
+  THREAD_PRIORITY_HIGH,
+  THREAD_PRIORITIES,
+} thread_priority_t;
+
+typedef enum thread_state_t {
+  THREAD_RUNNING,
+  THREAD_RUNNABLE,
+  THREAD_BLOCKED,
+  THREAD_DEAD,
+} thread_state_t;
+
+typedef void (*thread_func_t)(void *data);
+
+typedef struct thread_t thread_t;
+struct thread_t {
+  // Saved by switch_stack() while the thread is not running.
+  uint32_t esp;
+  uint32_t id;
+  char name[THREAD_NAME_LEN];
+  thread_priority_t priority;
+  // Guards `state` and `woken` against wake-ups from other CPUs.
+  spinlock_t lock;
+  thread_state_t state;
+  // A thread_wake() that came while it was not blocked, so the next
+  // thread_block() returns at once.
+  bool woken;
+  // Still on the stack of the CPU that switched away from it. No other CPU may
+  // run it until that is done.
+  bool on_cpu;
+  // The CPUs it may run on.
+  uint32_t affinity;
+  // The CPU it runs, is queued or last ran on.
+  uint32_t cpu;
+  // When it last stopped running, in timer_ns() time.
+  uint64_t last_ran;
+  thread_func_t func;
+  void *data;
+  // Bottom of the stack, NULL for the boot thread, whose stack is not ours.
+  uint32_t *stack;
+  fpu_state_t fpu;
+  // Next in its run queue.
+  thread_t *next;
+  // Next of all threads, for the dump.
+  thread_t *next_all;
+  uint64_t runtime_ns;
+  uint32_t switches;
+};
+
+typedef struct sched_stats_t {
+  // Runnable threads waiting in its queue.
+  uint32_t queued;
+  uint32_t switches;
+  // Threads it took from the queues of other CPUs, and other CPUs took from
+  // it.
+  uint32_t steals;
+  uint32_t stolen;
+} sched_stats_t;
+
+// Make the running flow of control, kernel_main, the idle thread of the boot
+// CPU. Threads start running when it blocks or is preempted.
+void sched_init(void);
+// The same for an application processor, from its start code.
+void sched_init_ap(void);
+// A thread that may run on the CPUs in `affinity`, at least one of them
+// online. NULL if there is no memory. Only from the boot CPU, which the
+// allocators need.
+thread_t *thread_create(const char *name, thread_priority_t priority, uint32_t affinity, thread_func_t func,
+                        void *data);
+thread_t *thread_current(void);
+// Let the other runnable threads of the same priority run first.
+void thread_yield(void);
+// Stop running until thread_wake(). Called with interrupts disabled, after
+// arranging the wake-up, so it cannot be missed. Returns with interrupts
+// disabled. A wake-up from another CPU may come before it blocks, or may be
+// one left over, so callers check again what they waited for.
+void thread_block(void);
+// Make a blocked thread runnable, on the CPU it last ran on if that one is
+// idle or no other is. Safe from interrupt handlers. A thread that is not
+// blocked does not block the next time.
+void thread_wake(thread_t *thread);
+void thread_sleep(uint64_t ns);
+// Whether the running code is a thread that may block: not an idle thread,
+// with preemption and interrupts enabled. Interrupt handlers run with
+// interrupts disabled, tasklets with preemption disabled.
+bool thread_may_block(void);
+__attribute__((noreturn)) void thread_exit(void);
+
+// Switch if a higher priority thread woke up or the slice ran out. Called on
+// interrupt exit, with interrupts disabled.
+void thread_preempt(void);
+void sched_stats(uint32_t cpu, sched_stats_t *stats);
+void thread_dump(void);
+
+#endif
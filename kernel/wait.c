@@ -0,0 +1,175 @@
+#include "wait.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/timer.h"
+#include "kernel/hrtimer.h"
+#include <stddef.h>
+
+void wait_queue_init_class(wait_queue_t *queue, lockstat_t *class) {
+  spin_init_class(&queue->lock, class);
+  queue->head = NULL;
+  queue->tail = NULL;
+}
+
+void wait_prepare(wait_queue_t *queue, wait_entry_t *entry, uint64_t ns) {
+  entry->thread = thread_current();
+  entry->woken = false;
+  entry->next = NULL;
+  entry->deadline = WAIT_FOREVER;
+  if (ns != WAIT_FOREVER) {
+    uint64_t now = timer_ns();
+    entry->deadline = ns < WAIT_FOREVER - now ? now + ns : WAIT_FOREVER;
+  }
+  uint32_t flags = spin_lock_irqsave(&queue->lock);
+  if (queue->tail == NULL) {
+    queue->head = entry;
+  } else {
+    queue->tail->next = entry;
+  }
+  queue->tail = entry;
+  spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+static void wake_waiter(hrtimer_t *timer) { thread_wake(timer->data); }
+
+bool wait_sleep(wait_entry_t *entry) {
+  bool timed = entry->deadline != WAIT_FOREVER;
+  if (timed && timer_ns() >= entry->deadline) {
+    return false;
+  }
+  hrtimer_t timer;
+  hrtimer_init(&timer, wake_waiter, entry->thread);
+  uint32_t flags = interrupts_save();
+  if (timed && !hrtimer_start(&timer, entry->deadline)) {
+    // No timer to wake us, check back after the others had a turn.
+    interrupts_restore(flags);
+    thread_yield();
+    return true;
+  }
+  // A wake-up since the condition was checked left the thread's woken token,
+  // so this returns at once and none is lost.
+  thread_block();
+  if (timed) {
+    // Also waits for wake_waiter() if it runs on another CPU, as the timer
+    // is on this stack.
+    hrtimer_cancel(&timer);
+  }
+  interrupts_restore(flags);
+  // Before the condition is checked again, so that wake_up_one() does not
+  // pass this one over while it goes back to sleep. Sequentially consistent,
+  // so the check cannot be done before the store is seen.
+  __atomic_store_n(&entry->woken, false, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+void wait_finish(wait_queue_t *queue, wait_entry_t *entry) {
+  uint32_t flags = spin_lock_irqsave(&queue->lock);
+  wait_entry_t *previous = NULL;
+  for (wait_entry_t *e = queue->head; e != NULL; previous = e, e = e->next) {
+    if (e != entry) {
+      continue;
+    }
+    if (previous == NULL) {
+      queue->head = e->next;
+    } else {
+      previous->next = e->next;
+    }
+    if (queue->tail == e) {
+      queue->tail = previous;
+    }
+    break;
+  }
+  spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+void wake_up(wait_queue_t *queue) {
+  uint32_t flags = spin_lock_irqsave(&queue->lock);
+  for (wait_entry_t *entry = queue->head; entry != NULL; entry = entry->next) {
+    __atomic_store_n(&entry->woken, true, __ATOMIC_RELAXED);
+    thread_wake(entry->thread);
+  }
+  spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+void wake_up_one(wait_queue_t *queue) {
+  uint32_t flags = spin_lock_irqsave(&queue->lock);
+  for (wait_entry_t *entry = queue->head; entry != NULL; entry = entry->next) {
+    if (!__atomic_load_n(&entry->woken, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&entry->woken, true, __ATOMIC_RELAXED);
+      thread_wake(entry->thread);
+      break;
+    }
+  }
+  spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+void completion_init_class(completion_t *completion, lockstat_t *class) {
+  completion->done = 0;
+  wait_queue_init_class(&completion->wait, class);
+}
+
+void completion_reinit(completion_t *completion) { __atomic_store_n(&completion->done, 0, __ATOMIC_RELAXED); }
+
+void complete(completion_t *completion) {
+  uint32_t done = __atomic_load_n(&completion->done, __ATOMIC_RELAXED);
+  // UINT32_MAX is complete_all(), which stays.
+  while (done != UINT32_MAX &&
+         !__atomic_compare_exchange_n(&completion->done, &done, done + 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  wake_up_one(&completion->wait);
+}
+
+void complete_all(completion_t *completion) {
+  __atomic_store_n(&completion->done, UINT32_MAX, __ATOMIC_RELEASE);
+  wake_up(&completion->wait);
+}
+
+// Take one completion, if there is one.
+static bool take(completion_t *completion) {
+  uint32_t done = __atomic_load_n(&completion->done, __ATOMIC_ACQUIRE);
+  while (done != 0) {
+    if (done == UINT32_MAX ||
+        __atomic_compare_exchange_n(&completion->done, &done, done - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void completion_wait(completion_t *completion) { wait_event(&completion->wait, take(completion)); }
+
+bool completion_wait_timeout(completion_t *completion, uint64_t ns) {
+  return wait_event_timeout(&completion->wait, take(completion), ns);
+}
+
+void semaphore_init_class(semaphore_t *semaphore, uint32_t count, lockstat_t *class) {
+  semaphore->count = count;
+  wait_queue_init_class(&semaphore->wait, class);
+}
+
+bool semaphore_trydown(semaphore_t *semaphore) {
+  uint32_t count = __atomic_load_n(&semaphore->count, __ATOMIC_ACQUIRE);
+  while (count != 0) {
+    if (__atomic_compare_exchange_n(&semaphore->count, &count, count - 1, true, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_ACQUIRE)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void semaphore_down(semaphore_t *semaphore) { wait_event(&semaphore->wait, semaphore_trydown(semaphore)); }
+
+void semaphore_down_or_spin(semaphore_t *semaphore) {
+  if (thread_may_block()) {
+    semaphore_down(semaphore);
+    return;
+  }
+  while (!semaphore_trydown(semaphore)) {
+    cpu_relax();
+  }
+}
+
+void semaphore_up(semaphore_t *semaphore) {
+  __atomic_fetch_add(&semaphore->count, 1, __ATOMIC_RELEASE);
+  wake_up_one(&semaphore->wait);
+}
@@ -0,0 +1,108 @@
+#ifndef KERNEL_WAIT_H
+#define KERNEL_WAIT_H
+
+#include "kernel/spinlock.h"
+#include "kernel/thread.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Wait for as long as it takes.
+#define WAIT_FOREVER UINT64_MAX
+
+// A waiting thread, on its own stack for as long as it waits.
+typedef struct wait_entry_t {
+  thread_t *thread;
+  // Set by the wake-up, so wake_up_one() passes on to the next waiter.
+  bool woken;
+  // When to give up, in timer_ns() time.
+  uint64_t deadline;
+  struct wait_entry_t *next;
+} wait_entry_t;
+
+// Threads waiting for something an interrupt handler or another thread does,
+// woken in the order they came.
+typedef struct wait_queue_t {
+  spinlock_t lock;
+  wait_entry_t *head;
+  wait_entry_t *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT(name) {.lock = SPINLOCK_INIT(name)}
+
+#define wait_queue_init(queue, name) wait_queue_init_class((queue), LOCKSTAT_CLASS(name))
+void wait_queue_init_class(wait_queue_t *queue, lockstat_t *class);
+
+// Block the running thread until `condition` holds, for at most `ns`
+// nanoseconds. Returns whether it holds. The condition is checked after
+// joining the queue, so a wake-up that comes after setting it is not lost.
+// Only from threads that may block, see thread_may_block().
+#define wait_event_timeout(queue, condition, ns)                                                                       \
+  ({                                                                                                                   \
+    wait_entry_t entry_;                                                                                               \
+    wait_prepare((queue), &entry_, (ns));                                                                              \
+    bool done_;                                                                                                        \
+    while (!(done_ = (condition))) {                                                                                   \
+      if (!wait_sleep(&entry_)) {                                                                                      \
+        done_ = (condition);                                                                                           \
+        break;                                                                                                         \
+      }                                                                                                                \
+    }                                                                                                                  \
+    wait_finish((queue), &entry_);                                                                                     \
+    done_;                                                                                                             \
+  })
+
+#define wait_event(queue, condition) ((void)wait_event_timeout((queue), (condition), WAIT_FOREVER))
+
+// The steps of wait_event_timeout().
+void wait_prepare(wait_queue_t *queue, wait_entry_t *entry, uint64_t ns);
+// Block until woken, returning false without blocking once the deadline has
+// passed.
+bool wait_sleep(wait_entry_t *entry);
+void wait_finish(wait_queue_t *queue, wait_entry_t *entry);
+
+// Wake every waiter, or the first one not woken yet. Safe from interrupt
+// handlers.
+void wake_up(wait_queue_t *queue);
+void wake_up_one(wait_queue_t *queue);
+
+// Something that happens, like a disk command finishing. Each complete() lets
+// one wait through, complete_all() lets every wait through until reinit.
+typedef struct completion_t {
+  uint32_t done;
+  wait_queue_t wait;
+} completion_t;
+
+#define COMPLETION_INIT(name) {.wait = WAIT_QUEUE_INIT(name)}
+
+#define completion_init(completion, name) completion_init_class((completion), LOCKSTAT_CLASS(name))
+void completion_init_class(completion_t *completion, lockstat_t *class);
+// Forget the completions nobody waited for, before starting over.
+void completion_reinit(completion_t *completion);
+void complete(completion_t *completion);
+void complete_all(completion_t *completion);
+void completion_wait(completion_t *completion);
+// Returns false if `ns` nanoseconds passed first.
+bool completion_wait_timeout(completion_t *completion, uint64_t ns);
+
+// A counting semaphore: down() waits until the count is above 0 and takes
+// one, up() gives one back.
+typedef struct semaphore_t {
+  uint32_t count;
+  wait_queue_t wait;
+} semaphore_t;
+
+#define SEMAPHORE_INIT(name, n) {.count = (n), .wait = WAIT_QUEUE_INIT(name)}
+
+#define semaphore_init(semaphore, n, name) semaphore_init_class((semaphore), (n), LOCKSTAT_CLASS(name))
+void semaphore_init_class(semaphore_t *semaphore, uint32_t count, lockstat_t *class);
+void semaphore_down(semaphore_t *semaphore);
+// semaphore_down() for code that may also run where it cannot block, see
+// thread_may_block(). There it spins, which only ends if the holder is not
+// asleep on this CPU.
+void semaphore_down_or_spin(semaphore_t *semaphore);
+// Take one without waiting. Returns false if there was none.
+bool semaphore_trydown(semaphore_t *semaphore);
+// Safe from interrupt handlers.
+void semaphore_up(semaphore_t *semaphore);
+
+#endif
@@ -1,14 +1,456 @@
 #include "mem.h"
+#include "arch/x86/alternative.h"
+#include "arch/x86/cpu.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Below this the cost of saving SSE registers is not won back.
+#define SSE_MIN_SIZE 256
+#define SSE_MIN_SCAN 64
+
+// The variants are called from patch sites with their arguments in eax, edx
+// and ecx, so a site is a single call instruction.
+#define MEM_CALL __attribute__((regparm(3)))
+
+typedef MEM_CALL void copy_fn(uint8_t *dest, const uint8_t *source, size_t n);
+typedef MEM_CALL void set_fn(uint8_t *dest, uint8_t value, size_t n);
+typedef MEM_CALL int compare_fn(const uint8_t *a, const uint8_t *b, size_t n);
+typedef MEM_CALL const uint8_t *find_fn(const uint8_t *p, uint8_t value, size_t n);
+
+static void copy_bytes(uint8_t *dest, const uint8_t *source, size_t n) {
+  while (n--) {
+    *dest++ = *source++;
+  }
+}
+
+static void set_bytes(uint8_t *dest, uint8_t value, size_t n) {
+  while (n--) {
+    *dest++ = value;
+  }
+}
+
+static int compare_bytes(const uint8_t *a, const uint8_t *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (a[i] != b[i]) {
+      return a[i] - b[i];
+    }
+  }
+  return 0;
+}
+
+static const uint8_t *find_bytes(const uint8_t *p, uint8_t value, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (p[i] == value) {
+      return p + i;
+    }
+  }
+  return NULL;
+}
+
+// Align the destination with single bytes, then move whole words.
+static MEM_CALL void copy_words(uint8_t *dest, const uint8_t *source, size_t n) {
+  size_t head = -(uintptr_t)dest & 3;
+  if (head > n) {
+    head = n;
+  }
+  copy_bytes(dest, source, head);
+  dest += head;
+  source += head;
+  n -= head;
+  size_t words = n >> 2;
+  asm volatile("rep movsl" : "+D"(dest), "+S"(source), "+c"(words) : : "memory");
+  copy_bytes(dest, source, n & 3);
+}
+
+static MEM_CALL void set_words(uint8_t *dest, uint8_t value, size_t n) {
+  size_t head = -(uintptr_t)dest & 3;
+  if (head > n) {
+    head = n;
+  }
+  set_bytes(dest, value, head);
+  dest += head;
+  n -= head;
+  size_t words = n >> 2;
+  asm volatile("rep stosl" : "+D"(dest), "+c"(words) : "a"(value * 0x01010101u) : "memory");
+  set_bytes(dest, value, n & 3);
+}
+
+static MEM_CALL int compare_words(const uint8_t *a, const uint8_t *b, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n && *(const uint32_t *)(a + i) == *(const uint32_t *)(b + i); i += 4) {
+  }
+  return compare_bytes(a + i, b + i, n - i);
+}
+
+static MEM_CALL const uint8_t *find_words(const uint8_t *p, uint8_t value, size_t n) {
+  uint32_t pattern = value * 0x01010101u;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    // Some byte of x is zero iff this is non-zero.
+    uint32_t x = *(const uint32_t *)(p + i) ^ pattern;
+    if ((x - 0x01010101u) & ~x & 0x80808080u) {
+      break;
+    }
+  }
+  return find_bytes(p + i, value, n - i);
+}
+
+// Kernel code can be interrupted, or take a page fault, while it has data in
+// SSE registers and the handler may use them too. Every user saves the
+// registers it clobbers and restores them, so this nests.
+static inline void xmm_save(uint8_t *save) {
+  asm volatile("movdqu %%xmm0, 0(%0)\n\t"
+               "movdqu %%xmm1, 16(%0)\n\t"
+               "movdqu %%xmm2, 32(%0)\n\t"
+               "movdqu %%xmm3, 48(%0)"
+               :
+               : "r"(save)
+               : "memory");
+}
+
+static inline void xmm_restore(const uint8_t *save) {
+  asm volatile("movdqu 0(%0), %%xmm0\n\t"
+               "movdqu 16(%0), %%xmm1\n\t"
+               "movdqu 32(%0), %%xmm2\n\t"
+               "movdqu 48(%0), %%xmm3"
+               :
+               : "r"(save)
+               : "memory");
+}
+
+static MEM_CALL void copy_sse2(uint8_t *dest, const uint8_t *source, size_t n) {
+  if (n < SSE_MIN_SIZE) {
+    copy_words(dest, source, n);
+    return;
+  }
+  size_t head = -(uintptr_t)dest & 15;
+  copy_words(dest, source, head);
+  dest += head;
+  source += head;
+  n -= head;
+
+  uint8_t save[64];
+  xmm_save(save);
+  for (; n >= 64; n -= 64, dest += 64, source += 64) {
+    asm volatile("movdqu 0(%0), %%xmm0\n\t"
+                 "movdqu 16(%0), %%xmm1\n\t"
+                 "movdqu 32(%0), %%xmm2\n\t"
+                 "movdqu 48(%0), %%xmm3\n\t"
+                 "movdqa %%xmm0, 0(%1)\n\t"
+                 "movdqa %%xmm1, 16(%1)\n\t"
+                 "movdqa %%xmm2, 32(%1)\n\t"
+                 "movdqa %%xmm3, 48(%1)"
+                 :
+                 : "r"(source), "r"(dest)
+                 : "memory");
+  }
+  xmm_restore(save);
+  copy_words(dest, source, n);
+}
+
+static MEM_CALL void set_sse2(uint8_t *dest, uint8_t value, size_t n) {
+  if (n < SSE_MIN_SIZE) {
+    set_words(dest, value, n);
+    return;
+  }
+  size_t head = -(uintptr_t)dest & 15;
+  set_words(dest, value, head);
+  dest += head;
+  n -= head;
+
+  uint32_t pattern[4];
+  set_words((uint8_t *)pattern, value, sizeof(pattern));
+  uint8_t save[64];
+  xmm_save(save);
+  asm volatile("movdqu (%0), %%xmm0" : : "r"(pattern) : "memory");
+  for (; n >= 64; n -= 64, dest += 64) {
+    asm volatile("movdqa %%xmm0, 0(%0)\n\t"
+                 "movdqa %%xmm0, 16(%0)\n\t"
+                 "movdqa %%xmm0, 32(%0)\n\t"
+                 "movdqa %%xmm0, 48(%0)"
+                 :
+                 : "r"(dest)
+                 : "memory");
+  }
+  xmm_restore(save);
+  set_words(dest, value, n);
+}
+
+static MEM_CALL int compare_sse2(const uint8_t *a, const uint8_t *b, size_t n) {
+  if (n < SSE_MIN_SCAN) {
+    return compare_words(a, b, n);
+  }
+  uint8_t save[64];
+  xmm_save(save);
+  size_t i = 0;
+  uint32_t mask = 0xffff;
+  for (; i + 16 <= n; i += 16) {
+    asm volatile("movdqu (%1), %%xmm0\n\t"
+                 "movdqu (%2), %%xmm1\n\t"
+                 "pcmpeqb %%xmm1, %%xmm0\n\t"
+                 "pmovmskb %%xmm0, %0"
+                 : "=r"(mask)
+                 : "r"(a + i), "r"(b + i)
+                 : "memory");
+    if (mask != 0xffff) {
+      break;
+    }
+  }
+  xmm_restore(save);
+  if (mask != 0xffff) {
+    i += __builtin_ctz(~mask);
+    return a[i] - b[i];
+  }
+  return compare_bytes(a + i, b + i, n - i);
+}
+
+// Only aligned blocks are loaded, so nothing past the end of the page holding
+// the last byte is touched.
+static MEM_CALL const uint8_t *find_sse2(const uint8_t *p, uint8_t value, size_t n) {
+  if (n < SSE_MIN_SCAN) {
+    return find_words(p, value, n);
+  }
+  size_t head = -(uintptr_t)p & 15;
+  const uint8_t *found = find_bytes(p, value, head);
+  if (found != NULL) {
+    return found;
+  }
+  p += head;
+  n -= head;
+
+  uint32_t pattern[4];
+  set_words((uint8_t *)pattern, value, sizeof(pattern));
+  uint8_t save[64];
+  xmm_save(save);
+  asm volatile("movdqu (%0), %%xmm0" : : "r"(pattern) : "memory");
+  uint32_t mask = 0;
+  for (; n >= 16; n -= 16, p += 16) {
+    asm volatile("movdqa (%1), %%xmm1\n\t"
+                 "pcmpeqb %%xmm0, %%xmm1\n\t"
+                 "pmovmskb %%xmm1, %0"
+                 : "=r"(mask)
+                 : "r"(p)
+                 : "memory");
+    if (mask != 0) {
+      break;
+    }
+  }
+  xmm_restore(save);
+  if (mask != 0) {
+    return p + __builtin_ctz(mask);
+  }
+  return find_bytes(p, value, n);
+}
+
+// With ERMS, rep movsb and rep stosb beat anything hand-written.
+static MEM_CALL void copy_erms(uint8_t *dest, const uint8_t *source, size_t n) {
+  asm volatile("rep movsb" : "+D"(dest), "+S"(source), "+c"(n) : : "memory");
+}
+
+static MEM_CALL void set_erms(uint8_t *dest, uint8_t value, size_t n) {
+  asm volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(value) : "memory");
+}
+
+// Patch sites. Until alternatives_apply() runs they call the rep movsd
+// versions, which every i386 can run.
+static inline void copy(uint8_t *dest, const uint8_t *source, size_t n) {
+  asm volatile(ALTERNATIVE_2("call %P[words]", "call %P[sse2]", X86_FEATURE_SSE2, "call %P[erms]", X86_FEATURE_ERMS)
+               : "+a"(dest), "+d"(source), "+c"(n)
+               : [words] "i"(copy_words), [sse2] "i"(copy_sse2), [erms] "i"(copy_erms)
+               : "memory", "cc");
+}
+
+static inline void set(uint8_t *dest, uint8_t value, size_t n) {
+  uint32_t edx = value;
+  asm volatile(ALTERNATIVE_2("call %P[words]", "call %P[sse2]", X86_FEATURE_SSE2, "call %P[erms]", X86_FEATURE_ERMS)
+               : "+a"(dest), "+d"(edx), "+c"(n)
+               : [words] "i"(set_words), [sse2] "i"(set_sse2), [erms] "i"(set_erms)
+               : "memory", "cc");
+}
+
+static inline int compare(const uint8_t *a, const uint8_t *b, size_t n) {
+  uint32_t eax = (uint32_t)a;
+  asm volatile(ALTERNATIVE("call %P[words]", "call %P[sse2]", X86_FEATURE_SSE2)
+               : "+a"(eax), "+d"(b), "+c"(n)
+               : [words] "i"(compare_words), [sse2] "i"(compare_sse2)
+               : "memory", "cc");
+  return eax;
+}
+
+static inline const uint8_t *find(const uint8_t *p, uint8_t value, size_t n) {
+  uint32_t edx = value;
+  asm volatile(ALTERNATIVE("call %P[words]", "call %P[sse2]", X86_FEATURE_SSE2)
+               : "+a"(p), "+d"(edx), "+c"(n)
+               : [words] "i"(find_words), [sse2] "i"(find_sse2)
+               : "memory", "cc");
+  return p;
+}
 
 void memory_copy(char *source, char *dest, int nbytes) {
-  int i;
-  for (i = 0; i < nbytes; i++) {
-    *(dest + i) = *(source + i);
+  if (nbytes > 0) {
+    copy((uint8_t *)dest, (const uint8_t *)source, nbytes);
+  }
+}
+
+void memory_set(unsigned char *dest, unsigned char val, unsigned int len) { set(dest, val, len); }
+
+// Copying forwards is safe unless the destination starts inside the source.
+// Backwards copies move words from the top down after the unaligned tail.
+void *memmove(void *dest, const void *source, size_t n) {
+  uint8_t *d = dest;
+  const uint8_t *s = source;
+  if (d <= s || d >= s + n) {
+    copy(d, s, n);
+    return dest;
+  }
+  while (n & 3) {
+    n--;
+    d[n] = s[n];
+  }
+  if (n > 0) {
+    size_t words = n >> 2;
+    d += n - 4;
+    s += n - 4;
+    asm volatile("std\n\t"
+                 "rep movsl\n\t"
+                 "cld"
+                 : "+D"(d), "+S"(s), "+c"(words)
+                 :
+                 : "memory");
   }
+  return dest;
 }
 
-void memory_set(unsigned char *dest, unsigned char val, unsigned int len) {
-  unsigned char *temp = (unsigned char *)dest;
-  for (; len != 0; len--)
-    *temp++ = val;
-}
\ No newline at end of file
+int memcmp(const void *a, const void *b, size_t n) { return compare(a, b, n); }
+
+void *memchr(const void *p, int c, size_t n) { return (void *)find(p, (uint8_t)c, n); }
+
+#ifdef DEBUG
+#define TEST_SIZE 4200
+#define TEST_SLACK 32
+#define FEATURE_NONE 0xffffffff
+
+// The variants of a feature. Each one the CPU can run is checked against the
+// byte versions.
+typedef struct mem_impl_t {
+  uint32_t feature;
+  copy_fn *copy;
+  set_fn *set;
+  compare_fn *compare;
+  find_fn *find;
+} mem_impl_t;
+
+static const mem_impl_t impls[] = {
+    {FEATURE_NONE, copy_words, set_words, compare_words, find_words},
+    {X86_FEATURE_SSE2, copy_sse2, set_sse2, compare_sse2, find_sse2},
+    {X86_FEATURE_ERMS, copy_erms, set_erms, NULL, NULL},
+};
+
+static uint8_t expected[TEST_SIZE + TEST_SLACK];
+static uint8_t actual[TEST_SIZE + TEST_SLACK];
+static uint8_t source[TEST_SIZE + TEST_SLACK];
+
+static void fill(uint8_t *p, size_t n, uint32_t seed) {
+  for (size_t i = 0; i < n; i++) {
+    seed = seed * 1103515245 + 12345;
+    p[i] = seed >> 16;
+  }
+}
+
+static int sign(int x) { return (x > 0) - (x < 0); }
+
+// One size and alignment. Bytes around the range must not be touched.
+static bool check(const mem_impl_t *m, size_t n, size_t dest_align, size_t source_align) {
+  uint8_t *e = expected + dest_align;
+  uint8_t *a = actual + dest_align;
+  const uint8_t *s = source + source_align;
+  size_t total = sizeof(expected);
+
+  fill(expected, total, n);
+  fill(actual, total, n);
+  copy_bytes(e, s, n);
+  m->copy(a, s, n);
+  if (compare_bytes(expected, actual, total) != 0) {
+    return false;
+  }
+
+  set_bytes(e, n, n);
+  m->set(a, n, n);
+  if (compare_bytes(expected, actual, total) != 0) {
+    return false;
+  }
+
+  if (m->compare == NULL) {
+    return true;
+  }
+  // Equal ranges, then a difference at the start, middle and end.
+  copy_bytes(a, s, n);
+  if (m->compare(a, s, n) != 0) {
+    return false;
+  }
+  size_t at[] = {0, n / 2, n - 1};
+  for (size_t i = 0; i < 3 && n > 0; i++) {
+    a[at[i]] ^= 0x80;
+    if (sign(m->compare(a, s, n)) != sign(compare_bytes(a, s, n)) ||
+        sign(m->compare(s, a, n)) != sign(compare_bytes(s, a, n))) {
+      return false;
+    }
+    a[at[i]] ^= 0x80;
+  }
+
+  // A byte that is not in the range, then at the same places.
+  set_bytes(a, 0x5a, n);
+  a[n] = 0xa5;
+  if (m->find(a, 0xa5, n) != NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < 3 && n > 0; i++) {
+    a[at[i]] = 0xa5;
+    if (m->find(a, 0xa5, n) != find_bytes(a, 0xa5, n)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool mem_selftest(void) {
+  fill(source, sizeof(source), 1);
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (impls[i].feature != FEATURE_NONE && !cpu_has(impls[i].feature)) {
+      continue;
+    }
+    for (size_t n = 0; n <= TEST_SIZE; n += n < 300 ? 1 : 97) {
+      for (size_t dest_align = 0; dest_align < 16; dest_align++) {
+        for (size_t source_align = 0; source_align < 16; source_align += 5) {
+          if (!check(&impls[i], n, dest_align, source_align)) {
+            return false;
+          }
+        }
+      }
+    }
+  }
+
+  // Overlapping moves both ways.
+  for (size_t n = 0; n < 300; n += 7) {
+    for (size_t shift = 1; shift < 9; shift++) {
+      fill(expected, sizeof(expected), n);
+      fill(actual, sizeof(actual), n);
+      for (size_t i = n; i-- > 0;) {
+        expected[shift + i] = expected[i];
+      }
+      memmove(actual + shift, actual, n);
+      if (compare_bytes(expected, actual, sizeof(expected)) != 0) {
+        return false;
+      }
+      for (size_t i = 0; i < n; i++) {
+        expected[i] = expected[shift + i];
+      }
+      memmove(actual, actual + shift, n);
+      if (compare_bytes(expected, actual, sizeof(expected)) != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+#endif
@@ -1,7 +1,18 @@
 #ifndef MEM_H
 #define MEM_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 void memory_copy(char *source, char *dest, int nbytes);
 void memory_set(unsigned char *dest, unsigned char val, unsigned int len);
+// Like memory_copy, for ranges that may overlap.
+void *memmove(void *dest, const void *source, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
+void *memchr(const void *p, int c, size_t n);
+
+// Compare every implementation the CPU supports with the byte-at-a-time one.
+// Only built with DEBUG.
+bool mem_selftest(void);
 
-#endif
\ No newline at end of file
+#endif
@@ -32,16 +32,13 @@ int strlen(char s[]) {
   return i;
 }
 
+// Returns 1 if the strings are equal, in a single pass.
 int strcmp(char *s1, char *s2) {
-  int n1 = strlen(s1);
-  int n2 = strlen(s2);
-  if (n1 != n2)
-    return 0;
-  for (int i = 0; i < n1; i++) {
-    if (s1[i] != s2[i])
-      return 0;
+  while (*s1 != '\0' && *s1 == *s2) {
+    s1++;
+    s2++;
   }
-  return 1;
+  return *s1 == *s2;
 }
 
 void strcat(char *dest, char *src, int size) {
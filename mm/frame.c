@@ -0,0 +1,400 @@
+#include "frame.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/memory_map.h"
+#include "kernel/kprintf.h"
+#include "kernel/trace.h"
+#include "libc/mem.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FRAME_NONE 0xffffffff
+// First block of a free buddy. Only the first frame of a block is marked.
+#define FRAME_FREE (1 << 0)
+// Never handed to the allocator (low memory, kernel, holes in the map).
+#define FRAME_RESERVED (1 << 1)
+// Order of frames that do not start a block, so stray frees are caught.
+#define FRAME_NO_ORDER 0xff
+
+// Low memory holds the IVT, the BIOS data area, the boot loader and its stack.
+#define LOW_MEMORY_END 0x100000
+// Only RAM in the direct map can be reached by the kernel.
+#define PHYSICAL_LIMIT DIRECT_MAP_SIZE
+// Zeroed frames kept for frame_alloc_zeroed(). The pool is only refilled while
+// at least as many frames are left free.
+#define ZERO_POOL_SIZE 64
+
+// One descriptor per page frame, indexed by frame number. Free blocks of each
+// order are kept on a doubly linked list threaded through the descriptors.
+typedef struct frame_t {
+  uint32_t next;
+  uint32_t prev;
+  uint8_t order;
+  uint8_t flags;
+  // References to an allocated block, kept in its first frame.
+  uint16_t refs;
+} frame_t;
+
+typedef struct range_t {
+  uint32_t start;
+  uint32_t end;
+} range_t;
+
+// Provided by the linker script or the entry code.
+extern char _kernel_start[];
+extern char _end[];
+
+static frame_t *frames;
+static uint32_t n_frames;
+static uint32_t free_lists[FRAME_N_ORDERS];
+static uint32_t free_blocks[FRAME_N_ORDERS];
+static uint32_t free_pages;
+static uint32_t total_pages;
+// Allocated, zeroed single frames linked through `next`.
+static uint32_t zero_pool = FRAME_NONE;
+static frame_zero_stats_t zero_stats;
+
+static void list_push(uint32_t pfn, uint32_t order) {
+  frame_t *frame = &frames[pfn];
+  frame->order = order;
+  frame->flags |= FRAME_FREE;
+  frame->prev = FRAME_NONE;
+  frame->next = free_lists[order];
+  if (frame->next != FRAME_NONE) {
+    frames[frame->next].prev = pfn;
+  }
+  free_lists[order] = pfn;
+  free_blocks[order]++;
+  free_pages += 1u << order;
+}
+
+static void list_remove(uint32_t pfn, uint32_t order) {
+  frame_t *frame = &frames[pfn];
+  if (frame->prev != FRAME_NONE) {
+    frames[frame->prev].next = frame->next;
+  } else {
+    free_lists[order] = frame->next;
+  }
+  if (frame->next != FRAME_NONE) {
+    frames[frame->next].prev = frame->prev;
+  }
+  frame->flags &= ~FRAME_FREE;
+  free_blocks[order]--;
+  free_pages -= 1u << order;
+}
+
+// Return a block to the free lists, merging it with its buddy for as long as
+// the buddy is free as a whole.
+static void free_block(uint32_t pfn, uint32_t order) {
+  frames[pfn].order = FRAME_NO_ORDER;
+  while (order < FRAME_MAX_ORDER) {
+    uint32_t buddy = pfn ^ (1u << order);
+    if (buddy >= n_frames || !(frames[buddy].flags & FRAME_FREE) || frames[buddy].order != order) {
+      break;
+    }
+    list_remove(buddy, order);
+    frames[buddy].order = FRAME_NO_ORDER;
+    pfn &= ~(1u << order);
+    order++;
+  }
+  list_push(pfn, order);
+}
+
+// Release the frames in [start, end) in the largest aligned blocks that fit.
+static void free_frames(uint32_t start, uint32_t end) {
+  for (uint32_t pfn = start; pfn < end; pfn++) {
+    frames[pfn].flags &= ~FRAME_RESERVED;
+  }
+  total_pages += end - start;
+  while (start < end) {
+    uint32_t order = 0;
+    while (order < FRAME_MAX_ORDER && (start & (1u << order)) == 0 && start + (2u << order) <= end) {
+      order++;
+    }
+    free_block(start, order);
+    start += 1u << order;
+  }
+}
+
+// Free [start, end) minus the reserved ranges.
+static void free_frames_except(uint32_t start, uint32_t end, const range_t *reserved, size_t n_reserved) {
+  for (size_t i = 0; i < n_reserved; i++) {
+    if (reserved[i].start < end && start < reserved[i].end) {
+      if (start < reserved[i].start) {
+        free_frames_except(start, reserved[i].start, reserved + i + 1, n_reserved - i - 1);
+      }
+      if (reserved[i].end < end) {
+        free_frames_except(reserved[i].end, end, reserved + i + 1, n_reserved - i - 1);
+      }
+      return;
+    }
+  }
+  if (start < end) {
+    free_frames(start, end);
+  }
+}
+
+// Usable part of a region in whole frames, clamped to what we can address.
+static bool usable_frames(const memory_region_t *region, uint32_t *start, uint32_t *end) {
+  if (region->type != MEMORY_USABLE || region->base >= PHYSICAL_LIMIT) {
+    return false;
+  }
+  uint64_t region_end = region->base + region->length;
+  if (region_end > PHYSICAL_LIMIT) {
+    region_end = PHYSICAL_LIMIT;
+  }
+  *start = (region->base + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  *end = region_end >> PAGE_SHIFT;
+  return *start < *end;
+}
+
+void frame_init(void) {
+  const memory_map_t *map = memory_map_get();
+  uint32_t start, end;
+
+  for (size_t order = 0; order < FRAME_N_ORDERS; order++) {
+    free_lists[order] = FRAME_NONE;
+    free_blocks[order] = 0;
+  }
+  free_pages = 0;
+  total_pages = 0;
+  zero_pool = FRAME_NONE;
+  zero_stats = (frame_zero_stats_t){0};
+
+  n_frames = 0;
+  for (size_t i = 0; i < map->n_regions; i++) {
+    if (usable_frames(&map->regions[i], &start, &end) && end > n_frames) {
+      n_frames = end;
+    }
+  }
+
+  // Place the descriptors in the first usable memory above the kernel.
+  uint32_t kernel_start = V2P(_kernel_start) >> PAGE_SHIFT;
+  uint32_t kernel_end = (V2P(_end) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  uint32_t low_end = LOW_MEMORY_END >> PAGE_SHIFT;
+  uint32_t n_descriptor_frames = (n_frames * sizeof(frame_t) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  frames = NULL;
+  for (size_t i = 0; i < map->n_regions && frames == NULL; i++) {
+    if (!usable_frames(&map->regions[i], &start, &end)) {
+      continue;
+    }
+    start = start > low_end ? start : low_end;
+    start = start > kernel_end || end <= kernel_start ? start : kernel_end;
+    if (start + n_descriptor_frames <= end) {
+      frames = P2V(start << PAGE_SHIFT);
+    }
+  }
+  if (frames == NULL) {
+    kprintf("frame: no room for %d frame descriptors\n", n_frames);
+    n_frames = 0;
+    return;
+  }
+
+  for (uint32_t pfn = 0; pfn < n_frames; pfn++) {
+    frames[pfn].next = FRAME_NONE;
+    frames[pfn].prev = FRAME_NONE;
+    frames[pfn].order = FRAME_NO_ORDER;
+    frames[pfn].flags = FRAME_RESERVED;
+    frames[pfn].refs = 0;
+  }
+
+  uint32_t descriptors = V2P(frames) >> PAGE_SHIFT;
+  range_t reserved[] = {
+      {0, low_end},
+      {kernel_start, kernel_end},
+      {descriptors, descriptors + n_descriptor_frames},
+  };
+  for (size_t i = 0; i < map->n_regions; i++) {
+    if (usable_frames(&map->regions[i], &start, &end)) {
+      free_frames_except(start, end, reserved, sizeof(reserved) / sizeof(reserved[0]));
+    }
+  }
+  TRACE("FRAME", 1, "%d frames, %d free, descriptors at %x", n_frames, free_pages, frames);
+}
+
+static uint32_t zero_pool_pop(void) {
+  uint32_t pfn = zero_pool;
+  zero_pool = frames[pfn].next;
+  frames[pfn].next = FRAME_NONE;
+  zero_stats.pooled--;
+  return pfn << PAGE_SHIFT;
+}
+
+// Give the zeroed frames back to the free lists when memory runs out.
+static void zero_pool_drain(void) {
+  while (zero_pool != FRAME_NONE) {
+    uint32_t pfn = zero_pool_pop() >> PAGE_SHIFT;
+    frames[pfn].refs = 0;
+    free_block(pfn, 0);
+  }
+  zero_stats.drains++;
+}
+
+static uint32_t alloc(uint32_t order) {
+  if (order > FRAME_MAX_ORDER) {
+    return 0;
+  }
+  uint32_t k = order;
+  while (k <= FRAME_MAX_ORDER && free_lists[k] == FRAME_NONE) {
+    k++;
+  }
+  if (k > FRAME_MAX_ORDER) {
+    if (zero_pool == FRAME_NONE) {
+      return 0;
+    }
+    if (order == 0) {
+      return zero_pool_pop();
+    }
+    zero_pool_drain();
+    return alloc(order);
+  }
+
+  uint32_t pfn = free_lists[k];
+  list_remove(pfn, k);
+  // Split the block, returning the upper halves to the free lists.
+  while (k > order) {
+    k--;
+    list_push(pfn + (1u << k), k);
+  }
+  frames[pfn].order = order;
+  frames[pfn].refs = 1;
+  return pfn << PAGE_SHIFT;
+}
+
+// Threads are preempted and interrupt handlers allocate too, so the free
+// lists, the zero pool and the reference counts only change with interrupts
+// off. Clearing a frame does not need them off.
+uint32_t frame_alloc(uint32_t order) {
+  uint32_t flags = interrupts_save();
+  uint32_t address = alloc(order);
+  interrupts_restore(flags);
+  return address;
+}
+
+uint32_t frame_alloc_zeroed(void) {
+  uint32_t flags = interrupts_save();
+  if (zero_pool != FRAME_NONE) {
+    zero_stats.hits++;
+    uint32_t address = zero_pool_pop();
+    interrupts_restore(flags);
+    return address;
+  }
+  uint32_t address = alloc(0);
+  if (address != 0) {
+    zero_stats.fallbacks++;
+  }
+  interrupts_restore(flags);
+  if (address != 0) {
+    memory_set(P2V(address), 0, PAGE_SIZE);
+  }
+  return address;
+}
+
+bool frame_zero_idle(void) {
+  uint32_t flags = interrupts_save();
+  uint32_t address = 0;
+  if (zero_stats.pooled < ZERO_POOL_SIZE && free_pages > ZERO_POOL_SIZE) {
+    address = alloc(0);
+  }
+  interrupts_restore(flags);
+  if (address == 0) {
+    return false;
+  }
+
+  memory_set(P2V(address), 0, PAGE_SIZE);
+  flags = interrupts_save();
+  uint32_t pfn = address >> PAGE_SHIFT;
+  frames[pfn].next = zero_pool;
+  zero_pool = pfn;
+  zero_stats.pooled++;
+  zero_stats.idle_zeroed++;
+  interrupts_restore(flags);
+  return true;
+}
+
+const frame_zero_stats_t *frame_zero_stats(void) { return &zero_stats; }
+
+void frame_free(uint32_t address, uint32_t order) {
+  uint32_t pfn = address >> PAGE_SHIFT;
+  if (address & (PAGE_SIZE - 1) || order > FRAME_MAX_ORDER || pfn >= n_frames || pfn & ((1u << order) - 1)) {
+    kprintf("frame: invalid free of %x order %d\n", address, order);
+    return;
+  }
+  uint32_t flags = interrupts_save();
+  if (frames[pfn].flags & (FRAME_FREE | FRAME_RESERVED) || frames[pfn].order != order) {
+    interrupts_restore(flags);
+    kprintf("frame: bad free of %x order %d\n", address, order);
+    return;
+  }
+  frames[pfn].refs = 0;
+  free_block(pfn, order);
+  interrupts_restore(flags);
+}
+
+// First frame of the allocated block at `address`, or FRAME_NONE.
+static uint32_t allocated_block(uint32_t address) {
+  uint32_t pfn = address >> PAGE_SHIFT;
+  if (address & (PAGE_SIZE - 1) || pfn >= n_frames || frames[pfn].flags & (FRAME_FREE | FRAME_RESERVED) ||
+      frames[pfn].order == FRAME_NO_ORDER) {
+    return FRAME_NONE;
+  }
+  return pfn;
+}
+
+void frame_ref(uint32_t address) {
+  uint32_t flags = interrupts_save();
+  uint32_t pfn = allocated_block(address);
+  if (pfn == FRAME_NONE || frames[pfn].refs == UINT16_MAX) {
+    interrupts_restore(flags);
+    kprintf("frame: bad reference to %x\n", address);
+    return;
+  }
+  frames[pfn].refs++;
+  interrupts_restore(flags);
+}
+
+void frame_unref(uint32_t address) {
+  uint32_t flags = interrupts_save();
+  uint32_t pfn = allocated_block(address);
+  if (pfn == FRAME_NONE) {
+    interrupts_restore(flags);
+    kprintf("frame: bad release of %x\n", address);
+    return;
+  }
+  if (--frames[pfn].refs == 0) {
+    free_block(pfn, frames[pfn].order);
+  }
+  interrupts_restore(flags);
+}
+
+uint32_t frame_refs(uint32_t address) {
+  uint32_t pfn = allocated_block(address);
+  return pfn == FRAME_NONE ? 0 : frames[pfn].refs;
+}
+
+int frame_block_order(uint32_t address) {
+  uint32_t pfn = allocated_block(address);
+  return pfn == FRAME_NONE ? -1 : frames[pfn].order;
+}
+
+uint32_t frame_order(uint32_t n_pages) {
+  uint32_t order = 0;
+  while ((1u << order) < n_pages) {
+    order++;
+  }
+  return order;
+}
+
+uint32_t frame_free_blocks(uint32_t order) { return order <= FRAME_MAX_ORDER ? free_blocks[order] : 0; }
+
+uint32_t frame_free_pages(void) { return free_pages; }
+
+uint32_t frame_total_pages(void) { return total_pages; }
+
+void frame_dump(void) {
+  kprintf("%u of %u pages free\n", free_pages, total_pages);
+  for (uint32_t order = 0; order <= FRAME_MAX_ORDER; order++) {
+    kprintf("order %d (%u KiB): %u free\n", order, (PAGE_SIZE >> 10) << order, free_blocks[order]);
+  }
+  kprintf("zero pool: %u/%u pages, %u hits, %u zeroed on demand, %u zeroed idle, %u drains\n", zero_stats.pooled,
+          ZERO_POOL_SIZE, zero_stats.hits, zero_stats.fallbacks, zero_stats.idle_zeroed, zero_stats.drains);
+}
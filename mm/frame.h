@@ -0,0 +1,59 @@
+#ifndef MM_FRAME_H
+#define MM_FRAME_H
+
+#include "arch/x86/paging.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Blocks range from 1 page (order 0) to 1024 pages (4 MiB).
+#define FRAME_MAX_ORDER 10
+#define FRAME_N_ORDERS (FRAME_MAX_ORDER + 1)
+
+// Hand all usable RAM in the direct map to the buddy allocator, except low
+// memory below 1 MiB and the kernel image.
+void frame_init(void);
+
+// Allocate 2^order physically contiguous, naturally aligned pages. Returns the
+// physical address, or 0 if there is no block large enough. The block is
+// reached through the direct map with P2V().
+uint32_t frame_alloc(uint32_t order);
+void frame_free(uint32_t address, uint32_t order);
+// Blocks start with one reference. Sharing a block takes another one and it is
+// freed when the last one is dropped.
+void frame_ref(uint32_t address);
+void frame_unref(uint32_t address);
+uint32_t frame_refs(uint32_t address);
+// Order of the allocated block starting at `address`, or -1 if there is none.
+int frame_block_order(uint32_t address);
+// Smallest order that holds `n_pages` pages.
+uint32_t frame_order(uint32_t n_pages);
+
+typedef struct frame_zero_stats_t {
+  // Zeroed frames waiting in the pool.
+  uint32_t pooled;
+  // Zeroed allocations served from the pool.
+  uint32_t hits;
+  // Zeroed allocations that found the pool empty and cleared the frame then.
+  uint32_t fallbacks;
+  // Frames cleared by frame_zero_idle().
+  uint32_t idle_zeroed;
+  // Times the pool was given back to satisfy an allocation.
+  uint32_t drains;
+} frame_zero_stats_t;
+
+// A single zeroed page, taken from the pool of frames cleared while idle when
+// there is one.
+uint32_t frame_alloc_zeroed(void);
+// Clear one frame for the pool. Called when there is nothing else to do, with
+// interrupts enabled. Returns false once the pool is full, so the caller can
+// halt.
+bool frame_zero_idle(void);
+const frame_zero_stats_t *frame_zero_stats(void);
+
+// Number of free blocks of exactly `order`.
+uint32_t frame_free_blocks(uint32_t order);
+uint32_t frame_free_pages(void);
+uint32_t frame_total_pages(void);
+void frame_dump(void);
+
+#endif
@@ -0,0 +1,92 @@
+#include "kmalloc.h"
+#include "frame.h"
+#include "kernel/kprintf.h"
+#include "libc/mem.h"
+#include "slab.h"
+#include <stdint.h>
+
+#define KMALLOC_MIN_SHIFT 3
+#define KMALLOC_N_CACHES 8
+
+static const char *names[KMALLOC_N_CACHES] = {
+    "kmalloc-8",   "kmalloc-16",  "kmalloc-32",  "kmalloc-64",
+    "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+static slab_cache_t caches[KMALLOC_N_CACHES];
+// Pages handed out for requests too large for the slab caches.
+static uint32_t large_pages;
+static uint32_t large_allocs;
+
+void kmalloc_init(void) {
+  for (size_t i = 0; i < KMALLOC_N_CACHES; i++) {
+    // kmalloc() charges the caller's tag instead.
+    slab_cache_init(&caches[i], names[i], 1 << (KMALLOC_MIN_SHIFT + i), MEMTAG_NONE);
+  }
+  large_pages = 0;
+  large_allocs = 0;
+}
+
+void *kmalloc_at(size_t size, memtag_t tag, const char *site) {
+  if (size == 0) {
+    return NULL;
+  }
+  if (size <= SLAB_MAX_OBJECT_SIZE) {
+    size_t i = 0;
+    while ((1u << (KMALLOC_MIN_SHIFT + i)) < size) {
+      i++;
+    }
+    void *p = slab_alloc(&caches[i]);
+    if (p == NULL) {
+      memstat_failed(tag);
+    } else {
+      memstat_alloc(tag, p, caches[i].object_size, site);
+    }
+    return p;
+  }
+
+  uint32_t order = frame_order((size + PAGE_SIZE - 1) >> PAGE_SHIFT);
+  uint32_t address = frame_alloc(order);
+  if (address == 0) {
+    memstat_failed(tag);
+    return NULL;
+  }
+  large_pages += 1u << order;
+  large_allocs++;
+  memstat_alloc(tag, P2V(address), PAGE_SIZE << order, site);
+  return P2V(address);
+}
+
+void *kzalloc_at(size_t size, memtag_t tag, const char *site) {
+  void *p = kmalloc_at(size, tag, site);
+  if (p != NULL) {
+    memory_set(p, 0, size);
+  }
+  return p;
+}
+
+void kfree(void *p, memtag_t tag) {
+  if (p == NULL) {
+    return;
+  }
+  slab_cache_t *cache = slab_cache_of(p);
+  if (cache != NULL) {
+    memstat_free(tag, p, cache->object_size);
+    slab_free(cache, p);
+    return;
+  }
+
+  int order = frame_block_order(V2P(p));
+  if (order < 0) {
+    kprintf("kfree: %x was not allocated\n", p);
+    return;
+  }
+  large_pages -= 1u << order;
+  large_allocs--;
+  memstat_free(tag, p, PAGE_SIZE << order);
+  frame_free(V2P(p), order);
+}
+
+void kmalloc_dump(void) {
+  slab_dump();
+  kprintf("large: %u allocations, %u pages\n", large_allocs, large_pages);
+}
@@ -0,0 +1,20 @@
+#ifndef MM_KMALLOC_H
+#define MM_KMALLOC_H
+
+#include "memstat.h"
+#include <stddef.h>
+
+// Requests up to SLAB_MAX_OBJECT_SIZE are served from power of two slab caches
+// (kmalloc-8 .. kmalloc-1024), larger ones get whole pages from the frame
+// allocator and are page aligned. Allocations are charged to `tag`, which
+// kfree() must be given again.
+void kmalloc_init(void);
+void *kmalloc_at(size_t size, memtag_t tag, const char *site);
+#define kmalloc(size, tag) kmalloc_at(size, tag, MEMSTAT_SITE)
+// Like kmalloc(), but the memory is zeroed.
+void *kzalloc_at(size_t size, memtag_t tag, const char *site);
+#define kzalloc(size, tag) kzalloc_at(size, tag, MEMSTAT_SITE)
+void kfree(void *p, memtag_t tag);
+void kmalloc_dump(void);
+
+#endif
@@ -0,0 +1,181 @@
+#include "memstat.h"
+#include "arch/x86/cpu.h"
+#include "kernel/kprintf.h"
+#include <stddef.h>
+
+static const char *names[MEMTAG_COUNT] = {
+    [MEMTAG_NONE] = "none",
+    [MEMTAG_SLAB] = "slab",
+    [MEMTAG_VM] = "vm",
+    [MEMTAG_BLOCK] = "block",
+    [MEMTAG_BUFFER_CACHE] = "buffer cache",
+    [MEMTAG_FILE] = "file",
+    [MEMTAG_PAGE_CACHE] = "page cache",
+    [MEMTAG_FSCK] = "fsck",
+    [MEMTAG_THREAD] = "thread",
+};
+// Only changed with atomic instructions, so allocators need no lock for them.
+static memstat_t stats[MEMTAG_COUNT];
+
+#ifdef DEBUG
+#define RECORD_SHIFT 11
+#define N_RECORDS (1 << RECORD_SHIFT)
+// Past this load new allocations are counted but not recorded.
+#define MAX_RECORDS (N_RECORDS * 3 / 4)
+
+typedef struct record_t {
+  const void *p;
+  const char *site;
+  uint32_t bytes;
+  memtag_t tag;
+} record_t;
+
+// Outstanding allocations, in an open addressed hash table with linear
+// probing. Free slots have p == NULL.
+static record_t records[N_RECORDS];
+static uint32_t n_records;
+static uint32_t untracked;
+
+static uint32_t slot(const void *p) { return ((uint32_t)p * 2654435761u) >> (32 - RECORD_SHIFT); }
+
+static void record(memtag_t tag, const void *p, uint32_t bytes, const char *site) {
+  uint32_t flags = interrupts_save();
+  if (n_records >= MAX_RECORDS) {
+    untracked++;
+  } else {
+    uint32_t i = slot(p);
+    while (records[i].p != NULL) {
+      i = (i + 1) & (N_RECORDS - 1);
+    }
+    records[i] = (record_t){.p = p, .site = site, .bytes = bytes, .tag = tag};
+    n_records++;
+  }
+  interrupts_restore(flags);
+}
+
+// Empty slot `i` and move later entries of its probe sequence back into it.
+static void remove_at(uint32_t i) {
+  uint32_t j = i;
+  while (1) {
+    records[i].p = NULL;
+    uint32_t home;
+    do {
+      j = (j + 1) & (N_RECORDS - 1);
+      if (records[j].p == NULL) {
+        return;
+      }
+      home = slot(records[j].p);
+    } while (i <= j ? i < home && home <= j : i < home || home <= j);
+    records[i] = records[j];
+    i = j;
+  }
+}
+
+// Drop the record of `p` and return the tag it was charged to.
+static memtag_t forget(memtag_t tag, const void *p) {
+  uint32_t flags = interrupts_save();
+  uint32_t i = slot(p);
+  while (records[i].p != NULL && records[i].p != p) {
+    i = (i + 1) & (N_RECORDS - 1);
+  }
+  if (records[i].p == NULL) {
+    if (untracked == 0) {
+      kprintf("memstat: %x freed as %s was not allocated\n", p, names[tag]);
+    }
+  } else {
+    if (records[i].tag != tag) {
+      kprintf("memstat: %x from %s freed as %s, not %s\n", p, records[i].site, names[tag], names[records[i].tag]);
+      tag = records[i].tag;
+    }
+    remove_at(i);
+    n_records--;
+  }
+  interrupts_restore(flags);
+  return tag;
+}
+#endif
+
+void memstat_alloc(memtag_t tag, const void *p, uint32_t bytes, const char *site) {
+  if (tag == MEMTAG_NONE) {
+    return;
+  }
+  memstat_t *stat = &stats[tag];
+  uint32_t now = __atomic_add_fetch(&stat->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stat->objects, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stat->allocs, 1, __ATOMIC_RELAXED);
+  uint32_t peak = __atomic_load_n(&stat->peak, __ATOMIC_RELAXED);
+  while (now > peak && !__atomic_compare_exchange_n(&stat->peak, &peak, now, true, __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED)) {
+  }
+#ifdef DEBUG
+  record(tag, p, bytes, site);
+#else
+  (void)p;
+  (void)site;
+#endif
+}
+
+void memstat_free(memtag_t tag, const void *p, uint32_t bytes) {
+  if (tag == MEMTAG_NONE) {
+    return;
+  }
+#ifdef DEBUG
+  tag = forget(tag, p);
+#else
+  (void)p;
+#endif
+  __atomic_sub_fetch(&stats[tag].bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&stats[tag].objects, 1, __ATOMIC_RELAXED);
+}
+
+void memstat_failed(memtag_t tag) { __atomic_add_fetch(&stats[tag].failed, 1, __ATOMIC_RELAXED); }
+
+const memstat_t *memstat_get(memtag_t tag) { return &stats[tag]; }
+
+const char *memstat_name(memtag_t tag) { return names[tag]; }
+
+void memstat_dump(void (*print)(const char *format, ...)) {
+  uint32_t total = 0;
+  for (memtag_t tag = MEMTAG_NONE + 1; tag < MEMTAG_COUNT; tag++) {
+    const memstat_t *stat = &stats[tag];
+    total += stat->bytes;
+    print("%s: %u B in %u objects, peak %u B, %u allocs, %u failed\n", names[tag], stat->bytes, stat->objects,
+          stat->peak, stat->allocs, stat->failed);
+  }
+  print("total: %u KiB\n", total / 1024);
+}
+
+void memstat_leaks(memtag_t tag, void (*print)(const char *format, ...)) {
+#ifdef DEBUG
+  uint32_t flags = interrupts_save();
+  for (uint32_t i = 0; i < N_RECORDS; i++) {
+    const record_t *r = &records[i];
+    if (r->p == NULL || (tag != MEMTAG_NONE && r->tag != tag)) {
+      continue;
+    }
+    // Print each site once, at its first record.
+    bool first = true;
+    for (uint32_t j = 0; j < i && first; j++) {
+      first = records[j].p == NULL || records[j].site != r->site || records[j].tag != r->tag;
+    }
+    if (!first) {
+      continue;
+    }
+    uint32_t n = 0, bytes = 0;
+    for (uint32_t j = i; j < N_RECORDS; j++) {
+      if (records[j].p != NULL && records[j].site == r->site && records[j].tag == r->tag) {
+        n++;
+        bytes += records[j].bytes;
+      }
+    }
+    print("%s: %u outstanding, %u B (%s)\n", r->site, n, bytes, names[r->tag]);
+  }
+  if (untracked > 0) {
+    print("%u allocations were not recorded\n", untracked);
+  }
+  interrupts_restore(flags);
+#else
+  (void)tag;
+  print("allocations are only recorded in debug builds\n");
+#endif
+}
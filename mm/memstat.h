@@ -0,0 +1,57 @@
+#ifndef MM_MEMSTAT_H
+#define MM_MEMSTAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Who an allocation is charged to.
+typedef enum memtag_t {
+  // Not charged. For caches whose users charge what they take themselves.
+  MEMTAG_NONE,
+  // Descriptors of slab caches.
+  MEMTAG_SLAB,
+  MEMTAG_VM,
+  MEMTAG_BLOCK,
+  MEMTAG_BUFFER_CACHE,
+  MEMTAG_FILE,
+  MEMTAG_PAGE_CACHE,
+  MEMTAG_FSCK,
+  // Thread descriptors and stacks.
+  MEMTAG_THREAD,
+  MEMTAG_COUNT,
+} memtag_t;
+
+typedef struct memstat_t {
+  // Bytes taken, rounded up to the object or block actually handed out.
+  uint32_t bytes;
+  uint32_t objects;
+  // Most bytes ever taken at once.
+  uint32_t peak;
+  uint32_t allocs;
+  uint32_t failed;
+} memstat_t;
+
+#define MEMSTAT_STR_(x) #x
+#define MEMSTAT_STR(x) MEMSTAT_STR_(x)
+// Debug builds record every outstanding allocation with the file and line that
+// made it, for leak reports. Allocation macros pass this along.
+#ifdef DEBUG
+#define MEMSTAT_SITE __FILE__ ":" MEMSTAT_STR(__LINE__)
+#else
+#define MEMSTAT_SITE NULL
+#endif
+
+// Charge `bytes` at `p` to `tag`. Safe to call from interrupt handlers.
+void memstat_alloc(memtag_t tag, const void *p, uint32_t bytes, const char *site);
+void memstat_free(memtag_t tag, const void *p, uint32_t bytes);
+void memstat_failed(memtag_t tag);
+const memstat_t *memstat_get(memtag_t tag);
+const char *memstat_name(memtag_t tag);
+
+// Print the counters of every tag with `print`, kprintf or serial_printf.
+void memstat_dump(void (*print)(const char *format, ...));
+// Print the outstanding allocations of `tag`, or of all tags with MEMTAG_NONE,
+// grouped by call site. Only debug builds record them.
+void memstat_leaks(memtag_t tag, void (*print)(const char *format, ...));
+
+#endif
@@ -0,0 +1,203 @@
+#include "slab.h"
+#include "frame.h"
+#include "kernel/kprintf.h"
+#include "kernel/thread.h"
+#include "kernel/trace.h"
+#include <stdbool.h>
+
+#define SLAB_ALIGN 8
+// Empty slabs kept per cache before pages are given back to the frame
+// allocator, so a cache hovering around a slab boundary does not thrash.
+#define SLAB_MAX_EMPTY 1
+
+// Header at the start of every slab page, followed by the objects.
+struct slab_t {
+  slab_cache_t *cache;
+  slab_t *prev;
+  slab_t *next;
+  // Singly linked list of free objects, threaded through the objects.
+  void *free;
+  uint32_t in_use;
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+// Descriptors of caches made by slab_cache_create() come from this cache.
+static slab_cache_t cache_cache;
+static slab_cache_t *caches;
+
+static void list_add(slab_t **head, slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *head;
+  if (*head != NULL) {
+    (*head)->prev = slab;
+  }
+  *head = slab;
+}
+
+static void list_del(slab_t **head, slab_t *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    *head = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+static slab_t *slab_grow(slab_cache_t *cache) {
+  uint32_t address = frame_alloc(0);
+  if (address == 0) {
+    return NULL;
+  }
+  slab_t *slab = P2V(address);
+  slab->cache = cache;
+  slab->in_use = 0;
+  slab->free = NULL;
+  uint8_t *object = (uint8_t *)slab + SLAB_HEADER_SIZE + (cache->objects_per_slab - 1) * cache->object_size;
+  for (uint32_t i = 0; i < cache->objects_per_slab; i++) {
+    *(void **)object = slab->free;
+    slab->free = object;
+    object -= cache->object_size;
+  }
+  cache->n_slabs++;
+  return slab;
+}
+
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t object_size, memtag_t tag) {
+  if (object_size < sizeof(void *)) {
+    object_size = sizeof(void *);
+  }
+  cache->name = name;
+  cache->tag = tag;
+  cache->object_size = (object_size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+  cache->objects_per_slab = (PAGE_SIZE - SLAB_HEADER_SIZE) / cache->object_size;
+  cache->partial = NULL;
+  cache->full = NULL;
+  cache->empty = NULL;
+  cache->n_empty = 0;
+  cache->n_slabs = 0;
+  cache->n_active = 0;
+  cache->n_allocs = 0;
+  cache->n_frees = 0;
+  cache->n_failed = 0;
+  cache->next = caches;
+  caches = cache;
+}
+
+void slab_init(void) {
+  caches = NULL;
+  slab_cache_init(&cache_cache, "slab_cache", sizeof(slab_cache_t), MEMTAG_SLAB);
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t object_size, memtag_t tag) {
+  if (object_size > SLAB_MAX_OBJECT_SIZE) {
+    kprintf("slab: objects of %s are too large\n", name);
+    return NULL;
+  }
+  slab_cache_t *cache = slab_alloc(&cache_cache);
+  if (cache != NULL) {
+    slab_cache_init(cache, name, object_size, tag);
+  }
+  return cache;
+}
+
+static void *alloc(slab_cache_t *cache, const char *site) {
+  slab_t *slab = cache->partial;
+  if (slab == NULL) {
+    slab = cache->empty;
+    if (slab != NULL) {
+      list_del(&cache->empty, slab);
+      cache->n_empty--;
+    } else if ((slab = slab_grow(cache)) == NULL) {
+      cache->n_failed++;
+      memstat_failed(cache->tag);
+      return NULL;
+    }
+    list_add(&cache->partial, slab);
+  }
+
+  void *object = slab->free;
+  slab->free = *(void **)object;
+  slab->in_use++;
+  if (slab->in_use == cache->objects_per_slab) {
+    list_del(&cache->partial, slab);
+    list_add(&cache->full, slab);
+  }
+  cache->n_active++;
+  cache->n_allocs++;
+  memstat_alloc(cache->tag, object, cache->object_size, site);
+  return object;
+}
+
+static void release(slab_cache_t *cache, void *object) {
+  slab_t *slab = (slab_t *)((uint32_t)object & ~(PAGE_SIZE - 1));
+  uint32_t offset = (uint8_t *)object - (uint8_t *)slab - SLAB_HEADER_SIZE;
+  if (slab->cache != cache || offset % cache->object_size != 0 ||
+      offset / cache->object_size >= cache->objects_per_slab) {
+    kprintf("slab: %x does not belong to %s\n", object, cache->name);
+    return;
+  }
+
+  if (slab->in_use == cache->objects_per_slab) {
+    list_del(&cache->full, slab);
+    list_add(&cache->partial, slab);
+  }
+  memstat_free(cache->tag, object, cache->object_size);
+  *(void **)object = slab->free;
+  slab->free = object;
+  slab->in_use--;
+  cache->n_active--;
+  cache->n_frees++;
+
+  if (slab->in_use == 0) {
+    list_del(&cache->partial, slab);
+    if (cache->n_empty < SLAB_MAX_EMPTY) {
+      list_add(&cache->empty, slab);
+      cache->n_empty++;
+    } else {
+      cache->n_slabs--;
+      frame_free(V2P(slab), 0);
+    }
+  }
+}
+
+// Threads share the caches, so none may be preempted halfway through a list
+// update.
+void *slab_alloc_at(slab_cache_t *cache, const char *site) {
+  preempt_disable();
+  void *object = alloc(cache, site);
+  preempt_enable();
+  return object;
+}
+
+void slab_free(slab_cache_t *cache, void *object) {
+  preempt_disable();
+  release(cache, object);
+  preempt_enable();
+}
+
+slab_cache_t *slab_cache_of(const void *object) {
+  if (((uint32_t)object & (PAGE_SIZE - 1)) == 0) {
+    return NULL;
+  }
+  return ((slab_t *)((uint32_t)object & ~(PAGE_SIZE - 1)))->cache;
+}
+
+static uint32_t list_length(const slab_t *slab) {
+  uint32_t n = 0;
+  for (; slab != NULL; slab = slab->next) {
+    n++;
+  }
+  return n;
+}
+
+void slab_dump(void) {
+  for (slab_cache_t *cache = caches; cache != NULL; cache = cache->next) {
+    kprintf("%s: %u B, %u/%u objects, %u slabs (%u partial, %u full, %u empty), %u allocs, %u frees, %u failed\n",
+            cache->name, cache->object_size, cache->n_active, cache->n_slabs * cache->objects_per_slab, cache->n_slabs,
+            list_length(cache->partial), list_length(cache->full), cache->n_empty, cache->n_allocs, cache->n_frees,
+            cache->n_failed);
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef MM_SLAB_H
+#define MM_SLAB_H
+
+#include "memstat.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest object a slab cache holds. Every slab is a single page that starts
+// with its slab_t header, so larger objects would waste most of the page.
+#define SLAB_MAX_OBJECT_SIZE 1024
+
+typedef struct slab_t slab_t;
+
+// A cache of equally sized objects carved out of page sized slabs. Slabs with
+// some free objects are kept on `partial`, so allocating and freeing are O(1).
+typedef struct slab_cache_t {
+  const char *name;
+  // Objects are charged to this tag.
+  memtag_t tag;
+  uint32_t object_size;
+  uint32_t objects_per_slab;
+  slab_t *partial;
+  slab_t *full;
+  slab_t *empty;
+  uint32_t n_empty;
+  // Statistics.
+  uint32_t n_slabs;
+  uint32_t n_active;
+  uint32_t n_allocs;
+  uint32_t n_frees;
+  uint32_t n_failed;
+  struct slab_cache_t *next;
+} slab_cache_t;
+
+void slab_init(void);
+// Create a named cache. `name` must outlive the cache.
+slab_cache_t *slab_cache_create(const char *name, size_t object_size, memtag_t tag);
+// Initialize a cache whose descriptor the caller provides.
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t object_size, memtag_t tag);
+void *slab_alloc_at(slab_cache_t *cache, const char *site);
+#define slab_alloc(cache) slab_alloc_at(cache, MEMSTAT_SITE)
+void slab_free(slab_cache_t *cache, void *object);
+// The cache an object was allocated from, or NULL if `object` is page aligned
+// and therefore not a slab object.
+slab_cache_t *slab_cache_of(const void *object);
+void slab_dump(void);
+
+#endif
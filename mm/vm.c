@@ -0,0 +1,562 @@
+#include "vm.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/isr.h"
+#include "frame.h"
+#include "kernel/kprintf.h"
+#include "kernel/thread.h"
+#include "kernel/trace.h"
+#include "libc/mem.h"
+#include "slab.h"
+
+#define PAGE_FAULT 14
+// Error code bits of a page fault.
+#define FAULT_PRESENT (1 << 0)
+#define FAULT_WRITE (1 << 1)
+#define FAULT_USER (1 << 2)
+
+#define KERNEL_PDE PDE_INDEX(KERNEL_VIRTUAL_BASE)
+
+static vm_space_t kernel_space;
+static vm_space_t *current;
+static slab_cache_t *space_cache;
+static slab_cache_t *area_cache;
+static vm_stats_t stats;
+
+static uint32_t page_flags(uint32_t flags) {
+  return PAGE_PRESENT | (flags & VM_WRITE ? PAGE_WRITE : 0) | (flags & VM_USER ? PAGE_USER : 0);
+}
+
+// Start of the page table after the one `address` is in.
+static uint32_t next_table(uint32_t address) { return (address & LARGE_PAGE_MASK) + LARGE_PAGE_SIZE; }
+
+static vm_area_t *find_area(vm_space_t *space, uint32_t address) {
+  for (vm_area_t *area = space->areas; area != NULL && area->start <= address; area = area->next) {
+    if (address < area->end) {
+      return area;
+    }
+  }
+  return NULL;
+}
+
+static vm_area_t *new_area(uint32_t start, uint32_t end, uint32_t flags) {
+  vm_area_t *area = slab_alloc(area_cache);
+  if (area != NULL) {
+    area->start = start;
+    area->end = end;
+    area->flags = flags;
+    area->ops = NULL;
+    area->object = NULL;
+    area->offset = 0;
+    area->next = NULL;
+  }
+  return area;
+}
+
+// A new area for [start, end) of `area`, referring to the same object.
+static vm_area_t *copy_area(const vm_area_t *area, uint32_t start, uint32_t end) {
+  vm_area_t *copy = new_area(start, end, area->flags);
+  if (copy != NULL && area->ops != NULL) {
+    copy->ops = area->ops;
+    copy->object = area->object;
+    copy->offset = area->offset + ((start - area->start) >> PAGE_SHIFT);
+    area->ops->open(copy);
+  }
+  return copy;
+}
+
+static void free_area(vm_area_t *area) {
+  if (area->ops != NULL) {
+    area->ops->close(area);
+  }
+  slab_free(area_cache, area);
+}
+
+static uint32_t object_index(const vm_area_t *area, uint32_t address) {
+  return area->offset + ((address - area->start) >> PAGE_SHIFT);
+}
+
+// Tell the object about a page written through a shared mapping.
+static void harvest_dirty(vm_space_t *space, vm_area_t *area, uint32_t address, pte_t *pte) {
+  if (area->ops != NULL && area->flags & VM_SHARED && *pte & PAGE_DIRTY) {
+    area->ops->dirty(area, object_index(area, address));
+    *pte &= ~PAGE_DIRTY;
+    paging_flush(space->directory, address);
+  }
+}
+
+// Drop the pages mapped in [start, end) of `area`.
+static void release_pages(vm_space_t *space, vm_area_t *area, uint32_t start, uint32_t end) {
+  for (uint32_t address = start; address < end;) {
+    pte_t *pte = paging_entry(space->directory, address, false);
+    if (pte == NULL) {
+      address = next_table(address);
+      continue;
+    }
+    if (*pte & PAGE_PRESENT) {
+      harvest_dirty(space, area, address, pte);
+      uint32_t frame = *pte & PAGE_MASK;
+      *pte = 0;
+      paging_flush(space->directory, address);
+      if (!(area->flags & VM_DEVICE)) {
+        frame_unref(frame);
+      }
+    }
+    address += PAGE_SIZE;
+  }
+}
+
+// Copy a kernel page directory entry made after the current space was
+// created. Returns false if there was nothing to copy.
+static bool sync_kernel(uint32_t address) {
+  pde_t entry = kernel_space.directory[PDE_INDEX(address)];
+  pde_t *pde = &current->directory[PDE_INDEX(address)];
+  if (current == &kernel_space || !(entry & PAGE_PRESENT) || *pde == entry) {
+    return false;
+  }
+  *pde = entry;
+  return true;
+}
+
+static bool zero_fill(vm_space_t *space, vm_area_t *area, uint32_t address) {
+  pte_t *pte = paging_entry(space->directory, address, true);
+  if (pte == NULL) {
+    return false;
+  }
+  // Nothing to do if the page is already there.
+  if (*pte & PAGE_PRESENT) {
+    return true;
+  }
+  uint32_t frame = frame_alloc_zeroed();
+  if (frame == 0) {
+    return false;
+  }
+  *pte = frame | page_flags(area->flags);
+  paging_flush(space->directory, address);
+  stats.zero_fills++;
+  return true;
+}
+
+// Map the page of the object behind `address`. Private mappings get it
+// copy-on-write, as the object keeps its own reference to the frame.
+// Interrupts are on while the object reads the page if `may_block`, so it can
+// sleep on the disk. The area may change meanwhile: if it did, the page is
+// left unmapped and the access faults again.
+static bool object_fill(vm_space_t *space, vm_area_t *area, uint32_t address, bool *major, bool may_block) {
+  pte_t *pte = paging_entry(space->directory, address, true);
+  if (pte == NULL) {
+    return false;
+  }
+  if (*pte & PAGE_PRESENT) {
+    return true;
+  }
+  // The copy holds on to the object in case the area is unmapped.
+  vm_area_t copy = *area;
+  copy.ops->open(&copy);
+  if (may_block) {
+    interrupts_enable();
+  }
+  uint32_t frame = copy.ops->page(&copy, object_index(&copy, address), major);
+  copy.ops->close(&copy);
+  if (may_block) {
+    interrupts_disable();
+  }
+  if (frame == 0) {
+    return false;
+  }
+  area = find_area(space, address);
+  pte = paging_entry(space->directory, address, false);
+  if (area == NULL || area->ops != copy.ops || area->object != copy.object ||
+      object_index(area, address) != object_index(&copy, address) || pte == NULL || *pte & PAGE_PRESENT) {
+    frame_unref(frame);
+    return true;
+  }
+  uint32_t flags = page_flags(area->flags);
+  if (!(area->flags & VM_SHARED) && flags & PAGE_WRITE) {
+    flags = (flags & ~PAGE_WRITE) | PAGE_COW;
+  }
+  *pte = frame | flags;
+  paging_flush(space->directory, address);
+  if (*major) {
+    stats.major_faults++;
+  } else {
+    stats.object_hits++;
+  }
+  return true;
+}
+
+static bool copy_on_write(vm_space_t *space, vm_area_t *area, uint32_t address) {
+  pte_t *pte = paging_entry(space->directory, address, false);
+  if (pte == NULL || !(*pte & PAGE_PRESENT) || !(*pte & PAGE_COW)) {
+    return false;
+  }
+  uint32_t frame = *pte & PAGE_MASK;
+  if (frame_refs(frame) > 1) {
+    uint32_t copy = frame_alloc(0);
+    if (copy == 0) {
+      return false;
+    }
+    memory_copy(P2V(frame), P2V(copy), PAGE_SIZE);
+    frame_unref(frame);
+    frame = copy;
+    stats.cow_copies++;
+  } else {
+    stats.cow_reuses++;
+  }
+  *pte = frame | page_flags(area->flags);
+  paging_flush(space->directory, address);
+  return true;
+}
+
+bool vm_fault(uint32_t address, uint32_t error, bool may_block) {
+  vm_space_t *space = address >= KERNEL_VIRTUAL_BASE ? &kernel_space : current;
+  if (space != current && sync_kernel(address)) {
+    stats.kernel_syncs++;
+    stats.minor_faults++;
+    return true;
+  }
+
+  vm_area_t *area = find_area(space, address);
+  bool valid = area != NULL && !(area->flags & VM_DEVICE) && (!(error & FAULT_WRITE) || area->flags & VM_WRITE) &&
+               (!(error & FAULT_USER) || area->flags & VM_USER);
+  bool major = false;
+  if (valid) {
+    if (error & FAULT_PRESENT) {
+      valid = error & FAULT_WRITE && copy_on_write(space, area, address);
+    } else if (area->ops == NULL) {
+      valid = zero_fill(space, area, address);
+    } else {
+      valid = object_fill(space, area, address, &major, may_block);
+      // A private page written right away is copied right away. The area
+      // may have changed while the page was read.
+      area = find_area(space, address);
+      pte_t *pte = paging_entry(space->directory, address, false);
+      if (valid && error & FAULT_WRITE && area != NULL && pte != NULL && *pte & PAGE_COW) {
+        valid = copy_on_write(space, area, address);
+      }
+    }
+  }
+  if (!valid) {
+    stats.invalid_faults++;
+    return false;
+  }
+  if (!major) {
+    stats.minor_faults++;
+  }
+  if (space != current) {
+    sync_kernel(address);
+  }
+  TRACE("VM", 2, "fault at %x, error %x", address, error);
+  return true;
+}
+
+static void page_fault(registers_t *r) {
+  uint32_t address = read_cr2();
+  if (vm_fault(address, r->err_code, r->eflags & EFLAGS_IF)) {
+    return;
+  }
+  kprintf("Page fault: %s of %x (%s) at eip %x\n", r->err_code & FAULT_WRITE ? "write" : "read", address,
+          r->err_code & FAULT_PRESENT ? "protection" : "not mapped", r->eip);
+  asm volatile("cli");
+  while (1) {
+    asm volatile("hlt");
+  }
+}
+
+void vm_init(void) {
+  kernel_space.directory = paging_kernel_directory();
+  kernel_space.areas = NULL;
+  current = &kernel_space;
+  space_cache = slab_cache_create("vm_space", sizeof(vm_space_t), MEMTAG_VM);
+  area_cache = slab_cache_create("vm_area", sizeof(vm_area_t), MEMTAG_VM);
+  register_interrupt_handler(PAGE_FAULT, page_fault);
+}
+
+vm_space_t *vm_kernel_space(void) { return &kernel_space; }
+
+vm_space_t *vm_current(void) { return current; }
+
+void vm_switch(vm_space_t *space) {
+  current = space;
+  paging_switch(space->directory);
+}
+
+vm_space_t *vm_space_create(void) {
+  vm_space_t *space = slab_alloc(space_cache);
+  if (space == NULL) {
+    return NULL;
+  }
+  uint32_t directory = frame_alloc(0);
+  if (directory == 0) {
+    slab_free(space_cache, space);
+    return NULL;
+  }
+  space->directory = P2V(directory);
+  space->areas = NULL;
+  memory_set((unsigned char *)space->directory, 0, KERNEL_PDE * sizeof(pde_t));
+  memory_copy((char *)&kernel_space.directory[KERNEL_PDE], (char *)&space->directory[KERNEL_PDE],
+              (PAGE_ENTRIES - KERNEL_PDE) * sizeof(pde_t));
+  return space;
+}
+
+// Share the pages touched in `area` of `space` with `clone`. Unless the area
+// is shared, writable pages become read-only in both until one of them
+// writes.
+static bool share_pages(vm_space_t *space, vm_space_t *clone, vm_area_t *area) {
+  for (uint32_t address = area->start; address < area->end;) {
+    pte_t *pte = paging_entry(space->directory, address, false);
+    if (pte == NULL) {
+      address = next_table(address);
+      continue;
+    }
+    if (*pte & PAGE_PRESENT) {
+      pte_t *copy = paging_entry(clone->directory, address, true);
+      if (copy == NULL) {
+        return false;
+      }
+      if (*pte & PAGE_WRITE && !(area->flags & VM_SHARED)) {
+        *pte = (*pte & ~PAGE_WRITE) | PAGE_COW;
+        paging_flush(space->directory, address);
+      }
+      *copy = *pte;
+      frame_ref(*pte & PAGE_MASK);
+    }
+    address += PAGE_SIZE;
+  }
+  return true;
+}
+
+vm_space_t *vm_space_clone(vm_space_t *space) {
+  if (space == &kernel_space) {
+    return NULL;
+  }
+  vm_space_t *clone = vm_space_create();
+  if (clone == NULL) {
+    return NULL;
+  }
+  vm_area_t **tail = &clone->areas;
+  for (vm_area_t *area = space->areas; area != NULL; area = area->next) {
+    vm_area_t *copy = copy_area(area, area->start, area->end);
+    if (copy == NULL) {
+      vm_space_destroy(clone);
+      return NULL;
+    }
+    *tail = copy;
+    tail = &copy->next;
+    if (!share_pages(space, clone, area)) {
+      vm_space_destroy(clone);
+      return NULL;
+    }
+  }
+  return clone;
+}
+
+void vm_space_destroy(vm_space_t *space) {
+  if (space == &kernel_space) {
+    return;
+  }
+  if (space == current) {
+    vm_switch(&kernel_space);
+  }
+  vm_unmap(space, 0, KERNEL_VIRTUAL_BASE);
+  for (uint32_t i = 0; i < KERNEL_PDE; i++) {
+    if (space->directory[i] & PAGE_PRESENT) {
+      frame_free(space->directory[i] & PAGE_MASK, 0);
+    }
+  }
+  frame_free(V2P(space->directory), 0);
+  slab_free(space_cache, space);
+}
+
+bool vm_map(vm_space_t *space, uint32_t start, uint32_t size, uint32_t flags) {
+  return vm_map_object(space, start, size, flags, NULL, NULL, 0);
+}
+
+bool vm_map_object(vm_space_t *space, uint32_t start, uint32_t size, uint32_t flags, const vm_ops_t *ops,
+                   void *object, uint32_t offset) {
+  uint32_t end = (start + size + PAGE_SIZE - 1) & PAGE_MASK;
+  start &= PAGE_MASK;
+  if (space == &kernel_space) {
+    flags &= ~VM_USER;
+    if (start < VMALLOC_START || end > VMALLOC_END) {
+      return false;
+    }
+  } else if (end > KERNEL_VIRTUAL_BASE) {
+    return false;
+  }
+  if (end <= start) {
+    return false;
+  }
+
+  vm_area_t **link = &space->areas;
+  while (*link != NULL && (*link)->end <= start) {
+    link = &(*link)->next;
+  }
+  if (*link != NULL && (*link)->start < end) {
+    return false;
+  }
+  vm_area_t *area = new_area(start, end, flags);
+  if (area == NULL) {
+    return false;
+  }
+  area->ops = ops;
+  area->object = object;
+  area->offset = offset;
+  area->next = *link;
+  *link = area;
+  return true;
+}
+
+void vm_unmap(vm_space_t *space, uint32_t start, uint32_t size) {
+  uint32_t end = (start + size + PAGE_SIZE - 1) & PAGE_MASK;
+  start &= PAGE_MASK;
+  vm_area_t **link = &space->areas;
+  while (*link != NULL && (*link)->start < end) {
+    vm_area_t *area = *link;
+    if (area->end <= start) {
+      link = &area->next;
+      continue;
+    }
+    uint32_t from = area->start > start ? area->start : start;
+    uint32_t to = area->end < end ? area->end : end;
+    if (from > area->start && to < area->end) {
+      // A hole in the middle, the end becomes an area of its own.
+      vm_area_t *tail = copy_area(area, to, area->end);
+      if (tail == NULL) {
+        kprintf("vm: out of memory unmapping %x\n", from);
+        return;
+      }
+      tail->next = area->next;
+      area->next = tail;
+    }
+    release_pages(space, area, from, to);
+    if (from == area->start && to == area->end) {
+      *link = area->next;
+      free_area(area);
+      continue;
+    }
+    if (from == area->start) {
+      area->offset = object_index(area, to);
+      area->start = to;
+    } else {
+      area->end = from;
+    }
+    link = &area->next;
+  }
+}
+
+void vm_sync(vm_space_t *space, uint32_t start, uint32_t size) {
+  uint32_t end = (start + size + PAGE_SIZE - 1) & PAGE_MASK;
+  start &= PAGE_MASK;
+  for (vm_area_t *area = space->areas; area != NULL && area->start < end; area = area->next) {
+    if (area->end <= start || area->ops == NULL || !(area->flags & VM_SHARED)) {
+      continue;
+    }
+    uint32_t to = area->end < end ? area->end : end;
+    for (uint32_t address = area->start > start ? area->start : start; address < to;) {
+      pte_t *pte = paging_entry(space->directory, address, false);
+      if (pte == NULL) {
+        address = next_table(address);
+        continue;
+      }
+      if (*pte & PAGE_PRESENT) {
+        harvest_dirty(space, area, address, pte);
+      }
+      address += PAGE_SIZE;
+    }
+    area->ops->sync(area);
+  }
+}
+
+uint32_t vm_find_free(vm_space_t *space, uint32_t size) {
+  uint32_t low = space == &kernel_space ? VMALLOC_START : VM_USER_START;
+  uint32_t high = space == &kernel_space ? VMALLOC_END : KERNEL_VIRTUAL_BASE;
+  if (size == 0 || size > high - low) {
+    return 0;
+  }
+  size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+  // First fit, with an unmapped guard page behind every area to catch
+  // overruns.
+  uint32_t start = low;
+  for (vm_area_t *area = space->areas; area != NULL; area = area->next) {
+    if (area->end + PAGE_SIZE <= start) {
+      continue;
+    }
+    if (area->start >= start && area->start - start >= size + PAGE_SIZE) {
+      break;
+    }
+    start = area->end + PAGE_SIZE;
+  }
+  return start > high - size ? 0 : start;
+}
+
+// Threads share the kernel space, finding room and taking it must not be
+// split by a switch.
+void *vmalloc_at(size_t size, memtag_t tag, const char *site) {
+  preempt_disable();
+  uint32_t start = vm_find_free(&kernel_space, size);
+  if (start == 0 || !vm_map(&kernel_space, start, size, VM_WRITE)) {
+    preempt_enable();
+    memstat_failed(tag);
+    return NULL;
+  }
+  preempt_enable();
+  memstat_alloc(tag, (void *)start, (size + PAGE_SIZE - 1) & PAGE_MASK, site);
+  return (void *)start;
+}
+
+void vfree(void *p, memtag_t tag) {
+  if (p == NULL) {
+    return;
+  }
+  preempt_disable();
+  vm_area_t *area = find_area(&kernel_space, (uint32_t)p);
+  if (area == NULL || area->start != (uint32_t)p) {
+    preempt_enable();
+    kprintf("vfree: %x was not allocated\n", p);
+    return;
+  }
+  memstat_free(tag, p, area->end - area->start);
+  vm_unmap(&kernel_space, area->start, area->end - area->start);
+  preempt_enable();
+}
+
+void *vm_map_device(uint32_t physical, uint32_t size, memtype_t type) {
+  uint32_t offset = physical & ~PAGE_MASK;
+  physical &= PAGE_MASK;
+  size = (offset + size + PAGE_SIZE - 1) & PAGE_MASK;
+  preempt_disable();
+  uint32_t start = vm_find_free(&kernel_space, size);
+  if (start == 0 || !vm_map(&kernel_space, start, size, VM_WRITE | VM_DEVICE)) {
+    preempt_enable();
+    return NULL;
+  }
+  uint32_t flags = PAGE_WRITE | memtype_flags(physical, size, type);
+  if (!paging_map(kernel_space.directory, start, physical, size, flags)) {
+    vm_unmap(&kernel_space, start, size);
+    start = 0;
+  }
+  preempt_enable();
+  return start == 0 ? NULL : (void *)(start + offset);
+}
+
+void vm_unmap_device(void *p) { vfree((void *)((uint32_t)p & PAGE_MASK), MEMTAG_NONE); }
+
+const vm_stats_t *vm_stats(void) { return &stats; }
+
+static void dump_areas(const char *name, vm_space_t *space) {
+  for (vm_area_t *area = space->areas; area != NULL; area = area->next) {
+    kprintf("%s: %x - %x %s%s%s%s\n", name, area->start, area->end - 1, area->flags & VM_WRITE ? "rw" : "ro",
+            area->flags & VM_USER ? " user" : "", area->flags & VM_SHARED ? " shared" : "",
+            area->ops != NULL ? " object" : area->flags & VM_DEVICE ? " device" : "");
+  }
+}
+
+void vm_dump(void) {
+  kprintf("minor faults: %u (%u zero-filled, %u copied, %u reused, %u cached), %u kernel syncs\n", stats.minor_faults,
+          stats.zero_fills, stats.cow_copies, stats.cow_reuses, stats.object_hits, stats.kernel_syncs);
+  kprintf("major faults: %u, invalid: %u\n", stats.major_faults, stats.invalid_faults);
+  dump_areas("kernel", &kernel_space);
+  if (current != &kernel_space) {
+    dump_areas("current", current);
+  }
+}
@@ -0,0 +1,127 @@
+#ifndef MM_VM_H
+#define MM_VM_H
+
+#include "arch/x86/memtype.h"
+#include "arch/x86/paging.h"
+#include "memstat.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernel virtual addresses above the direct map handed out by vmalloc(). The
+// top 8 MiB are left for fixed mappings.
+#define VMALLOC_START (KERNEL_VIRTUAL_BASE + DIRECT_MAP_SIZE)
+#define VMALLOC_END 0xff800000
+
+// Where vm_find_free() looks for room in user spaces.
+#define VM_USER_START 0x40000000
+
+#define VM_WRITE (1 << 0)
+#define VM_USER (1 << 1)
+// Writes go to the object and clones share the pages, instead of getting
+// private copies.
+#define VM_SHARED (1 << 2)
+// Maps device memory given at creation. The frames are not the allocator's
+// and faults in it are invalid.
+#define VM_DEVICE (1 << 3)
+
+typedef struct vm_area_t vm_area_t;
+
+// What backs an area that maps an object, like a file, instead of anonymous
+// memory. Indices are in pages from the start of the object.
+typedef struct vm_ops_t {
+  // The frame holding page `index`, with a reference taken for the mapping,
+  // or 0 if there is none. Sets `major` if the page had to be read.
+  uint32_t (*page)(vm_area_t *area, uint32_t index, bool *major);
+  // A shared mapping wrote to page `index`.
+  void (*dirty)(vm_area_t *area, uint32_t index);
+  // Write dirty pages back to the object.
+  void (*sync)(vm_area_t *area);
+  // Another area refers to the object, after a split or clone.
+  void (*open)(vm_area_t *area);
+  void (*close)(vm_area_t *area);
+} vm_ops_t;
+
+// A range of an address space. Nothing is mapped up front: pages are backed
+// by zeroed frames, or pages of the object, when they are first touched.
+struct vm_area_t {
+  uint32_t start;
+  uint32_t end;
+  uint32_t flags;
+  const vm_ops_t *ops;
+  void *object;
+  // Page of the object mapped at `start`.
+  uint32_t offset;
+  struct vm_area_t *next;
+};
+
+// Page directory plus its areas, sorted by address. User spaces have areas
+// below KERNEL_VIRTUAL_BASE and share the kernel mappings above it, the kernel
+// space holds the vmalloc areas.
+typedef struct vm_space_t {
+  pde_t *directory;
+  vm_area_t *areas;
+} vm_space_t;
+
+typedef struct vm_stats_t {
+  // Faults resolved without I/O.
+  uint32_t minor_faults;
+  // Faults that had to read the page of an object.
+  uint32_t major_faults;
+  // Object pages that were already in memory.
+  uint32_t object_hits;
+  uint32_t zero_fills;
+  uint32_t cow_copies;
+  // Write faults on copy-on-write pages nobody else shares any more.
+  uint32_t cow_reuses;
+  // Kernel page tables made after a space was created and copied into it.
+  uint32_t kernel_syncs;
+  uint32_t invalid_faults;
+} vm_stats_t;
+
+// Set up kernel space and take over the page fault exception.
+void vm_init(void);
+vm_space_t *vm_kernel_space(void);
+vm_space_t *vm_current(void);
+void vm_switch(vm_space_t *space);
+
+// A new, empty user address space.
+vm_space_t *vm_space_create(void);
+// A copy of `space`. Pages already touched are shared copy-on-write.
+vm_space_t *vm_space_clone(vm_space_t *space);
+void vm_space_destroy(vm_space_t *space);
+
+// Reserve [start, start + size) in `space`. Fails if the range overlaps an
+// area or, in a user space, reaches into kernel space.
+bool vm_map(vm_space_t *space, uint32_t start, uint32_t size, uint32_t flags);
+// Like vm_map, backed by pages of `object` from page `offset` on. Takes over
+// a reference to the object, dropped with ops->close.
+bool vm_map_object(vm_space_t *space, uint32_t start, uint32_t size, uint32_t flags, const vm_ops_t *ops,
+                   void *object, uint32_t offset);
+// Lowest free range of `size` bytes followed by an unmapped guard page, or 0.
+uint32_t vm_find_free(vm_space_t *space, uint32_t size);
+// Pass the pages written through shared mappings in [start, start + size) to
+// their objects and have them written back.
+void vm_sync(vm_space_t *space, uint32_t start, uint32_t size);
+// Release [start, start + size), splitting areas that are partly covered.
+void vm_unmap(vm_space_t *space, uint32_t start, uint32_t size);
+// Resolve a page fault at `address` with the error code pushed by the CPU.
+// `may_block` if the faulting code had interrupts on, so reading a page of a
+// mapped file may wait for the disk. Returns false if the access is invalid.
+bool vm_fault(uint32_t address, uint32_t error, bool may_block);
+
+// Map `size` bytes of device memory at `physical` into kernel space as `type`,
+// for memory outside the direct map or that needs another memory type.
+void *vm_map_device(uint32_t physical, uint32_t size, memtype_t type);
+void vm_unmap_device(void *p);
+
+// Zero-filled kernel memory that takes no frames until it is touched. The
+// whole range is charged to `tag` up front.
+void *vmalloc_at(size_t size, memtag_t tag, const char *site);
+#define vmalloc(size, tag) vmalloc_at(size, tag, MEMSTAT_SITE)
+void vfree(void *p, memtag_t tag);
+
+const vm_stats_t *vm_stats(void);
+void vm_dump(void);
+
+#endif
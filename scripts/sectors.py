@@ -19,8 +19,13 @@ print(stage2_sectors, kernel_sectors)
 if stage2_sectors > (0x1000 - 0x500) // 512:
     raise Exception("Stage 2 too large")
 
-if kernel_sectors > (0x80000 - 0x1000) // 512:
-    raise Exception("Kernel too large")
+# Stage 2 loads the kernel at 0x4000, below the real mode stack that stage 1
+# puts in the segment at 0x70000.
+KERNEL_OFFSET = 0x4000
+STACK_SEGMENT = 0x70000
+
+if kernel_sectors > (STACK_SEGMENT - KERNEL_OFFSET) // 512:
+    raise Exception("Kernel too large, it would overwrite the stage 2 stack")
 
 
 with open(args.stage1, "rb") as f: